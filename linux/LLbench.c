@@ -0,0 +1,448 @@
+/* EEEN20060 Communication Systems, Link Layer benchmark program
+   This program measures how well the link layer protocol works.
+   For each combination of block size, probability of error, number of
+   FEC parity bytes, bit rate and ARQ mode, it makes a pair of connected ports, then starts a child
+   process to receive on one end, while this process sends on the other.
+   Each block carries the time it was handed to the link layer, so the
+   receiver can measure the delay to deliver it.
+   The results are printed as CSV, one line for each run:
+       goodput      data bytes delivered per second
+       efficiency   goodput as a fraction of the line rate in bytes per
+                    second (bit rate / 10), blank at memory speed
+       retx/frame   frames sent again, per data block
+       latency      50th, 90th and 99th percentile and largest delay
+                    from LL_send to LL_receive, in ms
+   With the -t option, both ends use the link layer receive thread.
+   With the -l option, both ends use long frames, so blocks can be up to
+   MAX_JUMBO bytes.  With the -s option, both ends use wider sequence
+   numbers, so the window can be bigger.
+   With the -c option, the receiver spends that long on each block, like
+   a program that is slow to take its data, and with -q it holds at most
+   that many blocks, so the sender has to keep to its pace.
+   Messages from the link layer and physical layer are discarded,
+   unless the -v option is given.  Run with -h for the options.  */
+
+
+#include <stdio.h>      // standard input-output library
+#include <string.h>     // needed for string manipulation
+#include <stdlib.h>     // needed for atoi(), qsort()
+#include <unistd.h>     // needed for fork(), pipe(), getopt()
+#include <signal.h>     // needed for kill()
+#include <sys/wait.h>   // needed for waitpid()
+#include "linklayer.h"  // link layer functions
+#include "physical.h"   // needed for PHY_makePair()
+
+#define MAX_LIST 10     // most values in each list to sweep
+#define MAX_PORT 40     // maximum length of port name
+#define STAMPSIZE 12    // bytes at start of block: send time and block number
+#define N_BYTES 10000   // default number of data bytes in each run
+
+// Results of one run, sent from the receiver to the sender through a pipe
+typedef struct
+{
+    int nBlocks;      // number of blocks received
+    int nBad;         // number of blocks damaged or out of order
+    double firstTx;   // time the first block was handed to the link layer
+    double lastRx;    // time the last block was received
+    double p50, p90, p99, pMax;  // latency percentiles, in seconds
+} benchResult;
+
+// Function prototypes
+int benchRun(const char *kind, int arq, int window, int fec, int sizeBlk,
+             double prob, long rate, long nBytes, int pauseMs, FILE *csv);
+int benchSend(int nBlocks, int sizeBlk, long nBytes);
+void benchReceive(int nBlocks, int sizeBlk, int pauseMs, int fdResult);
+void fillBlock(byte_t *block, int sizeBlk, int blockNum);
+double percentile(double *sorted, int n, double fraction);
+int compareDouble(const void *a, const void *b);
+int parseList(char *text, double *list);
+
+
+int main(int argc, char *argv[])
+{
+    double blkList[MAX_LIST] = {20, 70, 140, MAX_BLK};  // block sizes
+    double errList[MAX_LIST] = {0.0, 1.0E-4, PROB_ERR}; // probabilities of error
+    double rateList[MAX_LIST] = {0, 115200};  // bit rates, 0 for memory speed
+    double arqList[MAX_LIST] = {ARQ_STOPWAIT, ARQ_GOBACKN, ARQ_SELREPEAT};
+    double fecList[MAX_LIST] = {FEC_PARITY};  // numbers of FEC parity bytes
+    int nBlk = 4, nErr = 3, nRate = 2, nArq = 3, nFec = 1;  // number of values in lists
+    char *kind = "mem";       // kind of port pair: mem or pty
+    long nBytes = N_BYTES;    // data bytes to send in each run
+    int window = TX_WINDOW;   // sender window for the pipelined modes
+    int verbose = FALSE;      // keep messages from the lower layers
+    int rxThread = FALSE;     // use the link layer receive thread
+    int longFrames = FALSE;   // use long frames, for bigger blocks
+    int seqBits = SEQ_BITS;   // bits in sequence numbers
+    int rxBuffer = RX_BUFFER; // most blocks the receiver holds
+    int pauseMs = 0;          // time the receiver spends on each block, ms
+    int maxBlk;               // largest block size allowed
+    int b, e, f, r, a;        // for use in loops
+    int opt;                  // option letter from command line
+    int nFail = 0;            // number of runs that failed
+    FILE *csv;                // where the results go
+
+    while ((opt = getopt(argc, argv, "p:n:b:e:f:r:a:w:s:q:c:tlvh")) != -1)
+    {
+        switch (opt)
+        {
+            case 'p': kind = optarg; break;
+            case 'n': nBytes = atol(optarg); break;
+            case 'b': nBlk = parseList(optarg, blkList); break;
+            case 'e': nErr = parseList(optarg, errList); break;
+            case 'f': nFec = parseList(optarg, fecList); break;
+            case 'r': nRate = parseList(optarg, rateList); break;
+            case 'a': nArq = parseList(optarg, arqList); break;
+            case 'w': window = atoi(optarg); break;
+            case 's': seqBits = atoi(optarg); break;
+            case 'q': rxBuffer = atoi(optarg); break;
+            case 'c': pauseMs = atoi(optarg); break;
+            case 't': rxThread = TRUE; break;
+            case 'l': longFrames = TRUE; break;
+            case 'v': verbose = TRUE; break;
+            default:
+                printf("Usage: %s [-p mem|pty] [-n bytes] [-b sizes] [-e probs]\n"
+                       "          [-f parity] [-r rates] [-a modes] [-w window]\n"
+                       "          [-s bits] [-q blocks] [-c ms] [-t] [-l] [-v]\n"
+                       "Lists are separated by commas, e.g. -b 20,70,200\n"
+                       "-f gives numbers of FEC parity bytes, 0 for none\n"
+                       "Bit rate 0 means memory speed.  ARQ modes are\n"
+                       "%d stop-and-wait, %d Go-Back-N, %d selective repeat\n"
+                       "-t uses the receive thread at both ends\n"
+                       "-l uses long frames, for blocks up to %d bytes\n"
+                       "-s gives bits in sequence numbers: 4, 8 or 16,\n"
+                       "   for windows of up to %d frames\n"
+                       "-q gives the most blocks the receiver holds\n"
+                       "-c gives the time the receiver spends on each block\n",
+                       argv[0], ARQ_STOPWAIT, ARQ_GOBACKN, ARQ_SELREPEAT,
+                       MAX_JUMBO, MAX_WINDOW);
+                return (opt == 'h') ? 0 : 1;
+        }
+    }
+    if ((strcmp(kind, "mem") != 0) && (strcmp(kind, "pty") != 0))
+    {
+        printf("Bench: Port kind must be mem or pty, not %s\n", kind);
+        return 1;
+    }
+    if ((nBlk < 1) || (nErr < 1) || (nFec < 1) || (nRate < 1) || (nArq < 1)
+        || (nBytes < 1))
+    {
+        printf("Bench: Nothing to do\n");
+        return 1;
+    }
+
+    maxBlk = longFrames ? MAX_JUMBO : MAX_BLK;
+    for (b = 0; b < nBlk; b++)
+    {
+        if ((blkList[b] < STAMPSIZE) || (blkList[b] > maxBlk))
+        {
+            printf("Bench: Block size %g not allowed, must be %d to %d\n",
+                   blkList[b], STAMPSIZE, maxBlk);
+            return 1;
+        }
+    }
+
+    // The settings are kept by the receiver process after fork
+    if (rxThread) LL_setRxThread(TRUE, FALSE);
+    if (longFrames) LL_setLongFrames(TRUE, FALSE);
+    if (LL_setSeqBits(seqBits, FALSE) != SUCCESS) return 1;
+    if (LL_setRxBuffer(rxBuffer, FALSE) != SUCCESS) return 1;
+    if (pauseMs < 0) pauseMs = 0;
+
+    // Results go to standard output, other messages go nowhere
+    fflush(stdout);
+    csv = fdopen(dup(STDOUT_FILENO), "w");
+    if (csv == NULL)
+    {
+        perror("Bench: Failed to set up output");
+        return 1;
+    }
+    if (!verbose) freopen("/dev/null", "w", stdout);
+
+    fprintf(csv, "port,arq,window,fec,block,prob_err,bit_rate,bytes,seconds,"
+                 "goodput_Bps,efficiency,frames,retx_per_frame,"
+                 "lat_p50_ms,lat_p90_ms,lat_p99_ms,lat_max_ms,bad_blocks,result\n");
+    fflush(csv);
+
+    for (a = 0; a < nArq; a++)
+        for (r = 0; r < nRate; r++)
+            for (e = 0; e < nErr; e++)
+                for (f = 0; f < nFec; f++)
+                    for (b = 0; b < nBlk; b++)
+                    {
+                        if (benchRun(kind, (int) arqList[a], window,
+                                     (int) fecList[f], (int) blkList[b],
+                                     errList[e], (long) rateList[r],
+                                     nBytes, pauseMs, csv) != 0)
+                            nFail++;
+                    }
+
+    fclose(csv);
+    return (nFail > 0) ? 2 : 0;
+}  // end of main
+
+
+// ============================================================================
+/* Function to do one run of the benchmark, and print a line of results.
+   Arguments: kind of port pair, ARQ mode and window, number of FEC
+              parity bytes, block size,
+              probability of error, bit rate (0 for memory speed),
+              number of data bytes to send, time the receiver spends on
+              each block in ms, file for the results.
+   Returns 0 if all the data was delivered, non-zero if not.  */
+int benchRun(const char *kind, int arq, int window, int fec, int sizeBlk,
+             double prob, long rate, long nBytes, int pauseMs, FILE *csv)
+{
+    char txPort[MAX_PORT];  // name of port to send on
+    char rxPort[MAX_PORT];  // name of port to receive on
+    int fdResult[2];        // pipe to bring back the receiver results
+    int nBlocks;            // number of blocks to send
+    int nFrames = 0;        // number of data frames sent
+    int retVal;             // return code from functions
+    pid_t child;            // process id of receiver
+    benchResult res;        // results from receiver
+    double seconds = 0.0, goodput = 0.0;  // time taken and data rate
+
+    if ((sizeBlk < STAMPSIZE) || (sizeBlk > MAX_JUMBO))
+    {
+        fprintf(stderr, "Bench: Block size %d not allowed, must be %d to %d\n",
+                sizeBlk, STAMPSIZE, MAX_JUMBO);
+        return 1;
+    }
+    if (arq == ARQ_STOPWAIT) window = 1;
+    if ((LL_setARQ(arq, window, FALSE) != SUCCESS)
+        || (LL_setErrorRate(prob, FALSE) != SUCCESS)
+        || (LL_setFEC(fec, FALSE) != SUCCESS))
+    {
+        fprintf(stderr, "Bench: ARQ mode %d window %d, probability %g or "
+                "FEC %d not allowed\n", arq, window, prob, fec);
+        return 1;
+    }
+    nBlocks = (int) ((nBytes + sizeBlk - 1) / sizeBlk);
+
+    if (rate > 0)
+    {
+        sprintf(txPort, "%s0:%ld", kind, rate);
+        sprintf(rxPort, "%s1:%ld", kind, rate);
+    }
+    else
+    {
+        sprintf(txPort, "%s0", kind);
+        sprintf(rxPort, "%s1", kind);
+    }
+
+    // Make the pair and the pipe before fork, so both processes share them
+    if (PHY_makePair(txPort) != 0) return 1;
+    if (pipe(fdResult) != 0)
+    {
+        perror("Bench: Failed to make pipe");
+        return 1;
+    }
+
+    fflush(stdout);  // so buffered output is not printed twice
+    fflush(csv);
+    child = fork();
+    if (child < 0)
+    {
+        perror("Bench: Failed to start receiver");
+        close(fdResult[0]);
+        close(fdResult[1]);
+        return 1;
+    }
+    if (child == 0)  // this is the receiver
+    {
+        close(fdResult[0]);
+        if (LL_connect(rxPort, FALSE) == SUCCESS)
+            benchReceive(nBlocks, sizeBlk, pauseMs, fdResult[1]);
+        _exit(0);  // not exit(), which would flush the copy of csv
+    }
+    close(fdResult[1]);
+
+    // This is the sender
+    retVal = LL_connect(txPort, FALSE);
+    if (retVal == SUCCESS)
+    {
+        retVal = benchSend(nBlocks, sizeBlk, nBytes);
+        if (retVal == SUCCESS) retVal = LL_flush(FALSE);
+        nFrames = LL_getFramesSent(FALSE);
+        LL_discon(FALSE);
+    }
+
+    // If the sender finished, the receiver has had every block,
+    // so wait for its results, then stop it re-sending ACKs
+    memset(&res, 0, sizeof(res));
+    if (retVal == SUCCESS)
+    {
+        if (read(fdResult[0], &res, sizeof(res)) != sizeof(res))
+            memset(&res, 0, sizeof(res));
+    }
+    kill(child, SIGTERM);
+    waitpid(child, NULL, 0);
+    close(fdResult[0]);
+
+    if ((retVal == SUCCESS) && (res.nBlocks == nBlocks))
+    {
+        seconds = res.lastRx - res.firstTx;
+        if (seconds > 0.0) goodput = nBytes / seconds;
+    }
+    else if (retVal == SUCCESS) retVal = FAILURE;  // receiver did not finish
+
+    fflush(stdout);  // with -v, keep the messages apart from the results
+    fprintf(csv, "%s,%d,%d,%d,%d,%g,%ld,%ld,%.4f,%.0f,", kind, arq, window, fec,
+            sizeBlk, prob, rate, nBytes, seconds, goodput);
+    if ((rate > 0) && (retVal == SUCCESS))
+        fprintf(csv, "%.3f", 10.0 * goodput / rate);  // 10 bits per byte
+    if (retVal == SUCCESS)
+        fprintf(csv, ",%d,%.3f,%.1f,%.1f,%.1f,%.1f,%d,ok\n", nFrames,
+                (double) (nFrames - nBlocks) / nBlocks,
+                1000.0 * res.p50, 1000.0 * res.p90, 1000.0 * res.p99,
+                1000.0 * res.pMax, res.nBad);
+    else fprintf(csv, ",,,,,,,,failed %d\n", retVal);
+    fflush(csv);
+
+    return (retVal == SUCCESS) ? 0 : 1;
+}  // end of benchRun
+
+
+// ============================================================================
+/* Function to send the blocks for one run.
+   Each block starts with the time it is handed to the link layer and its
+   block number, followed by a pattern the receiver can check.
+   The last block is shorter if nBytes is not a multiple of the size.
+   Returns SUCCESS, or the code from LL_send if it failed.  */
+int benchSend(int nBlocks, int sizeBlk, long nBytes)
+{
+    byte_t block[MAX_JUMBO];  // block to send
+    int i;      // block number
+    int nData;  // bytes in this block
+    double now; // time block is handed over
+    int retVal; // return value from LL_send
+
+    for (i = 0; i < nBlocks; i++)
+    {
+        nData = sizeBlk;
+        if ((long) (i + 1) * sizeBlk > nBytes)
+            nData = (int) (nBytes - (long) i * sizeBlk);
+        if (nData < STAMPSIZE) nData = STAMPSIZE;  // room for the stamp
+
+        fillBlock(block, nData, i);
+        now = timeNow();
+        memcpy(block, &now, sizeof(now));
+        memcpy(block + sizeof(now), &i, sizeof(i));
+        retVal = LL_send(block, nData, FALSE);
+        if (retVal < 0) return retVal;  // link failed
+    }
+    return SUCCESS;
+}  // end of benchSend
+
+
+// ============================================================================
+/* Function to receive the blocks for one run, in the child process.
+   It checks each block, and measures the delay since it was sent.
+   Every block but the last should hold sizeBlk bytes, the last no more.
+   When all blocks are received, it writes the results to the pipe.
+   Then it goes on receiving, so it can ACK any frame sent again,
+   until the sender has finished.  */
+void benchReceive(int nBlocks, int sizeBlk, int pauseMs, int fdResult)
+{
+    byte_t block[MAX_JUMBO+2];  // block received
+    byte_t expect[MAX_JUMBO];   // pattern it should contain
+    double *latency;  // delay for each block, seconds
+    double sent;      // time block was handed to the sender
+    int nRx;          // bytes in block
+    int blockNum;     // number of block received
+    benchResult res;  // results for sender
+
+    memset(&res, 0, sizeof(res));
+    latency = malloc(nBlocks * sizeof(double));
+    if (latency == NULL) return;
+
+    while (res.nBlocks < nBlocks)
+    {
+        nRx = LL_receive(block, MAX_JUMBO+2, FALSE);
+        if (nRx < 0) break;      // link failed
+        if (nRx == 0) continue;  // nothing yet
+        if ((nRx < STAMPSIZE) || (nRx > sizeBlk))
+        {
+            res.nBad++;
+            continue;
+        }
+
+        memcpy(&sent, block, sizeof(sent));
+        memcpy(&blockNum, block + sizeof(sent), sizeof(blockNum));
+        res.lastRx = timeNow();
+        if (res.nBlocks == 0) res.firstTx = sent;
+
+        fillBlock(expect, nRx, blockNum);
+        if ((blockNum != res.nBlocks)
+            || ((blockNum < nBlocks - 1) && (nRx != sizeBlk))
+            || (memcmp(block + STAMPSIZE, expect + STAMPSIZE, nRx - STAMPSIZE) != 0))
+            res.nBad++;
+        latency[res.nBlocks++] = res.lastRx - sent;
+        if (pauseMs > 0) usleep(1000 * pauseMs);  // a slow program
+    }
+
+    if (res.nBlocks == nBlocks)
+    {
+        qsort(latency, nBlocks, sizeof(double), compareDouble);
+        res.p50 = percentile(latency, nBlocks, 0.50);
+        res.p90 = percentile(latency, nBlocks, 0.90);
+        res.p99 = percentile(latency, nBlocks, 0.99);
+        res.pMax = latency[nBlocks-1];
+        write(fdResult, &res, sizeof(res));
+        while (LL_receive(block, MAX_JUMBO+2, FALSE) >= 0);  // until stopped
+    }
+    free(latency);
+}  // end of benchReceive
+
+
+// ============================================================================
+/* Function to fill a block with a pattern that depends on the block number,
+   so the receiver can check it.  The first STAMPSIZE bytes are left for
+   the time and block number.  */
+void fillBlock(byte_t *block, int sizeBlk, int blockNum)
+{
+    int i;  // position in block
+
+    for (i = STAMPSIZE; i < sizeBlk; i++)
+        block[i] = (byte_t) (blockNum * 7 + i * 13);
+}  // end of fillBlock
+
+
+// ============================================================================
+/* Function to find a percentile of a sorted list of values.
+   Arguments: the sorted values; how many there are;
+              fraction of values at or below the result, e.g. 0.9
+   Returns the value at that position in the list.  */
+double percentile(double *sorted, int n, double fraction)
+{
+    int i = (int) (fraction * n + 0.5) - 1;  // position in list
+
+    if (i < 0) i = 0;
+    if (i > n - 1) i = n - 1;
+    return sorted[i];
+}  // end of percentile
+
+
+// ============================================================================
+/* Function to compare two values, for qsort().  */
+int compareDouble(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}  // end of compareDouble
+
+
+// ============================================================================
+/* Function to read a list of numbers separated by commas.
+   Arguments: the text, which is changed; array for the numbers.
+   Returns how many numbers were read, up to MAX_LIST.  */
+int parseList(char *text, double *list)
+{
+    char *item;  // one number in the text
+    int n = 0;   // how many so far
+
+    for (item = strtok(text, ","); (item != NULL) && (n < MAX_LIST);
+         item = strtok(NULL, ","))
+        list[n++] = atof(item);
+    return n;
+}  // end of parseList
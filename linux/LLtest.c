@@ -76,6 +76,7 @@ int main()
 	
         printf("Program will use port %s\n", portName); // print the result
     }
+    else portName = "loop";  // port that sends bytes back to this end
 
 
     // If sending, open the input file and check for failure
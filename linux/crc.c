@@ -0,0 +1,245 @@
+/*  Cyclic redundancy check functions, used for frame error detection.
+       CRC_init       builds the tables and chooses the kernels
+       CRC_setKernel  selects a kernel, for testing
+       CRC_8          calculates CRC-8, for short blocks
+       CRC_16         calculates CRC-16-CCITT
+       CRC_32C        calculates CRC-32C
+    Three kinds of kernel are provided.  The byte-wise kernel uses one
+    256-entry table and handles one byte per step.  The slicing-by-8
+    kernel uses eight tables, so eight bytes are handled per step with
+    independent table lookups.  On x86 processors with SSE4.2, CRC-32C
+    can use the crc32 instruction, which handles eight bytes per
+    instruction.  All kernels give the same results.  */
+
+#include <string.h>   // for memcpy
+#include <pthread.h>  // for pthread_once, so threads can share the tables
+#include "crc.h"      // header file for functions in this file
+
+#define CRC8_POLY 0x07          // CRC-8 polynomial, MSB first
+#define CRC16_POLY 0x1021       // CRC-16-CCITT polynomial, MSB first
+#define CRC16_INIT 0xFFFF       // CRC-16 initial value
+#define CRC32C_POLY 0x82F63B78  // CRC-32C polynomial, reflected (LSB first)
+#define CRC32C_INIT 0xFFFFFFFF  // CRC-32C initial value and final XOR
+
+// The hardware kernel needs x86 and a compiler that can target SSE4.2
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define CRC_HAVE_SSE42 1
+#include <nmmintrin.h>   // SSE4.2 intrinsics
+#else
+#define CRC_HAVE_SSE42 0
+#endif
+
+/* Tables for the table-driven kernels.  Table k gives the effect of a
+   byte followed by k zero bytes, so slicing-by-8 uses tables 0 to 7.  */
+static uint8_t crc8Table[256];
+static uint16_t crc16Table[8][256];
+static uint32_t crc32cTable[8][256];
+static pthread_once_t initOnce = PTHREAD_ONCE_INIT;  // tables are built once
+static int hwAvailable = 0;  // processor has the crc32 instruction
+static int kernel16 = CRC_BYTEWISE;  // kernel in use for CRC-16
+static int kernel32 = CRC_BYTEWISE;  // kernel in use for CRC-32C
+
+//===================================================================
+/* Function to build the tables and choose the kernels, run only once,
+   by CRC_init.  */
+static void buildTables(void)
+{
+    int i, k;        // for use in loops
+    uint8_t c8;      // CRC-8 value being worked out
+    uint16_t c16;    // CRC-16 value being worked out
+    uint32_t c32;    // CRC-32C value being worked out
+
+    // Table 0 is the usual byte-at-a-time table
+    for (i = 0; i < 256; i++)
+    {
+        c8 = (uint8_t) i;
+        c16 = (uint16_t) (i << 8);
+        c32 = (uint32_t) i;
+        for (k = 0; k < 8; k++)
+        {
+            c8 = (c8 & 0x80) ? (uint8_t) ((c8 << 1) ^ CRC8_POLY)
+                             : (uint8_t) (c8 << 1);
+            c16 = (c16 & 0x8000) ? (uint16_t) ((c16 << 1) ^ CRC16_POLY)
+                                 : (uint16_t) (c16 << 1);
+            c32 = (c32 & 1) ? (c32 >> 1) ^ CRC32C_POLY : (c32 >> 1);
+        }
+        crc8Table[i] = c8;
+        crc16Table[0][i] = c16;
+        crc32cTable[0][i] = c32;
+    }
+
+    // Each further table pushes the previous one through another zero byte
+    for (k = 1; k < 8; k++)
+    {
+        for (i = 0; i < 256; i++)
+        {
+            c16 = crc16Table[k-1][i];
+            crc16Table[k][i] = (uint16_t) ((c16 << 8) ^ crc16Table[0][c16 >> 8]);
+            c32 = crc32cTable[k-1][i];
+            crc32cTable[k][i] = (c32 >> 8) ^ crc32cTable[0][c32 & 0xFF];
+        }
+    }
+
+#if CRC_HAVE_SSE42
+    __builtin_cpu_init();
+    hwAvailable = __builtin_cpu_supports("sse4.2");
+#endif
+
+    kernel16 = CRC_SLICE8;
+    kernel32 = hwAvailable ? CRC_HARDWARE : CRC_SLICE8;
+}
+
+//===================================================================
+/* CRC_init function - builds the tables and chooses the kernels.
+   Safe to call more than once, and from several threads at once: the
+   first call does the work, and any others wait until it is done.  */
+void CRC_init(void)
+{
+    pthread_once(&initOnce, buildTables);
+}
+
+//===================================================================
+/* CRC_setKernel function - selects the kernel to use, for testing.
+   If the kernel asked for is not available, the best one that is
+   available is used instead.  CRC-16 has no hardware kernel.
+   Returns the kernel that will be used for CRC-32C.  */
+int CRC_setKernel(int kernel)
+{
+    CRC_init();
+    if ((kernel == CRC_HARDWARE) && !hwAvailable) kernel = CRC_SLICE8;
+    if ((kernel < CRC_BYTEWISE) || (kernel > CRC_HARDWARE)) kernel = CRC_SLICE8;
+    kernel32 = kernel;
+    kernel16 = (kernel == CRC_BYTEWISE) ? CRC_BYTEWISE : CRC_SLICE8;
+    return kernel32;
+}
+
+//===================================================================
+/* CRC_8 function - calculates the CRC-8 of a block of bytes.
+   Most significant bit first.  Meant for a few bytes, such as a frame
+   header, so there is only the byte-wise kernel.
+   Returns the 8-bit CRC value.  */
+uint8_t CRC_8(const byte_t *data, int nBytes)
+{
+    uint8_t crc = 0;  // CRC value so far
+
+    CRC_init();
+    while (nBytes-- > 0)
+    {
+        crc = crc8Table[crc ^ *data++];
+    }
+    return crc;
+}
+
+//===================================================================
+/* CRC_16 function - calculates the CRC-16-CCITT of a block of bytes.
+   Most significant bit first, so a byte enters at the top of the CRC.
+   With slicing-by-8, the two CRC bytes are combined with the first two
+   data bytes, and all eight bytes are looked up independently.
+   Returns the 16-bit CRC value.  */
+uint16_t CRC_16(const byte_t *data, int nBytes)
+{
+    uint16_t crc = CRC16_INIT;  // CRC value so far
+
+    CRC_init();
+
+    if (kernel16 == CRC_SLICE8)
+    {
+        while (nBytes >= 8)
+        {
+            crc = (uint16_t) (crc16Table[7][(crc >> 8) ^ data[0]]
+                            ^ crc16Table[6][(crc & 0xFF) ^ data[1]]
+                            ^ crc16Table[5][data[2]] ^ crc16Table[4][data[3]]
+                            ^ crc16Table[3][data[4]] ^ crc16Table[2][data[5]]
+                            ^ crc16Table[1][data[6]] ^ crc16Table[0][data[7]]);
+            data += 8;
+            nBytes -= 8;
+        }
+    }
+
+    while (nBytes-- > 0)  // remaining bytes, one at a time
+    {
+        crc = (uint16_t) ((crc << 8) ^ crc16Table[0][(crc >> 8) ^ *data++]);
+    }
+    return crc;
+}
+
+#if CRC_HAVE_SSE42
+//===================================================================
+/* Hardware CRC-32C kernel, using the SSE4.2 crc32 instruction.
+   Compiled for SSE4.2 even if the rest of the program is not, and only
+   called if the processor supports it.  */
+__attribute__((target("sse4.2")))
+static uint32_t crc32cHardware(uint32_t crc, const byte_t *data, int nBytes)
+{
+#if defined(__x86_64__)
+    uint64_t crc64 = crc;  // the 64-bit instruction works on a 64-bit value
+    uint64_t word;         // eight data bytes
+
+    while (nBytes >= 8)
+    {
+        memcpy(&word, data, 8);  // safe for any alignment
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        nBytes -= 8;
+    }
+    crc = (uint32_t) crc64;
+#else
+    uint32_t word;         // four data bytes
+
+    while (nBytes >= 4)
+    {
+        memcpy(&word, data, 4);  // safe for any alignment
+        crc = _mm_crc32_u32(crc, word);
+        data += 4;
+        nBytes -= 4;
+    }
+#endif
+    while (nBytes-- > 0)  // remaining bytes, one at a time
+    {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+#endif
+
+//===================================================================
+/* CRC_32C function - calculates the CRC-32C of a block of bytes.
+   Least significant bit first, so a byte enters at the bottom of the CRC.
+   With slicing-by-8, the CRC is combined with the first four data bytes,
+   and all eight bytes are looked up independently.
+   Returns the 32-bit CRC value.  */
+uint32_t CRC_32C(const byte_t *data, int nBytes)
+{
+    uint32_t crc = CRC32C_INIT;  // CRC value so far
+    uint32_t lo, hi;  // first and second four bytes of a group of eight
+
+    CRC_init();
+
+#if CRC_HAVE_SSE42
+    if (kernel32 == CRC_HARDWARE)
+        return crc32cHardware(crc, data, nBytes) ^ CRC32C_INIT;
+#endif
+
+    if (kernel32 == CRC_SLICE8)
+    {
+        while (nBytes >= 8)
+        {
+            lo = crc ^ ((uint32_t) data[0] | ((uint32_t) data[1] << 8)
+                   | ((uint32_t) data[2] << 16) | ((uint32_t) data[3] << 24));
+            hi = (uint32_t) data[4] | ((uint32_t) data[5] << 8)
+               | ((uint32_t) data[6] << 16) | ((uint32_t) data[7] << 24);
+            crc = crc32cTable[7][lo & 0xFF] ^ crc32cTable[6][(lo >> 8) & 0xFF]
+                ^ crc32cTable[5][(lo >> 16) & 0xFF] ^ crc32cTable[4][lo >> 24]
+                ^ crc32cTable[3][hi & 0xFF] ^ crc32cTable[2][(hi >> 8) & 0xFF]
+                ^ crc32cTable[1][(hi >> 16) & 0xFF] ^ crc32cTable[0][hi >> 24];
+            data += 8;
+            nBytes -= 8;
+        }
+    }
+
+    while (nBytes-- > 0)  // remaining bytes, one at a time
+    {
+        crc = (crc >> 8) ^ crc32cTable[0][(crc ^ *data++) & 0xFF];
+    }
+    return crc ^ CRC32C_INIT;
+}
@@ -0,0 +1,56 @@
+/* Define a type called byte_t, if not already defined.
+   This is an 8-bit variable, able to hold integers from 0 to 255.
+   It could be named "byte", but this conflicts with a definition in
+   windows.h, which is needed for the real physical layer functions. */
+#ifndef BYTE_T_DEFINED
+#define BYTE_T_DEFINED
+typedef unsigned char byte_t;  // define type "byte_t" for simplicity
+#endif
+
+
+#ifndef CRC_H_INCLUDED
+#define CRC_H_INCLUDED
+
+#include <stdint.h>   // fixed-size integer types for CRC values
+
+/*  Cyclic redundancy check functions, used for frame error detection.
+       CRC_8        CRC-8: polynomial 0x07, initial value 0 - for short
+                    blocks such as a frame header, so byte-wise only
+       CRC_16       CRC-16-CCITT: polynomial 0x1021, initial value 0xFFFF
+       CRC_32C      CRC-32C (Castagnoli): reflected polynomial 0x82F63B78,
+                    initial value and final XOR 0xFFFFFFFF
+    Each CRC has several kernels giving the same result.  The fastest one
+    available on this processor is chosen when CRC_init() is first called. */
+
+// Kernels - ways of calculating the CRCs, slowest first
+#define CRC_BYTEWISE 0   // table-driven, one byte at a time
+#define CRC_SLICE8 1     // table-driven, eight bytes at a time
+#define CRC_HARDWARE 2   // SSE4.2 crc32 instruction (CRC-32C only)
+
+/* CRC_init function - builds the tables and chooses the kernels.
+   Safe to call more than once, from any thread.  The CRC functions call
+   it if needed. */
+void CRC_init(void);
+
+/* CRC_setKernel function - selects the kernel to use, for testing.
+   If the kernel asked for is not available, the best one that is
+   available is used instead.
+   Returns the kernel that will be used for CRC-32C. */
+int CRC_setKernel(int kernel);
+
+/* CRC_8 function - calculates the CRC-8 of a block of bytes.
+   Arguments: pointer to the bytes; number of bytes.
+   Returns the 8-bit CRC value. */
+uint8_t CRC_8(const byte_t *data, int nBytes);
+
+/* CRC_16 function - calculates the CRC-16-CCITT of a block of bytes.
+   Arguments: pointer to the bytes; number of bytes.
+   Returns the 16-bit CRC value. */
+uint16_t CRC_16(const byte_t *data, int nBytes);
+
+/* CRC_32C function - calculates the CRC-32C of a block of bytes.
+   Arguments: pointer to the bytes; number of bytes.
+   Returns the 32-bit CRC value. */
+uint32_t CRC_32C(const byte_t *data, int nBytes);
+
+#endif // CRC_H_INCLUDED
@@ -10,19 +10,25 @@
 #include <stdio.h>      // standard input-output library
 #include <string.h>     // needed for string manipulation
 #include <stdlib.h>   // needed for atoi()
+#include <unistd.h>     // needed for fork()
+#include <sys/wait.h>   // needed for waitpid()
 #include "linklayer.h"  // link layer functions
+#include "physical.h"   // needed for PHY_makePair()
+#include "log.h"        // needed for LOG_dump()
 
 #define FILENAME 233  // header value for file name
 #define FILEDATA 234  // header value for data
 #define FILEEND 235   // header value to mark end of file
-#define MAX_DATA 300  // maximum data block size to use
+#define MAX_DATA MAX_JUMBO  // maximum data block size to use
 
 #define MAX_FNAME 80  // maximum file name length
 #define MAX_MODE 10   // maximum length of mode input
+#define MAX_PORT 40   // maximum length of port name
 
 // Function prototypes
 int sendFile(char *fName, char *portName, int debug);
 int receiveFile(char *portName, int debug);
+int sendBoth(char *fName, char *portName, int debug);
 
 int main()
 {
@@ -30,7 +36,7 @@ int main()
     char inString[MAX_MODE]; // string to hold user command
     int nInput;         // length of input string
     int retVal;         // return value from functions
-    char portName[MAX_MODE];        // serial port number
+    char portName[MAX_PORT];        // serial port name
     int debug = FALSE;  // flag to select more printing
 
     printf("Link Layer Assignment - Application Program\n");  // welcome message
@@ -41,14 +47,14 @@ int main()
     if ((inString[0] == 'd')||(inString[0] == 'D')) debug = FULL;
 
     // Ask which port to use
-    printf("\nName of port to use (eg: ttyS10): ");
-    fgets(portName, MAX_MODE, stdin);  // get user input
+    printf("\nName of port to use (eg: ttyS10, or mem or pty to run both ends): ");
+    fgets(portName, MAX_PORT, stdin);  // get user input
     portName[ strlen(portName) - 1 ] = '\0';   // remove trailing newline
     
     printf("Program will use port /dev/%s\n", portName); // print the result
 
     // Then ask what the user wants to do
-    printf("\nSelect send or receive (s/r): ");
+    printf("\nSelect send, receive or both (s/r/b): ");
     fgets(inString, MAX_MODE, stdin);  // get user input
 
     // Decide what to do, based on what the user entered
@@ -63,14 +69,38 @@ int main()
             printf("\n");  // blank line
             retVal = sendFile(fName, portName, debug);  // call function to send file
             if (retVal == 0) printf("\nFile sent!\n");
-            else printf("\n*** Send failed, code %d\n", retVal);
+            else
+            {
+                printf("\n*** Send failed, code %d\n", retVal);
+                LOG_dump(stdout);  // what the link layer said, leading up to it
+            }
             break;
 
         case 'r':
         case 'R':
 	  retVal = receiveFile(portName, debug);  // call function to receive file
             if (retVal == 0) printf("\nFile received!\n");
-            else printf("\n*** Receive failed, code %d\n", retVal);
+            else
+            {
+                printf("\n*** Receive failed, code %d\n", retVal);
+                LOG_dump(stdout);  // what the link layer said, leading up to it
+            }
+            break;
+
+        case 'b':
+        case 'B':
+            printf("\nEnter name of file to send with extension (name.ext): ");
+            fgets(fName, MAX_FNAME, stdin);  // get filename
+            nInput = strlen(fName);
+            fName[nInput-1] = '\0';   // remove the newline at the end
+            printf("\n");  // blank line
+            retVal = sendBoth(fName, portName, debug);  // send and receive
+            if (retVal == 0) printf("\nFile sent and received!\n");
+            else
+            {
+                printf("\n*** Send or receive failed, code %d\n", retVal);
+                LOG_dump(stdout);  // from the sending end, leading up to it
+            }
             break;
 
         default:
@@ -101,6 +131,7 @@ int sendFile(char *fName, char *portName, int debug)
 {
     FILE *fpi;  // file handle for input file
     byte_t data[MAX_DATA+2];  // array of bytes
+    byte_t *block;      // link layer buffer for the next block
     int sizeDataBlk;    // number of data bytes per block
     int nByte;   // number of bytes read or found in filename
     int retVal;  // return code from functions
@@ -153,9 +184,18 @@ int sendFile(char *fName, char *portName, int debug)
     // Start sending the contents of the file, one block at a time
     do  // loop block by block
     {
-        data[0] = (byte_t) FILEDATA;  // set the header byte
-        // read bytes from file, store in array starting after header
-        nByte = (int) fread(data+1, 1, sizeDataBlk, fpi);
+        // The best block size depends on the errors seen, so ask again
+        sizeDataBlk = LL_getOptBlockSize(FALSE) - 1;
+        if (sizeDataBlk > MAX_DATA) sizeDataBlk = MAX_DATA;
+
+        // Read straight into the link layer's buffer, to save a copy
+        retVal = LL_getTxBuffer(&block, debug);
+        if (retVal < 0) break;  // link failed, dealt with below
+        if (sizeDataBlk > retVal - 1) sizeDataBlk = retVal - 1;
+
+        block[0] = (byte_t) FILEDATA;  // set the header byte
+        // read bytes from file, store in buffer starting after header
+        nByte = (int) fread(block+1, 1, sizeDataBlk, fpi);
         if (ferror(fpi))  // check for problem
         {
             perror("Send: Problem reading input file");
@@ -168,7 +208,7 @@ int sendFile(char *fName, char *portName, int debug)
                    nByte, nByte+1);
         byteCount += nByte;  // add to byte count
 
-        retVal = LL_send(data, nByte+1, debug);  // send bytes to link layer
+        retVal = LL_sendBuffer(nByte+1, debug);  // send bytes from buffer
         // retVal is 0 if succeeded, non-zero if failed
     }
     while ((retVal == 0) && (feof(fpi) == 0));  // until input file ends or error
@@ -191,6 +231,10 @@ int sendFile(char *fName, char *portName, int debug)
     if (retVal < 0) printf("Send: Problem sending end block\n");
     else if (debug) printf("Send: Sent end block, %d byte\n", retVal);
 
+    // Blocks may still be in flight - wait until they are all acknowledged
+    if (retVal == 0) retVal = LL_flush(debug);
+    if (retVal < 0) printf("Send: Problem completing transfer, code %d\n", retVal);
+
     // Ask link layer to disconnect
     if (debug) printf("Send: Disconnecting...\n");
     LL_discon(debug);  // ignore return value here...
@@ -214,6 +258,7 @@ int receiveFile(char *portName, int debug)
 {
     FILE *fpo;  // file handle for output file
     byte_t data[MAX_DATA+2];  // array of bytes
+    byte_t *block;      // data block, in the link layer's buffer
     int nByte, nWrite;  // number of bytes received or written
     int header = 0;  // header value from received block
     int retVal;  // return code from other functions
@@ -272,10 +317,11 @@ int receiveFile(char *portName, int debug)
     }
 
     // Finally, we can start to receive the data
-    // Get each block of data and write to file
+    // Get each block of data and write to file, straight from the
+    // link layer's buffer, to save a copy
     do  // loop block by block
     {
-        nByte = LL_receive(data, MAX_DATA+1, debug);  // try to receive data block
+        nByte = LL_receiveView(&block, debug);  // try to receive data block
         // nByte will be number of bytes received, or negative if problem
 
         // First check nByte, to see what to do...
@@ -287,12 +333,12 @@ int receiveFile(char *portName, int debug)
         else // we got some data!
         {
             // Now check the header byte to see what to do...
-            header = (int) data[0];  // extract the header
+            header = (int) block[0];  // extract the header
             if (header == FILEDATA)  // got data block - write data to file
             {
                 byteCount += nByte-1;  // add to byte count
                 // write bytes to file, starting after header
-                nWrite = (int) fwrite(data+1, 1, nByte-1, fpo);
+                nWrite = (int) fwrite(block+1, 1, nByte-1, fpo);
                 if (ferror(fpo))  // check for problem
                 {
                     perror("RX: Problem writing output file");
@@ -314,6 +360,7 @@ int receiveFile(char *portName, int debug)
             } // end of inner if - checking header
 
         } // end of outer if - checking nByte
+        LL_releaseRx(debug);  // finished with the block
     }
     while (nByte >= 0);  // repeat until problem or end marker
 
@@ -324,3 +371,51 @@ int receiveFile(char *portName, int debug)
 
     return (nByte < -1) ? -nByte : 0;  // indicate success or failure
 }  // end of receiveFile
+
+
+// ============================================================================
+/* Function to send a file and receive it again, in one run of the program.
+   It makes a pair of connected ports (mem or pty, from the port name),
+   then starts a child process to receive on end 1 of the pair, while
+   this process sends on end 0.  Any ":rate" suffix applies to both ends.
+   The received copy has the usual Z in front of its name.
+   Returns 0 for success, or a non-zero failure code.  */
+int sendBoth(char *fName, char *portName, int debug)
+{
+    char txPort[MAX_PORT+2];  // name of port to send on
+    char rxPort[MAX_PORT+2];  // name of port to receive on
+    char *rate = strchr(portName, ':');  // pacing suffix, if any
+    pid_t child;   // process id of receiver
+    int status;    // exit status of receiver
+    int retVal;    // return code from functions
+
+    sprintf(txPort, "%.3s0%s", portName, (rate != NULL) ? rate : "");
+    sprintf(rxPort, "%.3s1%s", portName, (rate != NULL) ? rate : "");
+
+    // The pair must exist before fork, so both processes share it
+    retVal = PHY_makePair(portName);
+    if (retVal != 0) return retVal;
+
+    fflush(stdout);  // so buffered output is not printed twice
+    child = fork();
+    if (child < 0)
+    {
+        perror("Both: Failed to start receiver");
+        return 1;
+    }
+    if (child == 0)  // this is the receiver
+    {
+        retVal = receiveFile(rxPort, debug);
+        if (retVal != 0) LOG_dump(stdout);  // from the receiving end
+        exit(retVal);
+    }
+
+    retVal = sendFile(fName, txPort, debug);
+    waitpid(child, &status, 0);  // wait for the receiver to finish
+    if ((retVal == 0) && (!WIFEXITED(status) || (WEXITSTATUS(status) != 0)))
+    {
+        printf("Both: Receiver failed\n");
+        retVal = 1;
+    }
+    return retVal;
+}  // end of sendBoth
@@ -14,34 +14,149 @@ typedef unsigned char byte_t;  // define type "byte_t" for simplicity
 // Link Layer Protocol definitions - adjust all these to match your design
 #define MAX_BLK 200   // largest number of data bytes allowed in one frame
 #define OPT_BLK 70    // optimum number of data bytes in a frame
-#define MOD_SEQNUM 16 // modulo for sequence numbers
+#define MOD_SEQNUM 16 // modulo for sequence numbers - see LL_setSeqBits()
+
+// ARQ (automatic repeat request) modes, selected with LL_setARQ()
+#define ARQ_STOPWAIT 0  // send one frame, wait for its ACK before the next
+#define ARQ_GOBACKN 1   // several frames in flight, cumulative ACKs
+#define ARQ_SELREPEAT 2 // several frames in flight, each ACKed on its own
+#define ARQ_MODE ARQ_GOBACKN  // default ARQ mode
+#define TX_WINDOW 7     // default sender window: frames in flight at once
 
 // Frame marker byte values
 #define STARTBYTE 212   // start of frame marker
 #define ENDBYTE 204     // end of frame marker
+#define ESCBYTE 125     // escape marker, for byte stuffing
 
 
 // Frame header byte positions
-#define FRSPOS 1        // position of frame sdize
-#define SEQNUMPOS 2     // position of sequence number
+#define FRSPOS 1        // position of frame size (low byte in a long header)
+#define TYPEPOS 2       // position of frame type: data, ACK, NAK, setup, ...
+#define SEQNUMPOS 3     // position of sequence number
+#define ACKPOS 4        // position of ACK carried by a data frame, or NOACK
+#define HCSPOS 5        // position of header check: CRC-8 of bytes before it
+#define LENHIPOS 5      // long header: high byte of frame size, then the check
 
 // Header and trailer size
-#define HEADERSIZE 3	// number of bytes in frame header
-#define TRAILERSIZE 2	// number of bytes in frame trailer
+#define HEADERSIZE 6	// number of bytes in frame header
+#define LONG_HEADERSIZE 7  // number of bytes in long frame header
+#define MAX_TRAILER 5	// most bytes in frame trailer: CRC-32C and end marker
+
+// Long frames, selected with LL_setLongFrames()
+// The header has a 16-bit frame size, so a frame can carry a lot more data,
+// and the cost of the header, trailer and ACK is spread over more bytes
+#define LONG_FRAMES 0     // default: 1 for long frames, 0 for normal ones
+#define MAX_JUMBO 4096    // largest number of data bytes in a long frame
+
+// Sequence numbers, selected with LL_setSeqBits()
+// Wider sequence numbers allow a bigger window, to keep a long, fast link
+// busy while the ACKs come back.  With 8 bits, the sequence number and the
+// ACK carried each fill their byte in the header.  With 16 bits, a wide
+// header has a second byte for each.  The top bit of the field is not used
+// for numbers, so the ACK field can still say NOACK, with every bit set:
+//     4 bits      numbers 0 to 15, as MOD_SEQNUM
+//     8 bits      numbers 0 to 127
+//     16 bits     numbers 0 to 32767
+#define SEQ_BITS 4        // default bits in a sequence number: 4, 8 or 16
+#define SEQHI_SIZE 2      // extra header bytes with 16 bits: the high bytes
+#define MAX_WINDOW 512    // largest sender window - a power of 2
+#define MAX_HEADER (LONG_HEADERSIZE+SEQHI_SIZE)  // most bytes in a header
+
+// Error check types, selected with LL_setCheck()
+// The check bytes go in the trailer, just before the end marker
+#define CHECK_SUM 0     // 1 byte: sum of bytes, modulo MODULO
+#define CHECK_CRC16 1   // 2 bytes: CRC-16-CCITT
+#define CHECK_CRC32C 2  // 4 bytes: CRC-32C
+#define CHECK_TYPE CHECK_CRC16  // default error check
+
+// Forward error correction, selected with LL_setFEC()
+// Reed-Solomon parity bytes go in the trailer of data frames, after the
+// check bytes, and correct up to half their number of damaged bytes
+// A long frame is split into pieces, each with its own parity bytes,
+// as the code works on blocks of at most 255 bytes
+#define MAX_FEC 16      // most parity bytes in a frame, or in each piece
+#define FEC_PARITY 0    // default number of parity bytes: no FEC
+
+// Most bytes in a frame, with byte stuffing.  FEC parity is at most
+// MAX_FEC bytes for each 239 bytes of data, which is less than 1/8
+// FRAME_BYTES is for frames with blocks of up to n bytes, as agreed
+#define FRAME_BYTES(n) (2*(MAX_HEADER+(n)+MAX_TRAILER+(n)/8))
+#define MAX_FRAME FRAME_BYTES(MAX_JUMBO)
+
+// Send buffers, lent by LL_getTxBuffer().  The data goes after room for
+// the longest header, with room after it for the trailer, so the frame
+// is built around the data where it is, without copying it
+#define TX_HEADROOM MAX_HEADER  // bytes before the data
+#define TX_TAILROOM (MAX_TRAILER+MAX_JUMBO/8)  // bytes after the data
+#define TX_PLAIN (TX_HEADROOM+MAX_JUMBO+TX_TAILROOM)  // the whole buffer
 
 // Frame error check results
 #define FRAMEGOOD 1     // the frame has passed the tests
 #define FRAMEBAD 0      // the frame is damaged
 
+// Frame types, in the header - a response has its acknowledgement
+// value as its type
+#define DATAFRAME 68    // frame holding a block of data
+#define SETUPFRAME 83   // frame offering settings, sent at connect
+#define PROBEFRAME 80   // window probe: asks the receiver for its room
+#define WINDOWFRAME 87  // answer to a probe: the receiver's room
+#define NOACK 255       // in ACKPOS: the frame carries no ACK
+
 // Acknowledgement values
 #define POSACK 1        // positive acknowledgement
 #define NEGACK 26       // negative acknowledgement
-#define ACK_SIZE 5      // number of bytes in ack frame
+#define ACK_SIZE (MAX_HEADER+ROOM_SIZE+MAX_TRAILER) // most bytes in ack frame
+
+// Setup frames, sent by both ends at connect to agree the settings.
+// They always have the normal header and a CRC-16, whatever the settings.
+// The data says what this end would like, and if it has heard the other end.
+#define SETUP_SIZE 10   // bytes of data in a setup frame
+#define SETUP_FRAMESIZE (HEADERSIZE+SETUP_SIZE+3)  // with CRC-16 and end marker
+#define SU_VERSION 0    // position of version of the setup data
+#define SU_HEARD 1      // position of what this end has heard, below
+#define SU_ARQ 2        // position of ARQ mode
+#define SU_WINDOW 3     // position of sender window, 2 bytes, high first
+#define SU_MAXBLK 5     // position of largest data block, 2 bytes, high first
+#define SU_CHECK 7      // position of error check type
+#define SU_SEQBITS 8    // position of number of bits in sequence numbers
+#define SU_FEC 9        // position of number of FEC parity bytes
+#define SETUP_VERSION 2 // version of the setup data
+#define SETUP_NEW 0     // in SU_HEARD: nothing heard from the other end yet
+#define SETUP_HEARD 1   // this end has the other end's settings
+#define SETUP_DONE 2    // and knows the other end has this end's settings
 
 // Time limits
-#define TX_WAIT 4.0   // sender waiting time in seconds
+#define TX_WAIT 4.0   // longest sender waiting time in seconds
 #define RX_WAIT 6.0   // receiver waiting time in seconds
+#define RTO_MIN 0.05  // shortest sender waiting time in seconds
 #define MAX_TRIES 5   // number of times to re-try (either end)
+#define ACK_DELAY 0.2   // longest time an ACK waits to go in a data frame
+#define SETUP_WAIT 0.5    // time between setup frames, at connect
+#define CONNECT_WAIT 30.0 // longest time to wait for the other end, at connect
+
+// Block size adaptation, for LL_getOptBlockSize()
+#define ERR_MEMORY 0.98   // weight kept by the error estimate at each frame
+#define ERR_MIN_FRAMES 20 // frames to see before the block size adapts
+
+// Receive thread, selected with LL_setRxThread(), and the receive queues.
+// The queues are made at connect, with room for a few frames while the
+// settings are agreed, then for the window agreed and a few more, as
+// frames that are dropped from a full queue must be sent again
+#define RX_QUEUE_SETUP 8  // frames waiting in each queue, at connect
+#define RX_QUEUE_EXTRA 16 // frames waiting in each queue, beyond the window
+#define RESPONSE_BYTES ((ACK_SIZE > SETUP_FRAMESIZE) ? ACK_SIZE \
+                                                : SETUP_FRAMESIZE)
+
+// Receiver flow control, with the receive buffer set by LL_setRxBuffer()
+// Each ACK, NAK and probe answer has ROOM_SIZE data bytes, high first:
+// the number of data blocks the receiver has room for - its buffer, less
+// the blocks waiting for its program.  This is its advertised window.
+// The sender sends no more new blocks than that until the next response,
+// and while there is no room, it sends window probes until there is.
+// The buffer is part of the receive queue.  The sender never has more
+// than its window on the way, and the queue has room for that, and more
+#define RX_BUFFER MAX_WINDOW  // default receive buffer, in data blocks
+#define ROOM_SIZE 2       // data bytes in a response, giving the room
 
 // Physical Layer settings to be used
 #define PORTNUM 1        // default port number: COM1
@@ -65,15 +180,48 @@ typedef unsigned char byte_t;  // define type "byte_t" for simplicity
 // Definition of modulo to be used in the checksum
 #define MODULO 251      // will be used to compose checksum
 
+// A link: its port, sequence numbers, settings, buffers and counters.
+// What is in it is private to the link layer.
+typedef struct LL_link LL_link;
+
+// What has happened on a link since it connected, from LL_getStats().
+// Rates are per second of the time connected.  Bytes on the line include
+// every frame, with its header, trailer and stuffing, and ACKs and NAKs.
+typedef struct
+{
+    double elapsed;         // seconds since connected, on a monotonic clock
+    long dataBytesTx;       // data bytes sent, in new blocks
+    long dataBytesRx;       // data bytes received, returned to the program
+    long lineBytesTx;       // bytes sent on the line
+    long lineBytesRx;       // bytes received from the line
+    double goodputTx;       // data bytes sent per second
+    double goodputRx;       // data bytes received per second
+    int blocksSent;         // new data blocks sent
+    int framesSent;         // data frames sent, including re-sends
+    double retxRatio;       // data frames re-sent, per new block
+    int goodFrames;         // frames received that passed the checks
+    int badFrames;          // frames received that were damaged
+    double frameErrorRate;  // fraction of frames received that were damaged
+    int timeouts;           // times a wait for a frame ran out
+    int acksSent;           // ACKs sent in frames of their own
+    int acksRx;             // ACKs received
+    int naksSent;           // NAKs sent
+    int naksRx;             // NAKs received
+    double srtt;            // smoothed round trip time, seconds, 0 if none
+                            // has been measured yet
+    double rto;             // time the sender waits for an ACK, seconds
+} LL_stats;
+
 /* Functions to implement link layer protocol.
    All functions take a debug argument - if non-zero, they print
    messages explaining what is happening.  Regardless of debug,
    functions print messages when things go wrong.
    LL_send and LL_receive behave in a simpler way if debug is 1,
    to facilitate testing of some parts of the protocol.
-   Functions return negative values on failure.  */
+   Functions return negative values on failure.
+   These functions all work on one link, the default link.  */
 
-// Function to connect to another computer.
+// Function to connect to another computer, and agree the settings with it.
 int LL_connect(char *portName, int debug);
 
 // Function to disconnect from other computer.
@@ -82,37 +230,238 @@ int LL_discon(int debug);
 // Function to send a block of data in a frame.
 int LL_send(byte_t *dataTx, int nTXdata, int debug);
 
+// Function to lend the program the buffer for the next block, so the data
+// can be put straight into it, then sent by LL_sendBuffer() without a copy.
+int LL_getTxBuffer(byte_t **buffer, int debug);
+
+// Function to send the block of data put in the buffer from LL_getTxBuffer.
+int LL_sendBuffer(int nTXdata, int debug);
+
 // Function to receive a frame and return a block of data.
 int LL_receive(byte_t *dataRx, int maxData, int debug);
 
-// Function to return the optimum size of a data block.
+// Function to receive a frame and point to the block of data in it, where
+// it is, without copying it.  The data stays there until LL_releaseRx().
+int LL_receiveView(byte_t **dataRx, int debug);
+
+// Function to give back the block of data from LL_receiveView.
+int LL_releaseRx(int debug);
+
+// Function to return the optimum size of a data block, for the errors seen.
 int LL_getOptBlockSize(int debug);
 
+// Function to select the ARQ mode and sender window size.
+int LL_setARQ(int mode, int window, int debug);
+
+// Function to wait until all data blocks sent have been acknowledged.
+int LL_flush(int debug);
+
+// Function to select the error check used in the frame trailer.
+int LL_setCheck(int type, int debug);
+
+// Function to set the probability of simulated errors, for testing.
+int LL_setErrorRate(double prob, int debug);
+
+// Function to return the number of data frames sent, including re-sends.
+int LL_getFramesSent(int debug);
+
+// Function to fill in what has happened on the link since it connected.
+int LL_getStats(LL_stats *stats, int debug);
+
+// Function to turn the receive thread on or off, for two-way traffic.
+int LL_setRxThread(int on, int debug);
+
+// Function to set how long an ACK can wait, to go in a data frame.
+int LL_setAckDelay(double delay, int debug);
+
+// Function to select forward error correction, with parity bytes.
+int LL_setFEC(int nParity, int debug);
+
+// Function to select long frames, with a 16-bit size in the header.
+int LL_setLongFrames(int on, int debug);
+
+// Function to select the number of bits in sequence numbers.
+int LL_setSeqBits(int bits, int debug);
+
+// Function to set the receive buffer, the most data blocks held for
+// this program, which limits how far ahead the other end can send.
+int LL_setRxBuffer(int blocks, int debug);
+
+
+/* Functions to implement link layer protocol, on a given link.
+   Each does the same as the function above without "link" in its name,
+   but on the link given as its first argument, so one program can run
+   several links at once.  Make each link with LL_linkNew().  */
+
+// Function to make a new link, with the default settings.
+LL_link *LL_linkNew(void);
+
+// Function to free a link - it cannot be used after this.
+void LL_linkFree(LL_link *link);
+
+int LL_linkConnect(LL_link *link, char *portName, int debug);
+int LL_linkDiscon(LL_link *link, int debug);
+int LL_linkSend(LL_link *link, byte_t *dataTx, int nTXdata, int debug);
+int LL_linkGetTxBuffer(LL_link *link, byte_t **buffer, int debug);
+int LL_linkSendBuffer(LL_link *link, int nTXdata, int debug);
+int LL_linkReceive(LL_link *link, byte_t *dataRx, int maxData, int debug);
+int LL_linkReceiveView(LL_link *link, byte_t **dataRx, int debug);
+int LL_linkReleaseRx(LL_link *link, int debug);
+int LL_linkGetOptBlockSize(LL_link *link, int debug);
+int LL_linkSetARQ(LL_link *link, int mode, int window, int debug);
+int LL_linkFlush(LL_link *link, int debug);
+int LL_linkSetCheck(LL_link *link, int type, int debug);
+int LL_linkSetErrorRate(LL_link *link, double prob, int debug);
+int LL_linkGetFramesSent(LL_link *link, int debug);
+int LL_linkGetStats(LL_link *link, LL_stats *stats, int debug);
+int LL_linkSetRxThread(LL_link *link, int on, int debug);
+int LL_linkSetAckDelay(LL_link *link, double delay, int debug);
+int LL_linkSetFEC(LL_link *link, int nParity, int debug);
+int LL_linkSetLongFrames(LL_link *link, int on, int debug);
+int LL_linkSetSeqBits(LL_link *link, int bits, int debug);
+int LL_linkSetRxBuffer(LL_link *link, int blocks, int debug);
+
 
 // ==========================================================
 // Functions called by the main link layer functions above
 
-// Function to build a frame around a block of data.
-int buildDataFrame(byte_t *frameTx, byte_t *dataTx, int nData, int seq);
+// Function to build a frame around a block of data, where it is - there
+// must be TX_HEADROOM bytes before the data and TX_TAILROOM after it.
+int buildDataFrame(LL_link *link, byte_t *frameTx, byte_t *dataTx,
+                   int nData, int seq);
+
+// Function to add byte stuffing to a frame, ready to send.
+int stuffFrame(byte_t *frameTx, byte_t *frame, int sizeFrame);
 
 // Function to get a frame from bytes received by the physical layer.
-int getFrame(byte_t *frameRx, int maxSize, float timeLimit);
+int getFrame(LL_link *link, byte_t *frameRx, int maxSize, float timeLimit);
+
+// Function to get the next frame of one kind, from a queue or the port.
+int nextFrame(LL_link *link, int wantData, byte_t *frame, int maxSize,
+              float timeLimit);
+
+// Function to put a frame in the receive queue for its kind.
+void queueFrame(LL_link *link, int isData, byte_t *frame, int sizeFrame);
+
+// Function to sort a received frame into the receive queues, unless it
+// is the kind wanted by the caller.
+int routeFrame(LL_link *link, byte_t *frame, int sizeFrame, int want);
+
+// Function to find the kind of a frame from its header.
+int frameType(LL_link *link, byte_t *frame, int sizeFrame);
+
+// Function to check the header of a frame as it arrives.
+int checkHeader(LL_link *link, byte_t *frameRx, int nRx, int maxSize,
+                int *frameSize);
+
+// Function to drop a damaged frame from the start of the bytes received.
+int dropFrame(byte_t *frameRx, int nRx);
 
 // Function to check a frame for errors.
-int checkFrame(byte_t *frameRx, int sizeFrame);
+int checkFrame(LL_link *link, byte_t *frameRx, int sizeFrame);
+
+// Function to process a received frame, to find the data in it.
+int processFrame(LL_link *link, byte_t *frameRx, int sizeFrame,
+                 byte_t **dataRx, int *seqNum);
 
-// Function to process a received frame.
-int processFrame(byte_t *frameRx, int sizeFrame,
-                 byte_t *dataRx, int maxData, int *seqNum);
+// Function to build an acknowledgement frame, before stuffing.
+int buildAckFrame(LL_link *link, byte_t *ackFrame, int type, int seq,
+                  int room);
 
 // Function to send an acknowledgement - positive or negative.
-int sendAck(int type, int seq, int debug);
+int sendAck(LL_link *link, int type, int seq, int debug);
+
+// Function to work out how many data blocks this end has room for.
+int rxRoom(LL_link *link);
+
+// Function to acknowledge a data frame, in a data frame if one goes soon.
+int ackLater(LL_link *link, int seq, int debug);
+
+// Function to send the ACK that is waiting, if its time is up.
+int sendDelayedAck(LL_link *link, int force, int debug);
+
+// Function to ask for a missing block again, with a NAK.
+int sendNak(LL_link *link, int seq, int again, int debug);
+
+// Function to ask for a damaged data frame again, with a NAK.
+int nakBadFrame(LL_link *link, byte_t *frameRx, int sizeFrame, int expected,
+                int debug);
+
+// Function to send a block of data using the sliding window.
+int sendPipelined(LL_link *link, int nTXdata, int debug);
+
+// Function to wait until the other end has room for another data block.
+int waitForRoom(LL_link *link, int debug);
+
+// Function to note the room the other end has, from a response.
+int noteRoom(LL_link *link, byte_t *frame, int sizeFrame);
+
+// Function to agree the settings with the other end, at connect.
+int setupLink(LL_link *link, int debug);
+
+// Function to send a setup frame, offering this end's settings.
+int sendSetup(LL_link *link, int heard, int debug);
+
+// Function to check a setup frame for errors.
+int checkSetupFrame(byte_t *frame, int sizeFrame);
+
+// Function to work out the settings to use, from the other end's offer.
+void agreeSettings(LL_link *link, byte_t *offer, int debug);
+
+// Function to wait for one response to the frames in the window.
+int waitWindowAck(LL_link *link, int debug);
+
+// Function to re-send frames from the window when a NAK is received.
+int handleNak(LL_link *link, int seq, int debug);
+
+// Function to re-send one frame from the window.
+int resendFrame(LL_link *link, int seq, double now);
+
+// Function to deal with a good frame received in selective repeat mode.
+int receiveSelRepeat(LL_link *link, byte_t *frameRx, int sizeFrame,
+                     int expected, int debug);
 
 // ==========================================================
 // Helper functions used by various other functions
 
 // Function to advance the sequence number
-int next(int seq);
+int next(LL_link *link, int seq);
+
+// Function to return the size of a frame, from its header.
+int sizeField(LL_link *link, byte_t *header);
+
+// Function to return the sequence number, from a frame header.
+int seqField(LL_link *link, byte_t *header);
+
+// Function to return the ACK carried in a frame header, or -1 if none.
+int ackField(LL_link *link, byte_t *header);
+
+// Function to put the sequence number and the ACK carried in a header.
+void putSeqFields(LL_link *link, byte_t *header, int seq, int ack);
+
+// Function to return the number of FEC parity bytes for the bytes covered.
+int fecParity(LL_link *link, int nCovered);
+
+// Function to calculate the error check value over a block of bytes.
+unsigned long checkValue(LL_link *link, byte_t *bytes, int nBytes);
+
+// Function to read a clock that counts seconds, for measuring intervals.
+double timeNow(void);
+
+// Function to update the round trip time estimates with a new sample.
+void updateRTT(LL_link *link, double sample);
+
+// Function to double the retransmission timeout, after a timeout.
+void backoffRTO(LL_link *link);
+
+// Function to set the retransmission timeout from the estimates.
+void resetRTO(LL_link *link);
+
+// Function to update the error rate estimate with a frame sent or received.
+void noteFrameResult(LL_link *link, int nBytes, int good);
+
+// Function to count a frame received, and add it to the estimate as well.
+void noteFrameRx(LL_link *link, int nBytes, int good);
 
 // Function to set time limit at a point in the future.
 long timeSet(float limit);
@@ -1,9 +1,57 @@
 /* Functions to implement a link layer protocol:
-   LL_connect() connects to another computer;
+   LL_connect() connects to another computer, and agrees the settings;
    LL_discon()  disconnects;
    LL_send()    sends a block of data;
+   LL_getTxBuffer() and LL_sendBuffer() send a block of data put straight
+                into the link layer's buffer, without copying it
    LL_receive() waits to receive a block of data;
-   LL_getOptBlockSize()  returns the optimum size of data block
+   LL_receiveView() and LL_releaseRx() receive a block of data, left in
+                the link layer's buffer, without copying it
+   LL_getOptBlockSize()  returns the optimum size of data block, for the
+                         errors seen so far on the link
+   LL_setARQ()  selects stop-and-wait, Go-Back-N or selective repeat,
+                and the window size
+   LL_flush()   waits until all blocks sent have been acknowledged
+   LL_setCheck() selects the error check: checksum, CRC-16 or CRC-32C
+   LL_setErrorRate()  sets the probability of simulated errors
+   LL_getFramesSent() returns the number of data frames sent
+   LL_getStats() fills in the counts, rates and timing for the link,
+                at any time while it is connected
+   LL_setRxThread() turns the receive thread on or off
+   LL_setAckDelay() sets how long an ACK can wait to go in a data frame
+   LL_setFEC()  selects forward error correction for data frames
+   LL_setLongFrames()  selects long frames, with a 16-bit size, for
+                       blocks of up to MAX_JUMBO bytes
+   LL_setSeqBits()  selects wider sequence numbers, for a bigger window
+   LL_setRxBuffer() sets how many data blocks can wait for the program
+   Each of these works on one link, the default link.  A program that
+   needs several links at once makes each one with LL_linkNew(), and uses
+   the LL_link...() functions instead, e.g. LL_linkSend(link, ...), which
+   take the link as their first argument.  Each link has its own port,
+   sequence numbers, buffers and counters.
+   At connect, each end sends setup frames, offering the settings it was
+   given: ARQ mode, window, frame size, error check, sequence number size
+   and FEC.  Both ends
+   then use the same settings, worked out from the two offers, so they
+   need not be given the same settings by hand.
+   Each frame has a type in its header, so data frames can be told apart
+   from ACKs and NAKs.  Frames received are sorted into two queues: data
+   for LL_receive, and responses for the sender.  Without a receive
+   thread, whichever function is waiting reads the port, and queues any
+   frame of the other kind for later.  With the receive thread, turned
+   on by LL_setRxThread, the thread reads the port all the time, so data
+   can be sent and received at once in both directions on one link.
+   When data is going both ways, the ACK for a data frame received waits
+   a little, so it can go in the header of the next data frame sent,
+   rather than in a frame of its own.
+   A damaged data frame, or a gap in the sequence numbers, is answered
+   at once with a NAK naming the block needed, and the sender re-sends
+   it straight away, rather than waiting for its timer to run out.
+   Each ACK and NAK also says how many more data blocks the receiver has
+   room for, so a sender cannot run ahead of a program that is slow to
+   take its data: it stops when there is no room, and asks again with a
+   window probe, instead of sending frames that wait so long for their
+   ACKs that they are sent again.
    All functions take a debug argument - if non-zero, they print
    messages explaining what is happening.  Regardless of debug,
    functions print messages when things go wrong.
@@ -14,56 +62,413 @@
 
 
 #include <stdio.h>      // input-output library: print & file operations
+#include <stdlib.h>     // for calloc, free
 #include <time.h>       // for timing functions
+#include <string.h>     // for memchr, memmove, memcpy, strncmp
+#include <math.h>       // for log and exp, in the block size estimate
+#include <pthread.h>    // for the receive thread
 #include "physical.h"   // physical layer functions
 #include "linklayer.h"  // these functions
+#include "crc.h"        // CRC functions for error checking
+#include "stuffing.h"   // byte stuffing functions
+#include "rs.h"         // Reed-Solomon code, for forward error correction
+#include "pool.h"       // frame buffer pools, for the windows
+#include "log.h"        // messages, kept in a ring, some left out of the build
+
+/* Slot in the window arrays for a sequence number.  The sequence numbers
+   either fit in the arrays, or go round a whole number of times, so the
+   frames in any window get different slots.  */
+#define SLOT(seq) ((seq) % MAX_WINDOW)
+
+/* A queue of received frames of one kind, oldest first.  The headers
+   have been checked, to find the kind, but the rest has not.  Each frame
+   is in a buffer from the queue's own pool, made at connect, so the
+   queue only takes the memory the settings agreed need.  */
+typedef struct
+{
+    framePool pool;         // buffers for the frames, after unstuffing
+    byte_t **frames;        // the buffer in each slot
+    int *size;              // size of the frame in each slot
+    int slots;              // number of slots - most frames waiting
+    int head;               // slot holding the oldest frame
+    int count;              // number of frames waiting
+} frameQueue;
+
+/* Everything about one link: its port, sequence numbers, settings,
+   frame buffers and counters.  Each link has its own, so one program
+   can run several links at once.  */
+struct LL_link
+{
+    PHY_port *port;         // physical layer port, once connected
+    int seqNumTx;           // sequence number of transmit data block
+    int lastSeqRx;          // sequence number of last good block received
+    int connected;          // keep track of state of connection
+    int framesSent;         // count of frames sent
+    int acksSent;           // count of ACKs sent
+    int naksSent;           // count of NAKs sent
+    int acksRx;             // count of ACKs received
+    int naksRx;             // count of NAKs received
+    int badFrames;          // count of bad frames received
+    int goodFrames;         // count of good frames received
+    int timeouts;           // count of timeouts
+    long timerRx;           // time value for timeouts at receiver
+    double connectTime;     // time when connection was established, from
+                            // timeNow(), so it is not upset by clock changes
+    int blocksSent;         // count of new data blocks sent
+    long dataBytesTx;       // count of data bytes in them
+    long dataBytesRx;       // count of data bytes returned to the program
+    long lineBytesTx;       // count of bytes sent on the port
+    long lineBytesRx;       // count of bytes taken from the port
+    int checkType;          // error check in use
+    int checkLen;           // number of check bytes for that type
+    int trailerSize;        // check bytes plus end marker
+    int fecLen;             // FEC parity bytes in each data frame, or 0
+    int fecFixed;           // count of frames corrected by FEC
+    int longFrames;         // TRUE for long frames, with a 16-bit size
+    int headerSize;         // bytes in the header, from the settings
+    int maxBlock;           // most data bytes in a frame
+    int seqBits;            // bits in sequence numbers: 4, 8 or 16
+    int modSeq;             // modulo for sequence numbers
+
+    /* Settings this end was given, which it offers at connect.  The ones
+       in use while connected are those agreed with the other end, and
+       these are put back at disconnect.  */
+    int wantArq;            // ARQ mode
+    int wantWindow;         // sender window
+    int wantCheck;          // error check type
+    int wantFec;            // FEC parity bytes
+    int wantLong;           // TRUE for long frames
+    int wantSeqBits;        // bits in sequence numbers
+    int setupDone;          // TRUE once the settings have been agreed
+    int setupAgain;         // TRUE if the other end is still asking
+    double probErr;         // probability of simulated error on receive
+
+    /* Round trip time estimates, used to set the sender's waiting time.
+       These follow the usual smoothed mean and mean deviation method, with
+       Karn's rule: frames that were re-sent are not measured, as there is
+       no way to know which copy the ACK was for.  */
+    double srtt;            // smoothed round trip time, seconds
+    double rttvar;          // smoothed mean deviation of round trip time
+    double rto;             // retransmission timeout, seconds
+    int rttValid;           // TRUE once there has been a measurement
+
+    /* Error rate estimate, used to choose the block size.  Each frame
+       received, and each data frame sent, is a trial: it counts as damaged
+       if it failed its check, or was lost (a timeout or NAK), and as good
+       if it passed or was ACKed.  The counts are weighted, so the older
+       trials fade away, and the estimate follows changes in the line.  */
+    double errFrames;       // weighted count of frames seen
+    double errBad;          // weighted count of those damaged or lost
+    double errBytes;        // weighted count of bytes in those frames
+
+    /* Sliding window state for the pipelined modes.  The window holds the
+       frames that have been sent but not yet acknowledged, from baseTx up to
+       seqNumTx.  Frames are kept (in the slot for the sequence number) so
+       they can be re-sent, each in a buffer from the send pool.  In
+       selective repeat, frames can be ACKed out of order.  */
+    int arqMode;            // ARQ mode in use
+    int txWindow;           // max number of unacknowledged frames
+    int baseTx;             // sequence number of oldest unacknowledged frame
+    int nOutstanding;       // number of frames sent but not yet ACKed
+    int windowTries;        // timeouts and NAKs in a row without progress
+    byte_t *txFrames[MAX_WINDOW]; // frames kept for re-sending
+    int txFrameSize[MAX_WINDOW];  // size of each frame kept
+    byte_t *txPlain[MAX_WINDOW];  // each frame before stuffing, built
+                                  // around its data, to rebuild it - in
+                                  // the same buffer as the frame
+    int txDataSize[MAX_WINDOW];   // number of data bytes in each frame
+    int txAcked[MAX_WINDOW];      // selective repeat: frame has been ACKed
+    double txSentTime[MAX_WINDOW]; // time each frame was last sent
+    int txResent[MAX_WINDOW];     // frame has been sent more than once
+
+    /* Selective repeat receive window: good frames that arrive ahead of the
+       expected one are kept here, until the frames before them arrive.  */
+    byte_t *rxFrames[MAX_WINDOW]; // frames received early
+    int rxFrameSize[MAX_WINDOW];  // size of each frame kept
+    int rxBuffered[MAX_WINDOW];   // TRUE if a frame is waiting in the slot
+    int rxNaked[MAX_WINDOW];      // TRUE if a NAK has asked for this block
+
+    /* Frame buffers for the windows, from pools made at connect, sized
+       for the window and frame format agreed.  Each buffer in the send
+       pool holds a frame's data, with room around it, then the frame
+       after stuffing.  The receive pool has a buffer for each frame kept
+       in the receive window, and one for the frame arriving, which is
+       swapped into the window if the frame is kept, not copied.  */
+    framePool txPool;       // buffers for the send window
+    framePool rxPool;       // buffers for frames received
+    int txPlainSize;        // bytes before the stuffed frame, in a buffer
+    int rxFrameBytes;       // most bytes in a frame received
+
+    // Frame buffers for sending and receiving
+    byte_t frameTx[MAX_FRAME];    // stop-and-wait frame being sent
+    byte_t plainTx[TX_PLAIN];     // the same frame, before stuffing
+    byte_t *frameRx;              // frame being received, from the pool
+    byte_t frameAck[MAX_FRAME];   // response being received - room for a
+                                  // data frame, which can arrive instead
+
+    /* Receive queues, and the receive thread that fills them if it is on.
+       The lock protects the queues and the thread's state, and the
+       counters and error estimate that the sender and the receiver both
+       change - everything else belongs to the functions called by the
+       program.  Sending has a lock of its own, so frames from the sender
+       and the receiver go out one at a time, and are paced in turn.  */
+    frameQueue dataQ;       // data frames, for LL_receive
+    frameQueue ackQ;        // ACKs and NAKs, for the sender
+    pthread_mutex_t rxLock; // lock for the queues, and shared counters
+    pthread_mutex_t txLock; // lock for sending on the port
+    pthread_cond_t rxArrived;  // signalled when a frame is queued
+    pthread_t rxThread;     // the receive thread
+    int useRxThread;        // TRUE to run the thread while connected
+    int rxRunning;          // TRUE while the thread is running
+    int rxError;            // code from the port if the thread failed
+    int rxDropped;          // frames dropped as a queue was full
+    int loopback;           // TRUE on the loopback port, which sends and
+                            // receives through one buffer, so no thread
+
+    /* Delayed ACK: while this end is sending data too, the ACK for a data
+       frame received waits a little, so it can go in the header of the
+       next data frame, instead of in a frame of its own.  It waits for
+       about the time between data frames sent, measured as they are built.
+       The sender and LL_receive can be in different threads, so the lock
+       protects all this.  */
+    double ackDelay;        // longest time an ACK can wait, seconds
+    int ackPending;         // TRUE if an ACK is waiting to be sent
+    int ackSeq;             // sequence number it acknowledges
+    long ackDue;            // time it must be sent by, in ms
+    int txActive;           // TRUE while this end has data to send
+    double lastBuilt;       // time the last data frame was built, seconds
+    double txGap;           // smoothed time between data frames, seconds
+    int acksCarried;        // count of ACKs sent in data frames
+
+    /* Flow control.  Each response says how many data blocks the other
+       end has room for, and the sender counts the new blocks it sends
+       after that.  The receive side counts the blocks it holds for its
+       program, under the lock, as the sender may want them too.  */
+    int peerRoom;           // room at the other end, from its last response
+    int sentSinceRoom;      // new data blocks sent since then
+    int probesSent;         // count of window probes sent
+    int probed;             // TRUE if the window was probed, and has not
+                            // moved since
+    int probeAsked;         // TRUE if the other end has sent a probe
+    int rxBuffer;           // most data blocks held for this program
+    int rxKept;             // selective repeat: blocks kept in the window
+
+    /* Block lent to the program by LL_receiveView, until it gives it back.
+       In selective repeat it may be in a slot of the receive window, which
+       is not free again until then.  */
+    int viewHeld;           // TRUE while the program has a block
+    int viewSlot;           // receive window slot it is in, or -1
+};
+
+/* The link used by the functions without a link argument (LL_connect,
+   LL_send, ...), made when it is first needed.  */
+static LL_link *defaultLink = NULL;
+
+static int startRxThread(LL_link *link);
+static void stopRxThread(LL_link *link);
+static void *rxThreadMain(void *arg);
+static void setTxActive(LL_link *link, int active);
+static void setFormat(LL_link *link, int longFrames, int seqBits);
+static int windowLimit(int mode, int modSeq);
+static void restoreSettings(LL_link *link);
+static int fecCorrect(LL_link *link, byte_t *covered, int nCovered);
+static void restartTimers(LL_link *link);
+static int makePools(LL_link *link);
+static void freePools(LL_link *link);
+static int makeQueues(LL_link *link, int slots);
+static void freeQueue(frameQueue *queue);
+static void putFrame(LL_link *link, frameQueue *queue, byte_t *frame,
+                     int sizeFrame);
+static void slideWindow(LL_link *link, int nFrames);
+static int portSend(LL_link *link, byte_t *bytes, int nBytes);
 
-/* These variables need to retain their values between function calls, so they
-   are declared as static.  By declaring them outside any function, they are
-   made available to all the functions in this file.  */
-static int seqNumTx;        // sequence number of transmit data block
-static int lastSeqRx;       // sequence number of last good block received
-static int connected = FALSE;   // keep track of state of connection
-static int framesSent = 0;  // count of frames sent
-static int acksSent = 0;    // count of ACKs sent
-static int naksSent = 0;    // count of NAKs sent
-static int acksRx = 0;      // count of ACKs received
-static int naksRx = 0;      // count of NAKs received
-static int badFrames = 0;   // count of bad frames received
-static int goodFrames = 0;  // count of good frames received
-static int timeouts = 0;    // count of timeouts
-static long timerRx;        // time value for timeouts at receiver
-static long connectTime;    // time when connection was established
-
-// ===========================================================================
-/* Function to connect to another computer.
-   It just calls PHY_open() and reports any problem.
-   It also initialises counters for debug purposes.  */
-int LL_connect(char *portName, int debug)
+// ===========================================================================
+/* Function to make a new link, not yet connected.
+   It starts with the default settings from the header file, which can be
+   changed with the LL_linkSet...() functions before it is connected.
+   Returns the link, or NULL if there is no memory for it.  */
+LL_link *LL_linkNew(void)
+{
+    LL_link *link;  // the new link
+    pthread_condattr_t attr;  // to make the condition use the monotonic clock
+
+    link = calloc(1, sizeof(LL_link));  // everything starts at zero
+    if (link == NULL)
+    {
+        printf("LL: No memory for a new link\n");
+        return NULL;
+    }
+    link->connected = FALSE;
+    link->port = NULL;
+    link->probErr = PROB_ERR;
+    link->rto = TX_WAIT;
+    link->rttValid = FALSE;
+    link->arqMode = ARQ_MODE;
+    link->txWindow = TX_WINDOW;
+    LL_linkSetCheck(link, CHECK_TYPE, FALSE);  // sets the trailer size too
+    link->fecLen = FEC_PARITY;
+    link->seqBits = SEQ_BITS;  // the frame format depends on this too
+    LL_linkSetLongFrames(link, LONG_FRAMES, FALSE);  // sets the header size too
+
+    // Waits for queued frames use deadlines from the physical layer clock
+    pthread_mutex_init(&link->rxLock, NULL);
+    pthread_mutex_init(&link->txLock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&link->rxArrived, &attr);
+    pthread_condattr_destroy(&attr);
+    link->useRxThread = FALSE;
+    link->rxRunning = FALSE;
+    link->ackDelay = ACK_DELAY;
+    link->rxBuffer = RX_BUFFER;
+    return link;
+}
+
+
+// ===========================================================================
+/* Function to free a link made by LL_linkNew().  If it is still connected,
+   its port is closed, without waiting for frames in flight - use
+   LL_linkDiscon() first for that.  The link cannot be used after this.  */
+void LL_linkFree(LL_link *link)
+{
+    if (link == NULL) return;
+    stopRxThread(link);
+    if (link->connected) PHY_close(link->port);
+    freePools(link);
+    pthread_cond_destroy(&link->rxArrived);
+    pthread_mutex_destroy(&link->rxLock);
+    pthread_mutex_destroy(&link->txLock);
+    free(link);
+}
+
+
+// ===========================================================================
+/* Function to connect to another computer, using the given link.
+   It opens the port with PHY_open(), and reports any problem, then
+   resets the counters for the report, makes the receive queues, and
+   starts the receive thread if it has been turned on.  Then it agrees
+   the settings with the other end, waiting up to CONNECT_WAIT for it
+   (not in simple mode), and makes the frame buffer pools for the window
+   and frame format agreed.  If any step fails, the port is closed
+   again and the link keeps its own settings.
+   Returns SUCCESS, or a negative value if it fails.  */
+int LL_linkConnect(LL_link *link, char *portName, int debug)
 {
+    int i;  // for use in loop
+    int retCode;  // return code from PHY_open
+
+    // Make sure the frame sizes match the error check selected,
+    // and that the CRC tables are ready before any frames are built
+    LL_linkSetCheck(link, link->checkType, FALSE);
+    CRC_init();
+
+    // A link that is still connected gives up its old port
+    stopRxThread(link);
+    if (link->connected)
+    {
+        PHY_close(link->port);
+        link->connected = FALSE;
+        restoreSettings(link);
+        freePools(link);
+    }
+
     // Try to connect using port number given, bit rate as in header file,
     // always uses 8 data bits, no parity, fixed time limits.
-    int retCode = PHY_open(portName,BIT_RATE,8,0,1000,50,PROB_ERR);
+    retCode = PHY_open(&link->port,portName,BIT_RATE,8,0,1000,50,link->probErr);
     if (retCode == SUCCESS)   // check if succeeded
     {
-        connected = TRUE;   // record that we are connected
-        seqNumTx = 0;       // set first sequence number for sender
-        lastSeqRx = -1;     // set an impossible value for last seq. received
-        framesSent = 0;     // initialise all counters for this new connection
-        acksSent = 0;
-        naksSent = 0;
-        acksRx = 0;
-        naksRx = 0;
-        badFrames = 0;
-        goodFrames = 0;
-        timeouts = 0;
-        connectTime = time(NULL);  // capture time when connection was established
+        link->connected = TRUE;   // record that we are connected
+        link->seqNumTx = 0;       // set first sequence number for sender
+        link->baseTx = 0;         // window starts empty, at the first sequence number
+        link->nOutstanding = 0;
+        link->windowTries = 0;
+        link->lastSeqRx = -1;     // set an impossible value for last seq. received
+        link->rttValid = FALSE;   // no round trip time measured yet,
+        link->rto = TX_WAIT;      // so wait as long as allowed at first
+        for (i = 0; i < MAX_WINDOW; i++)  // both windows start empty
+        {
+            link->txAcked[i] = FALSE;
+            link->rxBuffered[i] = FALSE;
+            link->rxNaked[i] = FALSE;
+        }
+        link->framesSent = 0;     // initialise all counters for this new connection
+        link->blocksSent = 0;
+        link->dataBytesTx = 0;
+        link->dataBytesRx = 0;
+        link->lineBytesTx = 0;
+        link->lineBytesRx = 0;
+        link->acksSent = 0;
+        link->naksSent = 0;
+        link->acksRx = 0;
+        link->naksRx = 0;
+        link->badFrames = 0;
+        link->goodFrames = 0;
+        link->timeouts = 0;
+        link->fecFixed = 0;
+        link->errFrames = 0.0;    // nothing known about errors yet,
+        link->errBad = 0.5;       // so assume half a frame was damaged
+        link->errBytes = 0.0;
+        link->rxDropped = 0;      // the queues were freed at disconnect
+        link->ackPending = FALSE;  // no ACK waiting, and no data to send
+        link->txActive = FALSE;
+        link->lastBuilt = 0.0;
+        link->txGap = 0.0;
+        link->acksCarried = 0;
+        link->peerRoom = MAX_WINDOW;  // nothing heard yet - the window limits it
+        link->sentSinceRoom = 0;
+        link->probesSent = 0;
+        link->probed = FALSE;
+        link->probeAsked = FALSE;
+        link->rxKept = 0;
+        link->viewHeld = FALSE;
+        link->viewSlot = -1;
+        link->loopback = (strncmp(portName, "loop", 4) == 0);
+        link->wantArq = link->arqMode;  // settings to offer the other end
+        link->wantWindow = link->txWindow;
+        link->wantCheck = link->checkType;
+        link->wantFec = link->fecLen;
+        link->wantLong = link->longFrames;
+        link->wantSeqBits = link->seqBits;
+        link->setupDone = FALSE;
+        link->setupAgain = FALSE;
+
+        // Frames can arrive while the settings are agreed, so the queues
+        // are needed from the start, with room for a few of them
+        if ((makeQueues(link, RX_QUEUE_SETUP) != SUCCESS)
+            || (link->useRxThread && (startRxThread(link) != SUCCESS)))
+        {
+            PHY_close(link->port);
+            link->port = NULL;
+            link->connected = FALSE;
+            freePools(link);
+            return FAILURE;
+        }
+
+        // Agree the settings with the other end - in simple mode, there
+        // may not be one, so this end just uses its own
+        retCode = (debug == SIMPLE) ? SUCCESS : setupLink(link, debug);
+        // Then make the frame buffers, for the window and frames agreed
+        if (retCode == SUCCESS) retCode = makePools(link);
+        if (retCode != SUCCESS)
+        {
+            stopRxThread(link);
+            PHY_close(link->port);
+            link->port = NULL;
+            link->connected = FALSE;
+            restoreSettings(link);
+            freePools(link);
+            return retCode;
+        }
+        pthread_mutex_lock(&link->rxLock);
+        link->setupDone = TRUE;
+        pthread_mutex_unlock(&link->rxLock);
+        link->connectTime = timeNow();  // capture time when connection was established
         if (debug) printf("LL: Connected\n");
         return SUCCESS;
     }
     else  // failed
     {
-        connected = FALSE;  // record that we are not connected
+        link->connected = FALSE;  // record that we are not connected
         printf("LL: Failed to connect, PHY returned code %d\n",retCode);
         return -retCode;  // return a negative value to indicate failure
     }
@@ -71,24 +476,52 @@ int LL_connect(char *portName, int debug)
 
 
 // ===========================================================================
-/* Function to disconnect from the other computer.
+/* Function to disconnect from the other computer, using the given link.
    It just calls PHY_close() and prints a report of what happened.  */
-int LL_discon(int debug)
+int LL_linkDiscon(LL_link *link, int debug)
 {
-    long elapsedTime = time(NULL) - connectTime;  // measure time connected
-    float connTime = ((float) elapsedTime ) / CLOCKS_PER_SEC; // convert to seconds
-    int retCode = PHY_close();  // try to disconnect
-    connected = FALSE;  // assume we are no longer connected
+    double connTime = timeNow() - link->connectTime;  // measure time connected
+    int retCode;
+
+    // Give any frames still in the window a chance to be acknowledged
+    if (link->connected && (link->nOutstanding > 0)) LL_linkFlush(link, debug);
+    if (link->connected) sendDelayedAck(link, TRUE, debug);  // last ACK goes now
+    stopRxThread(link);  // the port is about to go
+
+    retCode = PHY_close(link->port);  // try to disconnect
+    link->port = NULL;
+    if (link->connected)  // assume we are no longer connected
+    {
+        link->connected = FALSE;
+        restoreSettings(link);  // back to this end's own settings
+        freePools(link);        // the frames in them are finished with
+    }
     if (retCode == SUCCESS)   // check if succeeded
     {
         // Print the report - have to print all the counters,
         // as we don't know if we were sending or receiving
         printf("\nLL: Disconnected after %.2f s.  Sent %d data frames\n",
-               connTime, framesSent);
+               connTime, link->framesSent);
         printf("LL: Received %d good and %d bad frames, had %d timeouts\n",
-               goodFrames, badFrames, timeouts);
-        printf("LL: Sent %d ACKs and %d NAKs\n", acksSent, naksSent);
-        printf("LL: Received %d ACKs and %d NAKs\n", acksRx, naksRx);
+               link->goodFrames, link->badFrames, link->timeouts);
+        printf("LL: Sent %d ACKs and %d NAKs, and %d ACKs in data frames\n",
+               link->acksSent, link->naksSent, link->acksCarried);
+        printf("LL: Received %d ACKs and %d NAKs\n", link->acksRx, link->naksRx);
+        printf("LL: Sent %ld data bytes in %ld bytes, received %ld in %ld\n",
+               link->dataBytesTx, link->lineBytesTx,
+               link->dataBytesRx, link->lineBytesRx);
+        if (link->probesSent > 0)
+            printf("LL: Sent %d window probes, as the other end had no room\n",
+                   link->probesSent);
+        if (link->fecLen > 0)
+            printf("LL: Corrected %d frames with %d FEC parity bytes\n",
+                   link->fecFixed, link->fecLen);
+        if (link->rxDropped > 0)
+            printf("LL: Dropped %d frames as a receive queue was full\n",
+                   link->rxDropped);
+        if (link->rttValid)
+            printf("LL: Smoothed round trip time %.3f s, timeout %.3f s\n",
+                   link->srtt, link->rto);
         return SUCCESS;
     }
     else  // failed
@@ -101,58 +534,176 @@ int LL_discon(int debug)
 
 // ===========================================================================
 /* Function to send a block of data in a frame.
-   Arguments:  dataTx is a pointer to an array of data bytes,
+   Arguments:  link is the link to use,
+               dataTx is a pointer to an array of data bytes,
+               nTXdata is the number of data bytes to send,
+               debug sets the mode of operation and controls printing.
+   The return value indicates success or failure.
+   The data is copied into the buffer for the next block, then sent with
+   LL_sendBuffer().  A program that can put its data straight into that
+   buffer saves the copy, by using LL_getTxBuffer() and LL_sendBuffer()
+   itself.  */
+int LL_linkSend(LL_link *link, byte_t *dataTx, int nTXdata, int debug)
+{
+    byte_t *buffer;  // buffer for the next block
+    int retVal;      // return value from other functions
+
+    retVal = LL_linkGetTxBuffer(link, &buffer, debug);
+    if (retVal < 0) return retVal;  // not connected, or link failed
+    if (nTXdata > retVal)
+    {
+        printf("LLS: Cannot send block of %d bytes, max block size %d\n",
+               nTXdata, retVal);
+        return BADUSE;  // problem code
+    }
+    memcpy(buffer, dataTx, nTXdata);
+    return LL_linkSendBuffer(link, nTXdata, debug);
+}
+
+
+// ===========================================================================
+/* Function to lend the program the buffer for the next data block.
+   The program puts the data straight into it, then sends it with
+   LL_sendBuffer(), so the data is not copied on its way to the port.
+   The buffer has room before it for the header, and after it for the
+   trailer, so the frame is built around the data where it is.  In the
+   pipelined modes it is a buffer from the send pool, in the window slot
+   for the next sequence number, where the data stays until it is ACKed,
+   so this first waits for room in the window, as LL_send would.  Nothing
+   else can be sent on the link until the block is sent.
+   Arguments:  link is the link to use,
+               buffer is a pointer to where the address of the buffer goes,
+               debug controls printing, and must be the same as for
+               LL_sendBuffer(), as simple mode uses the stop-and-wait buffer.
+   Returns the most data bytes the buffer can take, or a negative value
+   if the link is not connected, or failed while waiting.  */
+int LL_linkGetTxBuffer(LL_link *link, byte_t **buffer, int debug)
+{
+    int slot;    // window slot for the next frame
+    int retVal;  // return value from other functions
+
+    if (link->connected == FALSE)
+    {
+        printf("LLS: Attempt to send while not connected\n");
+        return BADUSE;  // problem code
+    }
+
+    if ((link->arqMode == ARQ_STOPWAIT) || (debug == SIMPLE))
+    {
+        *buffer = link->plainTx + TX_HEADROOM;
+        return link->maxBlock;
+    }
+
+    // The slot must not hold a frame still waiting for its ACK
+    setTxActive(link, TRUE);  // ACKs for data received can wait for this
+    while (link->nOutstanding >= link->txWindow)
+    {
+        retVal = waitWindowAck(link, debug);
+        if (retVal < 0) return retVal;  // link failed or gave up
+    }
+    slot = SLOT(link->seqNumTx);
+    if (link->txPlain[slot] == NULL)  // not lent out already
+    {
+        // There is a buffer for every frame the window can hold
+        link->txPlain[slot] = POOL_get(&link->txPool);
+        if (link->txPlain[slot] == NULL)
+        {
+            printf("LLS: No frame buffer free, %d in flight\n",
+                   link->nOutstanding);
+            return FAILURE;
+        }
+        link->txFrames[slot] = link->txPlain[slot] + link->txPlainSize;
+    }
+    *buffer = link->txPlain[slot] + TX_HEADROOM;
+    return link->maxBlock;
+}
+
+
+// ===========================================================================
+/* Function to send the block of data in the buffer from LL_getTxBuffer(),
+   in a frame.
+   Arguments:  link is the link to use,
                nTXdata is the number of data bytes to send,
                debug sets the mode of operation and controls printing.
    The return value indicates success or failure.
    If connected, builds a frame, then sends the frame using PHY_send.
    If debug is 1 (simple mode), it regards this as success, and returns.
    Otherwise, it waits for a reply, up to a time limit.
-   What happens after that is for you to decide...  */
-int LL_send(byte_t *dataTx, int nTXdata, int debug)
+   What happens after that is for you to decide...
+   In the pipelined modes the block is handed to sendPipelined() instead,
+   and SUCCESS means the frame is in the window, not yet that it was ACKed.  */
+int LL_linkSendBuffer(LL_link *link, int nTXdata, int debug)
 {
-    static byte_t frameTx[3*MAX_BLK];  // array large enough for frame
-    static byte_t frameAck[2*ACK_SIZE]; // twice expected ack frame size
+    byte_t *frameTx = link->frameTx;  // array large enough for frame
+    byte_t *frameAck = link->frameAck; // array to hold the response
     int sizeTXframe = 0;    // size of frame being transmitted
     int sizeAck = 0;        // size of ACK frame received
     int seqAck;             // sequence number in response received
     int attempts = 0;       // number of attempts to send this data
     int success = FALSE;    // flag to indicate block sent and ACKed
     int retVal;             // return value from other functions
+    double sentTime = 0.0;  // time the frame was first sent
 
     // First check if connected
-    if (connected == FALSE)
+    if (link->connected == FALSE)
     {
         printf("LLS: Attempt to send while not connected\n");
         return BADUSE;  // problem code
     }
 
     // Then check if block size OK - adjust limit for your design
-    if (nTXdata > MAX_BLK)
+    if (nTXdata > link->maxBlock)
     {
         printf("LLS: Cannot send block of %d bytes, max block size %d\n",
-               nTXdata, MAX_BLK);
+               nTXdata, link->maxBlock);
         return BADUSE;  // problem code
     }
 
+    // While there is data to send, ACKs for data received can wait for it
+    setTxActive(link, TRUE);
+
+    // Pipelined mode - the window takes care of waiting and re-sending
+    if ((link->arqMode != ARQ_STOPWAIT) && (debug != SIMPLE))
+        return sendPipelined(link, nTXdata, debug);
+
+    // The other end must have room for the block
+    if (debug != SIMPLE)
+    {
+        retVal = waitForRoom(link, debug);
+        if (retVal < 0) return retVal;  // link failed or gave up
+    }
+
     // Build the frame - sizeTXframe is the number of bytes in the frame
-    sizeTXframe = buildDataFrame(frameTx, dataTx, nTXdata, seqNumTx);
+    sizeTXframe = buildDataFrame(link, frameTx, link->plainTx + TX_HEADROOM,
+                                 nTXdata, link->seqNumTx);
 
     // Then loop, sending the frame and maybe waiting for response
     do
     {
         // Send the frame, then check for problems
-        retVal = PHY_send(frameTx, sizeTXframe);  // send frame bytes
+        retVal = portSend(link, frameTx, sizeTXframe);  // send frame bytes
         if (retVal != sizeTXframe)  // problem!
         {
-            printf("LLS: Block %d, failed to send frame\n", seqNumTx);
+            LOG_ERROR("LLS: Block %d, failed to send frame\n", link->seqNumTx);
             return FAILURE;  // problem code
         }
 
-        framesSent++;  // increment frame counter (for report)
         attempts++;    // increment attempt counter, so we don't try forever
+        pthread_mutex_lock(&link->rxLock);  // LL_linkGetStats reads them
+        link->framesSent++;  // increment frame counter (for report)
+        if (attempts == 1)
+        {
+            link->blocksSent++;    // a new block, for the statistics
+            link->dataBytesTx += nTXdata;
+        }
+        pthread_mutex_unlock(&link->rxLock);
+        if (attempts == 1)
+        {
+            sentTime = timeNow();  // start timing round trip
+            link->sentSinceRoom++; // uses some of the room at the other end
+        }
         if (debug) printf("LLS: Sent frame of %d bytes, block %d, attempt %d\n",
-                          sizeTXframe, seqNumTx, attempts);
+                          sizeTXframe, link->seqNumTx, attempts);
 
         // In simple mode, this is all we have to do (there are no responses)
         if (debug == SIMPLE)
@@ -161,8 +712,9 @@ int LL_send(byte_t *dataTx, int nTXdata, int debug)
             continue;       // and go straight to the while statement
         }
 
-        // Otherwise, we must wait to receive a response (ack or nak)
-        sizeAck = getFrame(frameAck, 2*ACK_SIZE, TX_WAIT);
+        // Otherwise, we must wait to receive a response (ack or nak),
+        // for as long as the round trip time estimates suggest
+        sizeAck = nextFrame(link, FALSE, frameAck, MAX_FRAME, link->rto);
         if (sizeAck < 0)  // some problem receiving
         {
             return FAILURE;  // quit if failed
@@ -170,40 +722,56 @@ int LL_send(byte_t *dataTx, int nTXdata, int debug)
         if (sizeAck == 0)  // this means timeout
         {
             if (debug) printf("LLS: Timeout waiting for response\n");
-            timeouts++;  // increment counter for report
+            pthread_mutex_lock(&link->rxLock);
+            link->timeouts++;  // increment counter for report
+            pthread_mutex_unlock(&link->rxLock);
+            noteFrameResult(link, sizeTXframe, FALSE);  // frame or ACK lost
+            backoffRTO(link);  // the estimate was too short - wait longer next time
             // What else should be done about that (if anything)?
             // If success remains FALSE, this loop will continue, so
             // it will re-transmit the frame and wait for a response...
         }
         else  // we have received a frame - check it
         {
-            if (checkFrame(frameAck, sizeAck) == FRAMEGOOD)  // good frame
+            if (checkFrame(link, frameAck, sizeAck) == FRAMEGOOD)  // good frame
             {
-                goodFrames++;  // increment counter for report
+                noteFrameRx(link, sizeAck, TRUE);  // counts it for report
+                noteRoom(link, frameAck, sizeAck);
                 // Extract some information from the response
-                seqAck = (int) frameAck[SEQNUMPOS]; // extract the sequence number
-                // If there is more than one type of response, extract the type
-                // Need to check if this is a positive ACK,
-                // and if it relates to the data block just sent...
-                if ( seqAck == seqNumTx )  // need a sensible test here!!
+                seqAck = seqField(link, frameAck); // extract the sequence number
+                // Check if this is a positive ACK,
+                // and if it relates to the data block just sent
+                if ((frameAck[TYPEPOS] == POSACK) && (seqAck == link->seqNumTx))
                 {
                     if (debug) printf("LLS: ACK received, seq %d\n", seqAck);
-                    acksRx++;           // increment counter for report
+                    pthread_mutex_lock(&link->rxLock);
+                    link->acksRx++;           // increment counter for report
+                    pthread_mutex_unlock(&link->rxLock);
+                    noteFrameResult(link, sizeTXframe, TRUE);  // it got there
                     success = TRUE;     // job is done
+                    // Measure round trip time, unless frame was re-sent
+                    if (attempts == 1) updateRTT(link, timeNow() - sentTime);
+                    else resetRTO(link);  // undo any backoff
                 }
                 else // could be NAK, or ACK for wrong block...
                 {
                     if (debug) printf("LLS: Response received, type %d, seq %d\n",
-                            0, seqAck );  // need sensible values here!!
-                    naksRx++;          // increment counter for report
-                    // What else should be done about this (if anything)?
-                    // If success remains FALSE, this loop will continue, so
-                    // it will re-transmit the frame and wait for a response...
+                            frameAck[TYPEPOS], seqAck);
+                    if (frameAck[TYPEPOS] == NEGACK)
+                    {
+                        pthread_mutex_lock(&link->rxLock);
+                        link->naksRx++;      // increment counter for report
+                        pthread_mutex_unlock(&link->rxLock);
+                        noteFrameResult(link, sizeTXframe, FALSE);  // damaged
+                    }
+                    // The frame did not arrive intact, so re-send it now:
+                    // success remains FALSE, so this loop will continue,
+                    // without waiting for the timeout...
                }
             }
             else  // bad frame received - errors found
             {
-                badFrames++;  // increment counter for report
+                noteFrameRx(link, sizeAck, FALSE);  // counts it for report
                 if (debug) printf("LLS: Bad frame received\n");
                 // No point in trying to extract anything from a bad frame.
                 // What else should be done about this (if anything)?
@@ -215,85 +783,149 @@ int LL_send(byte_t *dataTx, int nTXdata, int debug)
     }   // repeat all this until succeed or reach the limit
     while ((success == FALSE) && (attempts < MAX_TRIES));
 
+    setTxActive(link, FALSE);  // nothing more to send, for now
     if (success == TRUE)  // the data block has been sent and acknowledged
     {
-        seqNumTx = next(seqNumTx);  // increment the sequence number
+        link->seqNumTx = next(link, link->seqNumTx);  // increment the sequence number
+        link->baseTx = link->seqNumTx;          // keep the (empty) window in step
         return SUCCESS;
     }
     else    // maximum number of attempts has been reached, without success
     {
-        if (debug) printf("LLS: Block %d, tried %d times, failed\n",
-                          seqNumTx, attempts);
+        LOG_ERROR("LLS: Block %d, tried %d times, failed\n",
+                  link->seqNumTx, attempts);
         return GIVEUP;  // tried enough times, giving up
     }
 
-}  // end of LL_send
+}  // end of LL_sendBuffer
 
 
 // ===========================================================================
 /* Function to receive a frame and extract a block of data.
-   Arguments:  dataRx is a pointer to an array to hold the data block,
+   Arguments:  link is the link to use,
+               dataRx is a pointer to an array to hold the data block,
                maxData is the maximum size of the data block,
                debug sets the mode of operation and controls printing.
    The return value is the size of the data block, or negative on failure.
+   The block is received with LL_receiveView(), then copied into the array
+   and given back.  A program that can use the data where it is, in the
+   link layer's buffer, saves the copy by calling LL_receiveView() and
+   LL_releaseRx() itself.  */
+int LL_linkReceive(LL_link *link, byte_t *dataRx, int maxData, int debug)
+{
+    byte_t *view;  // the data block, in the link layer's buffer
+    int nRXdata;   // number of data bytes received
+
+    nRXdata = LL_linkReceiveView(link, &view, debug);
+    if (nRXdata < 0) return nRXdata;  // not connected, or failed
+    if (nRXdata > maxData) nRXdata = maxData;  // limit to the max allowed
+    memcpy(dataRx, view, nRXdata);
+    LL_linkReleaseRx(link, debug);
+    return nRXdata;
+}
+
+
+// ===========================================================================
+/* Function to receive a frame and point to the block of data in it.
+   The data is not copied: dataRx is set to point at it, in the frame
+   buffer where it arrived.  It stays there until the program gives it
+   back with LL_releaseRx(), or calls LL_receive again, which gives it
+   back first.  In selective repeat, a block taken from the receive window
+   keeps its slot, and its room in the receive buffer, until then.
+   Arguments:  link is the link to use,
+               dataRx is a pointer to where the address of the data goes,
+               debug sets the mode of operation and controls printing.
+   The return value is the size of the data block, or negative on failure.
    If connected, try to get a frame from the received bytes.
    If a frame is found, check if it is a good frame, with no errors.
    In simple mode, for good frames, data is extracted and the function returns.
    For bad frames, a block of ten # characters is returned as the data.
    In normal mode, the sequence number is also checked, and the function
    loops until it gets a good frame with the expected sequence number,
-   then returns with the data bytes from the frame.  */
-int LL_receive(byte_t *dataRx, int maxData, int debug)
+   then returns with the data bytes from the frame.
+   In selective repeat mode, good frames that arrive early are kept in the
+   receive window, and returned by later calls once the gap is filled.
+   In normal mode, damaged frames and missing blocks are asked for again
+   with a NAK, so the sender does not have to wait for a timeout.  */
+int LL_linkReceiveView(LL_link *link, byte_t **dataRx, int debug)
 {
-    static byte_t frameRx[3*MAX_BLK];  // create an array to hold the frame
+    byte_t *frameRx;      // buffer to hold the frame
     int nRXdata = 0;      // number of data bytes received
     int sizeRXframe = 0;  // number of bytes in the frame received
     int seqNumRx = 0;     // sequence number of the received frame
     int success = FALSE;  // flag to indicate success
     int attempts = 0;     // attempt counter
     int i = 0;            // used in for loop
-    int expected = next(lastSeqRx);  // calculate expected sequence number
+    int expected = next(link, link->lastSeqRx);  // calculate expected sequence number
 
     // First check if connected
-    if (connected == FALSE)
+    if (link->connected == FALSE)
     {
         printf("LLR: Attempt to receive while not connected\n");
         return BADUSE;  // problem code
     }
 
+    // The last block lent out is given back, as its buffer may be needed
+    LL_linkReleaseRx(link, debug);
+
+    // In selective repeat, the expected block may have arrived already.
+    // Its slot is not free again until the program gives it back.
+    if ((link->arqMode == ARQ_SELREPEAT) && (debug != SIMPLE)
+        && link->rxBuffered[SLOT(expected)])
+    {
+        nRXdata = processFrame(link, link->rxFrames[SLOT(expected)],
+                               link->rxFrameSize[SLOT(expected)],
+                               dataRx, &seqNumRx);
+        link->viewHeld = TRUE;
+        link->viewSlot = SLOT(expected);
+        pthread_mutex_lock(&link->rxLock);  // LL_linkGetStats reads it
+        link->dataBytesRx += nRXdata;
+        pthread_mutex_unlock(&link->rxLock);
+        link->lastSeqRx = expected;          // window moves on by one
+        if (debug) printf("LLR: Block %d with %d data bytes from window\n",
+                          seqNumRx, nRXdata);
+        return nRXdata;
+    }
+
     /* Loop to receive a frame, repeats until a frame is received.
        In normal mode, repeats until a good frame with the expected
        sequence number is received. */
     do
     {
         // First get a frame, up to size of frame array, with time limit.
-        // getFrame unction returns the number of bytes in the frame,
+        // nextFrame function returns the number of bytes in the frame,
         // or zero if it did not receive a frame within the time limit
         // or a negative value if there was some other problem.
-        sizeRXframe = getFrame(frameRx, 3*MAX_BLK, RX_WAIT);
+        // Responses to our own data frames are kept for the sender.
+        frameRx = link->frameRx;  // a new buffer, if the last frame was kept
+        sizeRXframe = nextFrame(link, TRUE, frameRx, link->rxFrameBytes, RX_WAIT);
         if (sizeRXframe < 0)  // some problem receiving
         {
             return FAILURE;  // quit if there was a problem
         }
 
-        attempts++;  // increment attempt counter
         if (sizeRXframe == 0)  // that means a timeout occurred
         {
-            printf("LLR: Timeout trying to receive frame, attempt %d\n",
-								attempts);
-            timeouts++; // increment the counter for the report
+            attempts++;  // increment attempt counter - only timeouts count,
+                         // as a pipelined sender may deliver several frames
+                         // out of order before the one we want arrives
+            LOG_INFO("LLR: Timeout trying to receive frame, attempt %d\n",
+                     attempts);
+            pthread_mutex_lock(&link->rxLock);
+            link->timeouts++; // increment the counter for the report
+            pthread_mutex_unlock(&link->rxLock);
             // No frame was received, so no response is needed
             // If success remains FALSE, loop will continue and try again...
         }
         else  // we have received a frame
         {
             if (debug) printf("LLR: Got frame, %d bytes, attempt %d\n",
-								        sizeRXframe, attempts);
+								        sizeRXframe, attempts+1);
 
             // Next step is to check it for errors
-            if (checkFrame(frameRx, sizeRXframe) == FRAMEBAD ) // frame is bad
+            if (checkFrame(link, frameRx, sizeRXframe) == FRAMEBAD ) // frame is bad
             {
-                badFrames++;  // increment bad frame counter
+                noteFrameRx(link, sizeRXframe, FALSE);  // counts it too
                 if (debug) printf("LLR: Bad frame received\n");
                 if (debug) printFrame(frameRx, sizeRXframe);
 
@@ -301,25 +933,38 @@ int LL_receive(byte_t *dataRx, int maxData, int debug)
                 if (debug == SIMPLE)  // simple mode
                 {
                     success = TRUE;  // pretend this is a success
-                    // Put some dummy bytes in the data array
-                    for (i=0; i<10; i++) dataRx[i] = 35; // # symbol
+                    // Put some dummy bytes in the frame array
+                    for (i=0; i<10; i++) frameRx[i] = 35; // # symbol
+                    *dataRx = frameRx;
                     nRXdata = 10;     // number of dummy bytes
                 }
-                else
+                else  // in normal mode, ask for the frame again
                 {
-                // In normal mode, this is not a success!
-                // Maybe send a response to the sender ?
-                // If so, what sequence number ?
-                // See the sendAck() function below.
+                    nakBadFrame(link, frameRx, sizeRXframe, expected, debug);
                 }
 
             }
+            else if ((link->arqMode == ARQ_SELREPEAT) && (debug != SIMPLE))
+            {
+                noteFrameRx(link, sizeRXframe, TRUE);  // counts it too
+                // ACK the frame, and keep it if it is early
+                success = receiveSelRepeat(link, frameRx, sizeRXframe, expected,
+                                           debug);
+                if (success == TRUE)  // the expected block - return it now
+                {
+                    nRXdata = processFrame(link, frameRx, sizeRXframe, dataRx,
+                                           &seqNumRx);
+                    link->lastSeqRx = seqNumRx;  // update last sequence number
+                    if (debug) printf("LLR: Received block %d with %d data bytes\n",
+                                      seqNumRx, nRXdata);
+                }
+            }
             else  // we have a good frame - process it
             {
-                goodFrames++;  // increment good frame counter
+                noteFrameRx(link, sizeRXframe, TRUE);  // counts it too
                 // Extract the data bytes and the sequence number
-                nRXdata = processFrame(frameRx, sizeRXframe, dataRx,
-                                     maxData, &seqNumRx);
+                nRXdata = processFrame(link, frameRx, sizeRXframe, dataRx,
+                                     &seqNumRx);
                 if (debug) printf("LLR: Received block %d with %d data bytes\n",
                                   seqNumRx, nRXdata);
 
@@ -329,14 +974,15 @@ int LL_receive(byte_t *dataRx, int maxData, int debug)
                 else if (seqNumRx == expected)  // got the expected data block
                 {
                     success = TRUE;  // job is done
-                    lastSeqRx = seqNumRx;  // update last sequence number
+                    link->lastSeqRx = seqNumRx;  // update last sequence number
+                    link->rxNaked[SLOT(seqNumRx)] = FALSE;  // got it, NAK or not
                     // Maybe send a response to the sender ?
                     // If so, what sequence number ?
                     // See the sendAck() function below.
-		    sendAck(POSACK, seqNumRx, debug); //ADDED
+		    ackLater(link, seqNumRx, debug); //ADDED
 
                 }
-                else if (seqNumRx == lastSeqRx) // got a duplicate data block
+                else if (seqNumRx == link->lastSeqRx) // got a duplicate data block
                 {
                     if (debug) printf("LLR: Duplicate rx seq. %d, expected %d\n",
                                   seqNumRx, expected);
@@ -345,15 +991,21 @@ int LL_receive(byte_t *dataRx, int maxData, int debug)
 		    //overwrite prev sent
 		    success = FALSE;  // job is done yet, let's wait for next frame
                     //  not needed: lastSeqRx = seqNumRx;  // update last sequence number
-		    sendAck(POSACK, seqNumRx, debug); // in case previous ACK was not received
+		    sendAck(link, POSACK, seqNumRx, debug); // in case previous ACK was not received
 
                 }
                 else // some other data block??
                 {
                     if (debug) printf("LLR: Unexpected block rx seq. %d, expected %d\n",
                                   seqNumRx, expected);
-                    // What should be done about this?
-		    sendAck(POSACK, lastSeqRx, debug);
+                    // The expected block is missing - ask for it with a NAK,
+                    // and a Go-Back-N sender will re-send everything from
+                    // there.  Once asked, repeat the ACK for the last block
+                    // received in order instead, which is cumulative, in
+                    // case the ACKs were lost.  Nothing to ACK yet if no
+                    // block has been received.
+		    if (!link->rxNaked[SLOT(expected)]) sendNak(link, expected, FALSE, debug);
+		    else if (link->lastSeqRx >= 0) sendAck(link, POSACK, link->lastSeqRx, debug);
 		    success = FALSE;
 
                 }  // end of sequence number checking
@@ -361,315 +1013,2958 @@ int LL_receive(byte_t *dataRx, int maxData, int debug)
             }  // end of good frame processing
 
         } // end of received frame processing
-	puts("am I alive? \n");
+        LOG_DEBUG("LLR: Waiting for block %d, attempt %d\n",
+                  expected, attempts);
     }   // repeat all this until succeed or reach the limit
     while ((success == FALSE) && (attempts < MAX_TRIES));
 
     if (success == TRUE)  // received good frame with expected sequence number
-        return nRXdata;  // return number of data bytes extracted from frame
+    {
+        link->viewHeld = TRUE;  // the data is lent until given back
+        pthread_mutex_lock(&link->rxLock);  // LL_linkGetStats reads it
+        link->dataBytesRx += nRXdata;
+        pthread_mutex_unlock(&link->rxLock);
+        return nRXdata;  // return number of data bytes in the frame
+    }
     else // failed to get a good frame within limit
     {
-        if (debug) printf("LLR: Tried to receive a frame %d times, failed\n",
-                          attempts);
+        LOG_WARN("LLR: Tried to receive a frame %d times, failed\n",
+                 attempts);
         return GIVEUP;  // tried enough times, giving up
     }
 
-}  // end of LL_receive
+}  // end of LL_receiveView
+
 
 // ===========================================================================
-/* Function to return the optimum size of a data block for this protocol.
-   The optimum size is defined in the header file by the protocol designer.
-   Arguments: debug controls printing
-   The return value is the optimum numer of data bytes in a frame.  */
-int LL_getOptBlockSize(int debug)
+/* Function to give back the block of data lent by LL_receiveView.
+   A block kept in the receive window frees its slot, so there is room
+   for another.  Nothing happens if no block is lent out.
+   Arguments: link is the link to use,
+              debug controls printing.
+   Returns SUCCESS.  */
+int LL_linkReleaseRx(LL_link *link, int debug)
 {
-    if (debug) printf("LLGOBS: Optimum size of data block is %d bytes\n",
-                      OPT_BLK);
-    return OPT_BLK;
+    if (link->viewHeld && (link->viewSlot >= 0))
+    {
+        link->rxBuffered[link->viewSlot] = FALSE;  // slot is free again
+        POOL_put(&link->rxPool, link->rxFrames[link->viewSlot]);
+        link->rxFrames[link->viewSlot] = NULL;
+        pthread_mutex_lock(&link->rxLock);
+        link->rxKept--;                      // so there is more room
+        pthread_mutex_unlock(&link->rxLock);
+        if (debug) printf("LLR: Released block held in slot %d\n",
+                         link->viewSlot);
+    }
+    link->viewHeld = FALSE;
+    link->viewSlot = -1;
+    return SUCCESS;
 }
 
-
 // ===========================================================================
-/* Function to build a frame around a block of data.
-   This function puts the header bytes into the frame, then copies in the
-   data bytes.  Then it adds the trailer bytes to the frame.
-   It calculates the total number of bytes in the frame, and returns this
-   value to the calling function.
-   Arguments: frameTx is a pointer to an array to hold the frame,
-              dataTx is the array of data bytes to be put in the frame,
-              nData is the number of data bytes to be put in the frame,
-              seq is the sequence number to include in the frame header.
-   The return value is the total number of bytes in the frame.  */
-int buildDataFrame(byte_t *frameTx, byte_t *dataTx, int nData, int seq)
+/* Function to return the optimum size of a data block for this protocol,
+   for the errors seen so far on the link.  It can be called again between
+   blocks, as the estimate changes during a transfer.
+   Each frame carries a fixed overhead of header, check bytes, FEC parity
+   and end marker.  A long block spreads that overhead over more data, but
+   is more likely to be damaged, and then all of it must be sent again.
+   If each byte gets through intact with probability q, a block of n data
+   bytes with h bytes of overhead carries useful data at a rate in
+   proportion to  n/(n+h) * q^(n+h).  The size with the highest rate is
+   chosen, from 1 to the largest block a frame can hold.  q comes from the
+   fraction of frames damaged or lost, f, and their average length L:
+   q = (1-f)^(1/L).  The count of damaged frames starts at half a frame,
+   so a link that has not shown any errors yet still gets a finite size.
+   That half frame fades with the other counts, so the size grows as more
+   frames get through, up to the largest on a clean line.
+   Until ERR_MIN_FRAMES frames have been seen, it returns OPT_BLK, the
+   size chosen by the protocol designer, from the header file.
+   Arguments: link is the link to use,
+              debug controls printing
+   The return value is the optimum numer of data bytes in a frame.  */
+int LL_linkGetOptBlockSize(LL_link *link, int debug)
 {
-    int i = 0;  // for use in loo
-    int checkSum = 0; //for error detection
-    int frameSize = HEADERSIZE+TRAILERSIZE+nData;
-    
-    // Build the frame header first
-    frameTx[0] = STARTBYTE;         // start of frame marker byte
-    frameTx[FRSPOS] = frameSize;
-    frameTx[SEQNUMPOS] = (byte_t) seq;  // sequence number as given
-    checkSum += seq; //sequence number added to checksum
-    checkSum += frameSize; //framesize added to checksum
+    int overhead;      // bytes in each frame that are not data
+    double fer;        // fraction of frames damaged or lost
+    double logQ;       // log of the probability that a byte gets through
+    double rate;       // relative rate of useful data, for one size
+    double bestRate = -1.0;  // highest rate found so far
+    int best = OPT_BLK;      // size with that rate
+    int n;             // block size being tried
+    double frames, bad, bytes;  // the weighted counts, as they are now
+
+    pthread_mutex_lock(&link->rxLock);  // the sender and receiver add to them
+    frames = link->errFrames;
+    bad = link->errBad;
+    bytes = link->errBytes;
+    pthread_mutex_unlock(&link->rxLock);
+
+    if (frames < ERR_MIN_FRAMES)  // not enough known yet
+    {
+        if (debug) printf("LLGOBS: Optimum size of data block is %d bytes\n",
+                          OPT_BLK);
+        return OPT_BLK;
+    }
 
-    printf("framesize was %d \n", frameTx[FRSPOS]);
+    fer = bad / frames;
+    if (fer > 0.99) fer = 0.99;  // keep the log finite
+    logQ = log(1.0 - fer) / (bytes / frames);
 
-    // Copy the data bytes into the frame, starting after the header
-    for (i = 0; i < nData; i++)     // step through the data array
+    for (n = 1; n <= link->maxBlock; n++)
     {
-        frameTx[HEADERSIZE+i] = dataTx[i];  // copy a data byte
-	checkSum += dataTx[i]; //and add same byte to cS
-	
+        overhead = link->headerSize + link->trailerSize
+                   + fecParity(link, n + link->checkLen);
+        rate = (double) n / (n + overhead) * exp(logQ * (n + overhead));
+        if (rate > bestRate)
+        {
+            bestRate = rate;
+            best = n;
+        }
     }
-    checkSum = checkSum % MODULO; //checksum calculated using MODULO from linklayer.h
-    printf("CHECKSUM is %d\n", checkSum);
-    // Add the trailer to the frame
-     
-    // Need to include some error detection system - one or more check
-    // bytes in the trailer, either before or after the end marker.
-
-    // Add the end marker - for now, this goes after the last data byte
-    frameTx[HEADERSIZE+nData] = checkSum; // end of frame marker byte
 
-    frameTx[HEADERSIZE+nData+1] = ENDBYTE;
-    
-    // Return the size of the frame
-    return HEADERSIZE+nData+TRAILERSIZE;
+    if (debug) printf("LLGOBS: Optimum size of data block is %d bytes, "
+                      "%.1f%% of frames damaged or lost\n", best, 100.0 * fer);
+    return best;
 }
 
 
 // ===========================================================================
-/* Function to find and extract a frame from the received bytes.
-   Arguments: frameRx is a pointer to an array of bytes to hold the frame,
-              maxSize is the maximum number of bytes to receive,
-              timeLimit is the time limit for receiving a frame.
-   The return value is the number of bytes in the frame,
-   zero if time limit or size limit was reached before frame received,
-   or a negative value if there was some other problem. */
-int getFrame(byte_t *frameRx, int maxSize, float timeLimit)
+/* Function to select the ARQ mode and the sender window size.
+   Arguments: link is the link to use,
+              mode is ARQ_STOPWAIT, ARQ_GOBACKN or ARQ_SELREPEAT,
+              window is the max number of unacknowledged frames,
+              debug controls printing.
+   For Go-Back-N the window must be less than the number of sequence
+   numbers, so that a cumulative ACK can never be mistaken for one from a
+   previous lap of the sequence numbers.  For selective repeat it can be at
+   most half that, as the receiver keeps a window of the same size.  With
+   wider sequence numbers, both can be up to MAX_WINDOW.
+   Both ends must use the same mode.  Can be called before or after
+   LL_connect, but not while frames are waiting to be acknowledged.
+   While connected, the window cannot be bigger than the one agreed at
+   connect, as the frame buffers, and the other end's receive window,
+   are sized for that.
+   Returns SUCCESS, or BADUSE.  */
+int LL_linkSetARQ(LL_link *link, int mode, int window, int debug)
 {
-    int nRx = 0;  // number of bytes received so far
-    int retVal = 0;  // return value from other functions
-    int frameSize = 0;
+    int maxWindow;  // largest window allowed in this mode
 
-    // WINONLY: timerRx = timeSet(timeLimit);  // set time limit to wait for frame
+    if ((mode != ARQ_STOPWAIT) && (mode != ARQ_GOBACKN)
+        && (mode != ARQ_SELREPEAT))
+    {
+        printf("LLARQ: Unknown ARQ mode %d\n", mode);
+        return BADUSE;
+    }
+    maxWindow = windowLimit(mode, link->modSeq);
+    if ((window < 1) || (window > maxWindow))
+    {
+        printf("LLARQ: Window size %d not allowed, must be 1 to %d\n",
+               window, maxWindow);
+        return BADUSE;
+    }
+    if (link->connected && (link->nOutstanding > 0))
+    {
+        printf("LLARQ: Cannot change ARQ mode with %d frames in flight\n",
+               link->nOutstanding);
+        return BADUSE;
+    }
+    if (link->connected && (window > link->txPool.nBufs))
+    {
+        printf("LLARQ: Window cannot grow past %d frames while connected\n",
+               link->txPool.nBufs);
+        return BADUSE;
+    }
 
-    printf("DEBUG: setting getFrame deadline with timeout=%f\n", timeLimit);
-    time_t deadlineTime = time(NULL) + timeLimit;
-    int deadlineExceeded = FALSE;
+    link->arqMode = mode;
+    link->txWindow = window;
+    if (debug) printf("LLARQ: Using %s, window %d\n",
+                      (mode == ARQ_SELREPEAT) ? "selective repeat" :
+                      (mode == ARQ_GOBACKN) ? "Go-Back-N" : "stop-and-wait",
+                      window);
+    return SUCCESS;
+}
 
-    // First search for the start of frame marker
-    do
-    {
-        retVal = PHY_get(frameRx, 1); // get one byte at a time
-        // Return value is number of bytes received, or negative for problem
-        if (retVal < 0) return retVal;  // check for problem and give up
-        else nRx += retVal;  // otherwise update the bytes received count
-	deadlineExceeded = (time(NULL) > deadlineTime) ? TRUE : FALSE;
-     }
-    while (((retVal < 1) || (frameRx[0] != STARTBYTE)) && !deadlineExceeded);  // !timeUp(timerRx));
-    // until we get a byte which is a start of frame marker, or timeout
 
-    // If we are out of time, without finding the start marker,
-    // report the facts, but return 0 - no useful bytes received
-    if (deadlineExceeded) // (timeUp(timerRx))
+// ===========================================================================
+/* Function to set the probability of simulated errors on receive.
+   The default is PROB_ERR, from the header file.
+   Arguments: link is the link to use,
+              prob is the probability of error in each bit received,
+              0.0 for none, debug controls printing.
+   Takes effect at the next LL_connect.  Returns SUCCESS, or BADUSE.  */
+int LL_linkSetErrorRate(LL_link *link, double prob, int debug)
+{
+    if ((prob < 0.0) || (prob > 1.0))
     {
-        printf("LLGF: Timeout seeking START, %d bytes received\n", nRx);
-        return 0;  // no frame received, but not a failure situation
+        printf("LLSER: Probability of error %g not allowed\n", prob);
+        return BADUSE;
     }
-    
-    retVal = PHY_get((frameRx + 1), 1);  // get one byte at a time
-    if (retVal < 0) return retVal;  // check for problem and give up
-    else nRx += retVal;  // otherwise update the bytes received count
-    frameSize = frameRx[FRSPOS];
-
-    printf("RxFramesize was %d \n", frameSize);
+    link->probErr = prob;
+    if (debug) printf("LLSER: Probability of error set to %g\n", prob);
+    return SUCCESS;
+}
 
-    nRx = 2;  // if we found the start marker, we got 1 byte
 
-    for (int i = 0; i < frameSize-2; i++) {
+// ===========================================================================
+/* Function to return the number of data frames sent since LL_connect,
+   including frames sent again after a timeout or NAK.
+   Arguments: link is the link to use,
+              debug controls printing.
+   Returns the number of frames.  */
+int LL_linkGetFramesSent(LL_link *link, int debug)
+{
+    if (debug) printf("LLGFS: Sent %d data frames\n", link->framesSent);
+    return link->framesSent;
+}
 
-      retVal = PHY_get((frameRx + nRx), 1);  // get one byte at a time
-      if (retVal < 0) return retVal;  // check for problem and give up
-      else nRx += retVal;  // otherwise update the bytes received count
-      
-    }
 
-    printf("nRx was %d \n", nRx);
-	
-    // until we get the end of frame marker or reach time limit or size limit
+// ===========================================================================
+/* Function to fill in what has happened on the link since LL_connect,
+   with the rates worked out from the counts.  It can be called at any
+   time while the link is connected, from any thread, to watch how well
+   the link is doing.  The counts are copied under the lock, so they
+   all come from the same moment.  With the receive thread on, the
+   bytes received from the line are counted by the thread, so they may
+   be a frame or so behind.
+   Arguments: link is the link to use,
+              stats is a pointer to the structure to fill in,
+              debug controls printing.
+   Returns SUCCESS, or BADUSE if the link is not connected.  */
+int LL_linkGetStats(LL_link *link, LL_stats *stats, int debug)
+{
+    int nFrames;  // frames received
 
-    // If we reached the time limit, without finding the end marker,
-    // this will be a bad frame, so report the facts but return 0
-    if (deadlineExceeded) // (timeUp(timerRx))
+    if (link->connected == FALSE)
     {
-        printf("LLGF: Timeout seeking END, %d bytes received\n", nRx);
-        return 0;  // no frame received, but not a failure situation
+        printf("LLGS: Attempt to get statistics while not connected\n");
+        return BADUSE;  // problem code
     }
 
-    // If we filled the frame array, without finding the end marker,
-    // this will be a bad frame, so so report the facts but return 0
-    if (nRx >= maxSize)
+    memset(stats, 0, sizeof(LL_stats));
+    pthread_mutex_lock(&link->rxLock);
+    stats->elapsed = timeNow() - link->connectTime;
+    stats->dataBytesTx = link->dataBytesTx;
+    stats->dataBytesRx = link->dataBytesRx;
+    stats->lineBytesTx = link->lineBytesTx;
+    stats->lineBytesRx = link->lineBytesRx;
+    stats->blocksSent = link->blocksSent;
+    stats->framesSent = link->framesSent;
+    stats->goodFrames = link->goodFrames;
+    stats->badFrames = link->badFrames;
+    stats->timeouts = link->timeouts;
+    stats->acksSent = link->acksSent;
+    stats->acksRx = link->acksRx;
+    stats->naksSent = link->naksSent;
+    stats->naksRx = link->naksRx;
+    if (link->rttValid) stats->srtt = link->srtt;
+    stats->rto = link->rto;
+    pthread_mutex_unlock(&link->rxLock);
+
+    // Then work out the rates from the copies
+    if (stats->elapsed > 0.0)
     {
-        printf("LLGF: Size limit seeking END, %d bytes received\n", nRx);
-        return 0;  // no frame received, but not a failure situation
+        stats->goodputTx = stats->dataBytesTx / stats->elapsed;
+        stats->goodputRx = stats->dataBytesRx / stats->elapsed;
     }
+    if (stats->blocksSent > 0)
+        stats->retxRatio = (double) (stats->framesSent - stats->blocksSent)
+                           / stats->blocksSent;
+    nFrames = stats->goodFrames + stats->badFrames;
+    if (nFrames > 0)
+        stats->frameErrorRate = (double) stats->badFrames / nFrames;
+
+    if (debug) printf("LLGS: %.2f s, sent %ld data bytes at %.0f B/s, "
+                      "received %ld at %.0f B/s, %.3f re-sends per block\n",
+                      stats->elapsed, stats->dataBytesTx, stats->goodputTx,
+                      stats->dataBytesRx, stats->goodputRx, stats->retxRatio);
+    return SUCCESS;
+}
 
-    // Otherwise, we found the end marker
-    return nRx;  // return the number of bytes in the frame
-}  // end of getFrame
+
+// ===========================================================================
+/* Function to turn the receive thread on or off.
+   With the thread on, it reads the port all the time, checks the header
+   of each frame, and puts it in the queue for its kind - data frames for
+   LL_receive, ACKs and NAKs for the sender.  So one end can be sending
+   and receiving data at the same time, in different threads of the
+   program, without the responses to one getting mixed up with the other.
+   LL_send and LL_receive can each be used by one thread at a time.
+   Arguments: link is the link to use,
+              on is TRUE to turn the thread on, FALSE to turn it off,
+              debug controls printing.
+   If the link is connected, the thread starts or stops now, otherwise
+   when it connects.  Not available on the loopback port.
+   Returns SUCCESS, or FAILURE if the thread could not be started.  */
+int LL_linkSetRxThread(LL_link *link, int on, int debug)
+{
+    link->useRxThread = on ? TRUE : FALSE;
+    if (debug) printf("LLRT: Receive thread %s\n", on ? "on" : "off");
+    if (!link->connected) return SUCCESS;  // takes effect at LL_connect
+
+    if (on) return startRxThread(link);
+    stopRxThread(link);
+    return SUCCESS;
+}
 
 
 // ===========================================================================
-/* Function to check a received frame for errors.
-   Arguments: frameRx is a pointer to an array of bytes holding a frame,
-              sizeFrame is the number of bytes in the frame.
-   As a minimum, this function should check the error detecting code.
-   This example just checks the start and end markers.
-   The return value indicates if the frame is good or bad.  */
-int checkFrame(byte_t *frameRx, int sizeFrame)
+/* Function to set how long the ACK for a data frame can wait, while this
+   end is sending data too, in the hope of going in a data frame.
+   The ACK waits for about the time between the data frames this end
+   sends, but never longer than this.  The default is ACK_DELAY, from the
+   header file.  The wait adds to the round trip time the other end
+   measures, so it must be well inside the longest sender waiting time.
+   Arguments: link is the link to use,
+              delay is the longest wait in seconds, 0.0 to send every ACK
+              in a frame of its own, at once,
+              debug controls printing.
+   Returns SUCCESS, or BADUSE.  */
+int LL_linkSetAckDelay(LL_link *link, double delay, int debug)
 {
-  //Declare local and Rx Checksums, read transmitted Checksum
-  int checkSum_Rx = frameRx[sizeFrame-2];
-  int checkSum_Lcl = 0;
-  
-  //Calculate local checksum via with MODULO from linklayer.h
-    for (int i = 0; i < sizeFrame-3 ; i++) {
-	
-        checkSum_Lcl += frameRx[(HEADERSIZE-2)+i]; 
-      
+    if ((delay < 0.0) || (delay > TX_WAIT / 4.0))
+    {
+        printf("LLAD: ACK delay %g s not allowed, must be 0 to %g s\n",
+               delay, TX_WAIT / 4.0);
+        return BADUSE;
     }
-    checkSum_Lcl = checkSum_Lcl % MODULO;
+    pthread_mutex_lock(&link->rxLock);
+    link->ackDelay = delay;
+    pthread_mutex_unlock(&link->rxLock);
+    if (debug) printf("LLAD: ACKs can wait up to %g s\n", delay);
+    return SUCCESS;
+}
 
-    //if checkSums do not match, return error message && "FRAMEBAD"
-    if (checkSum_Lcl != checkSum_Rx) {
 
-        printf("LLCF:  Frame bad - Checksum Mismatch\n");
-	return FRAMEBAD;
+// ===========================================================================
+/* Function to set the receive buffer: the most data blocks this end holds
+   for its program, received but not yet taken by LL_receive.  Each
+   response tells the other end how many more it has room for, so the
+   other end sends no more than that.  A program that is slow to take its
+   data can set a small buffer, so the other end keeps to its pace, rather
+   than sending frames that wait too long for an ACK, and are sent again.
+   The default is RX_BUFFER, from the header file.  It can be changed at
+   any time, and the other end hears of it with the next response.
+   Arguments: link is the link to use,
+              blocks is the number of data blocks, 1 to MAX_WINDOW,
+              debug controls printing.
+   Returns SUCCESS, or BADUSE.  */
+int LL_linkSetRxBuffer(LL_link *link, int blocks, int debug)
+{
+    if ((blocks < 1) || (blocks > MAX_WINDOW))
+    {
+        printf("LLRB: Receive buffer of %d blocks not allowed, must be 1 to %d\n",
+               blocks, MAX_WINDOW);
+        return BADUSE;
     }
+    pthread_mutex_lock(&link->rxLock);
+    link->rxBuffer = blocks;
+    pthread_mutex_unlock(&link->rxLock);
+    if (debug) printf("LLRB: Receive buffer holds %d blocks\n", blocks);
+    return SUCCESS;
+}
 
-    //If start marker not found on data, return message && "FRAMEBAD" 
-    if (frameRx[0] != STARTBYTE)
+
+// ===========================================================================
+/* Function to record whether this end has data to send, so ACKs for
+   data received can wait for it.  When there is no more, an ACK that is
+   waiting is sent at once - there may be nothing else to send it, as
+   delayed ACKs are only sent while a link function is running.
+   Arguments: the link, and TRUE or FALSE.  */
+static void setTxActive(LL_link *link, int active)
+{
+    pthread_mutex_lock(&link->rxLock);
+    link->txActive = active;
+    pthread_mutex_unlock(&link->rxLock);
+    if (!active) sendDelayedAck(link, TRUE, FALSE);
+}
+
+
+// ===========================================================================
+/* Function to start the receive thread for a connected link, if it is
+   not already running, and the port allows it.  Any frames left in the
+   queues are kept.
+   Returns SUCCESS, or FAILURE if the thread could not be started.  */
+static int startRxThread(LL_link *link)
+{
+    if (link->rxRunning) return SUCCESS;  // nothing to do
+    if (link->loopback)  // its buffer cannot be shared with another thread
     {
-        printf("LLCF: Frame bad - no start marker\n");
-        return FRAMEBAD;
+        printf("LLRT: No receive thread on a loopback port\n");
+        return SUCCESS;  // carry on without it
     }
 
-    // Check the end-of-frame marker in the last byte
-    if (frameRx[sizeFrame-1] != ENDBYTE)
+    link->rxError = 0;
+    link->rxRunning = TRUE;
+    if (pthread_create(&link->rxThread, NULL, rxThreadMain, link) != 0)
     {
-        printf("LLCF: Frame bad - no end marker\n");
-        return FRAMEBAD;
+        printf("LLRT: Failed to start receive thread\n");
+        link->rxRunning = FALSE;
+        return FAILURE;
     }
+    return SUCCESS;
+}
 
-    // Need to check the error detecting code here.
-    // If this check fails, print a message and return FRAMEBAD
 
-    // If all tests are passed, indicate a good frame
-    return FRAMEGOOD;
-}  // end of checkFrame
+// ===========================================================================
+/* Function to stop the receive thread, if it is running, and wait for it
+   to finish.  The thread may be waiting for bytes from the port, so it
+   is cancelled - it only holds the lock while it queues a frame, which
+   it cannot be cancelled in the middle of.  Frames it has queued are
+   kept, for LL_receive and the sender to take without the thread.  */
+static void stopRxThread(LL_link *link)
+{
+    if (!link->rxRunning) return;  // nothing to do
+
+    pthread_cancel(link->rxThread);
+    pthread_join(link->rxThread, NULL);
+    pthread_mutex_lock(&link->rxLock);
+    link->rxRunning = FALSE;
+    pthread_mutex_unlock(&link->rxLock);
+}
 
 
 // ===========================================================================
-/* Function to process a received frame, to extract the data & sequence number.
-   The frame has already been checked for errors, so this simple
-   implementation assumes everything is where is should be.
-   Arguments: frameRx is a pointer to the array holding the frame,
-              sizeFrame is the number of bytes in the frame,
-              dataRx is a pointer to an array to hold the data bytes,
-              maxData is the max number of data bytes to extract,
-              seqNum is a pointer to the sequence number.
-   The return value is the number of data bytes extracted. */
-int processFrame(byte_t *frameRx, int sizeFrame,
-                 byte_t *dataRx, int maxData, int *seqNum)
+/* The receive thread.  It gets frames from the port for as long as it
+   runs, and queues each one for the function that will deal with it.
+   If the port fails, the thread records
+   the problem, so waiting functions give up, and stops.
+   Argument: the link to use.  */
+static void *rxThreadMain(void *arg)
 {
-    int i = 0;  // for use in loop
-    int nRXdata;  // number of data bytes in the frame
+    LL_link *link = (LL_link *) arg;  // the link this thread serves
+    byte_t frame[MAX_FRAME];  // frame being received
+    int sizeFrame;            // number of bytes in the frame
 
-    // First get the sequence number from its place in the header
-    *seqNum = (int) frameRx[SEQNUMPOS];
+    while (TRUE)
+    {
+        sizeFrame = getFrame(link, frame, MAX_FRAME, RX_WAIT);
+        if (sizeFrame < 0)  // some problem receiving
+        {
+            LOG_ERROR("LLRT: Receive thread stopped, PHY returned code %d\n",
+                      sizeFrame);
+            pthread_mutex_lock(&link->rxLock);
+            link->rxError = sizeFrame;
+            pthread_cond_broadcast(&link->rxArrived);  // wake waiting functions
+            pthread_mutex_unlock(&link->rxLock);
+            return NULL;
+        }
+        if (sizeFrame > 0) routeFrame(link, frame, sizeFrame, -1);
+    }
+}
 
-    // Calculate the number of data bytes, based on the frame size
-    nRXdata = sizeFrame - HEADERSIZE - TRAILERSIZE;
 
-    // Check if this is within the limit given
-    if (nRXdata > maxData) nRXdata = maxData;  // limit to the max allowed
+// ===========================================================================
+/* Function to wait until every frame in the window has been acknowledged.
+   In stop-and-wait mode there is never anything left to wait for.
+   Arguments: link is the link to use,
+              debug controls printing.
+   Returns SUCCESS, or a negative value if the link failed or gave up.  */
+int LL_linkFlush(LL_link *link, int debug)
+{
+    int retVal;  // return value from other functions
 
-    // Now copy the data bytes from the middle of the frame
-    for (i = 0; i < nRXdata; i++)
+    if (link->connected == FALSE)
     {
-        dataRx[i] = frameRx[HEADERSIZE + i];  // copy one byte
+        printf("LLF: Attempt to flush while not connected\n");
+        return BADUSE;  // problem code
     }
 
-    return nRXdata;  // return the size of the data block extracted
-}  // end of processFrame
+    while (link->nOutstanding > 0)
+    {
+        retVal = waitWindowAck(link, debug);
+        if (retVal < 0) return retVal;  // link failed or gave up
+    }
+    setTxActive(link, FALSE);  // nothing left to send
+    return SUCCESS;
+}
 
 
 // ===========================================================================
-/* Function to send an acknowledgement - positive or negative.
-   Arguments: type is the type of acknowledgement to send,
-              seq is the sequence number that the ack should carry,
-              debug controls printing of messages.
-   Return value indicates success or failure.
-   Note type is used to update statistics for report, so the argument
-   is needed even if its value is not included in the ack frame. */
-int sendAck(int type, int seq, int debug)
+/* Function to get the link used by the functions below, which have no
+   link argument, so a program with only one link need not make one.
+   The link is made the first time it is needed.
+   Returns the link, or NULL if there is no memory for it.  */
+static LL_link *getDefaultLink(void)
 {
-    byte_t ackFrame[2*ACK_SIZE];  // twice expected frame size, for byte stuff
-    int sizeAck = 5; // number of bytes in the ack frame so far
-    int retVal; // return value from functions
-    int checkSum = 0;
+    if (defaultLink == NULL) defaultLink = LL_linkNew();
+    return defaultLink;
+}
 
-    // First build the frame
-    ackFrame[0] = STARTBYTE;
-    ackFrame[FRSPOS] = sizeAck;
-    ackFrame[SEQNUMPOS] = (byte_t) seq;  // sequence number as given
-    checkSum += seq; //sequence number added to checksum
-    checkSum += sizeAck; //framesize added to checksum
+// ===========================================================================
+/* Functions without a link argument - each one does the same as the
+   LL_link...() function of the same name, using the default link.  */
+int LL_connect(char *portName, int debug)
+{
+    LL_link *link = getDefaultLink();
+    if (link == NULL) return FAILURE;
+    return LL_linkConnect(link, portName, debug);
+}
+
+int LL_discon(int debug)
+{
+    LL_link *link = getDefaultLink();
+    if (link == NULL) return FAILURE;
+    return LL_linkDiscon(link, debug);
+}
+
+int LL_send(byte_t *dataTx, int nTXdata, int debug)
+{
+    LL_link *link = getDefaultLink();
+    if (link == NULL) return FAILURE;
+    return LL_linkSend(link, dataTx, nTXdata, debug);
+}
 
-    checkSum = checkSum % MODULO; //checksum calculated using MO
-    
-    ackFrame[HEADERSIZE] = checkSum; // end of frame marker byte
+int LL_getTxBuffer(byte_t **buffer, int debug)
+{
+    LL_link *link = getDefaultLink();
+    if (link == NULL) return FAILURE;
+    return LL_linkGetTxBuffer(link, buffer, debug);
+}
 
-    ackFrame[HEADERSIZE+1] = ENDBYTE;
+int LL_sendBuffer(int nTXdata, int debug)
+{
+    LL_link *link = getDefaultLink();
+    if (link == NULL) return FAILURE;
+    return LL_linkSendBuffer(link, nTXdata, debug);
+}
 
+int LL_receive(byte_t *dataRx, int maxData, int debug)
+{
+    LL_link *link = getDefaultLink();
+    if (link == NULL) return FAILURE;
+    return LL_linkReceive(link, dataRx, maxData, debug);
+}
 
-	// Add more bytes to the frame, and update sizeAck
+int LL_receiveView(byte_t **dataRx, int debug)
+{
+    LL_link *link = getDefaultLink();
+    if (link == NULL) return FAILURE;
+    return LL_linkReceiveView(link, dataRx, debug);
+}
 
-    // Then send the frame and check for problems
-    retVal = PHY_send(ackFrame, sizeAck);  // send the frame
-    if (retVal != sizeAck)  // problem!
-    {
-        printf("LLSA: Failed to send response, seq. %d\n", seq);
-        return FAILURE;  // problem code
-    }
-    else  // success - update the counters for the report
-    {
-        if (type == POSACK)  acksSent++;
-        else if (type == NEGACK) naksSent++;
-        if (debug)
-            printf("LLSA: Sent response of %d bytes, type %d, seq %d\n",
-                        sizeAck, type, seq);
-        return SUCCESS;
-    }
+int LL_releaseRx(int debug)
+{
+    LL_link *link = getDefaultLink();
+    if (link == NULL) return FAILURE;
+    return LL_linkReleaseRx(link, debug);
+}
+
+int LL_getOptBlockSize(int debug)
+{
+    LL_link *link = getDefaultLink();
+    if (link == NULL) return FAILURE;
+    return LL_linkGetOptBlockSize(link, debug);
 }
 
+int LL_setARQ(int mode, int window, int debug)
+{
+    LL_link *link = getDefaultLink();
+    if (link == NULL) return FAILURE;
+    return LL_linkSetARQ(link, mode, window, debug);
+}
 
-// ===========================================================================
-// Function to advance the sequence number, wrapping around at maximum value.
-int next(int seq)
+int LL_flush(int debug)
+{
+    LL_link *link = getDefaultLink();
+    if (link == NULL) return FAILURE;
+    return LL_linkFlush(link, debug);
+}
+
+int LL_setCheck(int type, int debug)
 {
-    return ((seq + 1) % MOD_SEQNUM);
+    LL_link *link = getDefaultLink();
+    if (link == NULL) return FAILURE;
+    return LL_linkSetCheck(link, type, debug);
 }
 
+int LL_setErrorRate(double prob, int debug)
+{
+    LL_link *link = getDefaultLink();
+    if (link == NULL) return FAILURE;
+    return LL_linkSetErrorRate(link, prob, debug);
+}
+
+int LL_getFramesSent(int debug)
+{
+    LL_link *link = getDefaultLink();
+    if (link == NULL) return FAILURE;
+    return LL_linkGetFramesSent(link, debug);
+}
+
+int LL_getStats(LL_stats *stats, int debug)
+{
+    LL_link *link = getDefaultLink();
+    if (link == NULL) return FAILURE;
+    return LL_linkGetStats(link, stats, debug);
+}
+
+int LL_setRxThread(int on, int debug)
+{
+    LL_link *link = getDefaultLink();
+    if (link == NULL) return FAILURE;
+    return LL_linkSetRxThread(link, on, debug);
+}
+
+int LL_setAckDelay(double delay, int debug)
+{
+    LL_link *link = getDefaultLink();
+    if (link == NULL) return FAILURE;
+    return LL_linkSetAckDelay(link, delay, debug);
+}
+
+int LL_setFEC(int nParity, int debug)
+{
+    LL_link *link = getDefaultLink();
+    if (link == NULL) return FAILURE;
+    return LL_linkSetFEC(link, nParity, debug);
+}
+
+int LL_setLongFrames(int on, int debug)
+{
+    LL_link *link = getDefaultLink();
+    if (link == NULL) return FAILURE;
+    return LL_linkSetLongFrames(link, on, debug);
+}
+
+int LL_setSeqBits(int bits, int debug)
+{
+    LL_link *link = getDefaultLink();
+    if (link == NULL) return FAILURE;
+    return LL_linkSetSeqBits(link, bits, debug);
+}
+
+int LL_setRxBuffer(int blocks, int debug)
+{
+    LL_link *link = getDefaultLink();
+    if (link == NULL) return FAILURE;
+    return LL_linkSetRxBuffer(link, blocks, debug);
+}
+
+
+// ===========================================================================
+/* Function to build a frame around a block of data.
+   The data is not copied: it has TX_HEADROOM bytes of room before it,
+   and TX_TAILROOM after it, so the frame is built around it where it is.
+   This function puts the header bytes into the room before the data.
+   If an ACK is waiting to be sent, it goes in the header.  Then it adds
+   the trailer bytes after the data.
+   With forward error correction on, the trailer has parity bytes too.
+   Then byte stuffing is added as the frame is copied out, so the markers
+   are not found inside it - the only pass that copies the data.
+   It calculates the total number of bytes in the frame, and returns this
+   value to the calling function.
+   Arguments: link is the link to use,
+              frameTx is a pointer to an array to hold the frame,
+              with room for twice the frame size, for stuffing,
+              dataTx is the array of data bytes to be put in the frame,
+              with room around it, as above,
+              nData is the number of data bytes to be put in the frame,
+              seq is the sequence number to include in the frame header.
+   The return value is the total number of bytes in the frame.  */
+int buildDataFrame(LL_link *link, byte_t *frameTx, byte_t *dataTx,
+                   int nData, int seq)
+{
+    int i = 0;  // for use in loop
+    unsigned long check;  // error check value
+    int hdr = link->headerSize;  // number of bytes in the header
+    int nCovered = nData + link->checkLen;  // bytes covered by FEC parity
+    int frameSize = hdr+nData+link->trailerSize+fecParity(link, nCovered);
+    byte_t *frame = dataTx - hdr;  // frame before stuffing, around the data
+    int nPiece;       // bytes in one piece covered by FEC parity
+    byte_t *parity;   // where the parity bytes for that piece go
+    int ack = -1;     // ACK to carry in the header, if any
+    double now;       // time now
+
+    // Build the frame header first
+    frame[0] = STARTBYTE;           // start of frame marker byte
+    frame[FRSPOS] = (byte_t) frameSize;  // the low byte, in a long header
+    if (link->longFrames) frame[LENHIPOS] = (byte_t) (frameSize >> 8);
+    frame[TYPEPOS] = DATAFRAME;         // this frame holds data
+
+    // If an ACK is waiting to be sent, it goes in this frame instead.
+    // Measure the time between data frames, for how long ACKs can wait.
+    pthread_mutex_lock(&link->rxLock);
+    now = timeNow();
+    if (link->lastBuilt > 0.0)
+        link->txGap = 0.875 * link->txGap + 0.125 * (now - link->lastBuilt);
+    link->lastBuilt = now;
+    if (link->ackPending)
+    {
+        ack = link->ackSeq;
+        link->ackPending = FALSE;
+        link->acksCarried++;  // for the report
+    }
+    pthread_mutex_unlock(&link->rxLock);
+    putSeqFields(link, frame, seq, ack);  // sequence number as given
+    frame[hdr-1] = CRC_8(frame, hdr-1);  // check on the header so far
+
+    // The data bytes are in the frame already, just after the header.
+    // Add the trailer to the frame - the error check covers everything
+    // after the start marker, and goes in the trailer, most significant
+    // byte first
+    check = checkValue(link, frame+FRSPOS, hdr+nData-FRSPOS);
+    LOG_DEBUG("LLBDF: Block %d, frame size %d, check %lu\n",
+              seq, frameSize, check);
+    for (i = 0; i < link->checkLen; i++)
+    {
+        frame[hdr+nData+i] =
+            (byte_t) (check >> (8*(link->checkLen-1-i)));
+    }
+
+    // With forward error correction, parity bytes covering the data and
+    // check bytes go after them.  The header has its own check.  A long
+    // frame is split into pieces the code can handle, and the parity for
+    // each piece goes after the parity for the one before.
+    parity = frame+hdr+nCovered;
+    for (i = 0; (link->fecLen > 0) && (i < nCovered); i += nPiece)
+    {
+        nPiece = RS_MAX_BLOCK - link->fecLen;
+        if (nPiece > nCovered - i) nPiece = nCovered - i;
+        RS_encode(frame+hdr+i, nPiece, parity, link->fecLen);
+        parity += link->fecLen;
+    }
+
+    // Add the end marker - this goes after the check and parity bytes
+    frame[frameSize-1] = ENDBYTE;
+
+    // Add byte stuffing, and return the size of the frame as sent
+    return stuffFrame(frameTx, frame, frameSize);
+}
+
+
+// ===========================================================================
+/* Function to add byte stuffing to a frame, ready to send.
+   The start and end markers are kept, and every byte between them is
+   stuffed, so the markers cannot appear anywhere else in the frame.
+   Arguments: frameTx is a pointer to an array to hold the stuffed frame,
+              with room for twice the frame size,
+              frame is a pointer to the frame before stuffing,
+              sizeFrame is the number of bytes in that frame.
+   The return value is the number of bytes in the stuffed frame.  */
+int stuffFrame(byte_t *frameTx, byte_t *frame, int sizeFrame)
+{
+    int nStuffed;  // number of bytes between the markers, after stuffing
+
+    frameTx[0] = frame[0];  // start marker
+    nStuffed = STUFF_encode(frame+1, sizeFrame-2, frameTx+1);
+    frameTx[nStuffed+1] = frame[sizeFrame-1];  // end marker
+    return nStuffed+2;
+}  // end of stuffFrame
+
+
+// ===========================================================================
+/* Function to get the next frame of one kind: data frames for LL_receive,
+   or responses (ACKs and NAKs) for the sender.  A frame of that kind that
+   has been queued already is taken first.  If the receive thread is
+   running, this waits for it to queue one.  Otherwise, frames are got from
+   the port here, straight into the array given.  A frame of the kind
+   wanted stays there, and is not copied again.  Others are sorted into
+   the queues by routeFrame, so nothing is lost when data and responses
+   are both on the way.
+   Only the header of the frame has been checked, to find its kind.
+   If an ACK is waiting to go in a data frame, and its time runs out
+   during the wait, it is sent on its own.
+   If the other end is still asking to agree the settings, after this end
+   has finished, it is answered here.  A setup frame that was queued just
+   before this end finished is dropped in the same way, as it is not a
+   response to the sender's frames.
+   Even if the time limit has passed already, the frames the port has
+   buffered are looked at - a sender that has been busy sending long
+   frames can find a timer has run out, with the ACK it was waiting for
+   already here.
+   Arguments: link is the link to use,
+              wantData is TRUE for a data frame, FALSE for a response,
+              frame is a pointer to an array of bytes to hold the frame,
+              maxSize is the maximum number of bytes to receive,
+              timeLimit is the time limit for receiving a frame.
+   The return value is the number of bytes in the frame, zero if the time
+   limit was reached first, or a negative value if there was a problem. */
+int nextFrame(LL_link *link, int wantData, byte_t *frame, int maxSize,
+              float timeLimit)
+{
+    frameQueue *queue = wantData ? &link->dataQ : &link->ackQ;
+    long deadline = timeSet(timeLimit);  // time limit, in ms
+    long waitUntil;         // end of this wait - sooner than the time limit
+                            // if an ACK must be sent before then
+    struct timespec until;  // the same time, for the thread functions
+    int sizeFrame;          // number of bytes in the frame
+    int threadOn;           // TRUE if the receive thread is running
+    int drained = FALSE;    // TRUE once the port had no frame waiting
+    int setupAgain;         // TRUE if the other end is still asking
+    int probeAsked;         // TRUE if the other end has sent a window probe
+
+    while (TRUE)
+    {
+        sizeFrame = 0;
+        pthread_mutex_lock(&link->rxLock);
+        setupAgain = link->setupAgain;
+        link->setupAgain = FALSE;
+        probeAsked = link->probeAsked;
+        link->probeAsked = FALSE;
+        pthread_mutex_unlock(&link->rxLock);
+        if (setupAgain) sendSetup(link, SETUP_DONE, FALSE);
+        if (probeAsked) sendAck(link, WINDOWFRAME, 0, FALSE);
+
+        pthread_mutex_lock(&link->rxLock);
+        waitUntil = deadline;
+        if (link->ackPending && (link->ackDue < waitUntil))
+            waitUntil = link->ackDue;
+        threadOn = link->rxRunning;
+        if (threadOn)  // wait for the thread to queue a frame, or fail
+        {
+            until.tv_sec = waitUntil / 1000L;
+            until.tv_nsec = (waitUntil % 1000L) * 1000000L;
+            while ((queue->count == 0) && (link->rxError == 0)
+                   && !link->setupAgain && !link->probeAsked
+                   && (pthread_cond_timedwait(&link->rxArrived, &link->rxLock,
+                                              &until) == 0))
+                ;  // woken by a frame for either queue, so look again
+        }
+        if (link->setupAgain || link->probeAsked)  // answer it first,
+                                                   // then look again
+        {
+            pthread_mutex_unlock(&link->rxLock);
+            continue;
+        }
+        if (queue->count > 0)  // take the oldest frame
+        {
+            sizeFrame = queue->size[queue->head];
+            if (sizeFrame > maxSize) sizeFrame = maxSize;
+            memcpy(frame, queue->frames[queue->head], sizeFrame);
+            POOL_put(&queue->pool, queue->frames[queue->head]);
+            queue->head = (queue->head + 1) % queue->slots;
+            queue->count--;
+            if (link->setupDone && (frame[TYPEPOS] == SETUPFRAME))
+            {
+                if ((checkSetupFrame(frame, sizeFrame) == FRAMEGOOD)
+                    && (frame[HEADERSIZE+SU_HEARD] != SETUP_DONE))
+                    link->setupAgain = TRUE;  // answered next time round
+                pthread_mutex_unlock(&link->rxLock);
+                continue;
+            }
+        }
+        else if (threadOn) sizeFrame = link->rxError;  // 0 if just a timeout
+        pthread_mutex_unlock(&link->rxLock);
+        if (sizeFrame != 0) return sizeFrame;  // got a frame, or a problem
+
+        // No receive thread - get a frame from the port.  If it is the
+        // kind wanted, it is ready where it is, as the queue is empty.
+        // If not, sort it into the queues, then look again.
+        if (!threadOn && (!timeUp(waitUntil) || !drained))
+        {
+            sizeFrame = getFrame(link, frame, maxSize,
+                                 (float) (waitUntil - PHY_timeMs()) / 1000.0f);
+            if (sizeFrame < 0) return sizeFrame;  // problem
+            if (sizeFrame == 0) drained = TRUE;  // nothing more here yet
+            else if (routeFrame(link, frame, sizeFrame, wantData))
+                return sizeFrame;
+            continue;
+        }
+
+        // Out of time - for the waiting ACK, or for the frame
+        sendDelayedAck(link, FALSE, FALSE);
+        if (timeUp(deadline)) return 0;
+    }
+}  // end of nextFrame
+
+
+// ===========================================================================
+/* Function to put a frame in the receive queue for its kind.
+   If the queue is full, the oldest frame is dropped to make room - the
+   sender will re-send it, if it was needed.  Any function waiting for
+   a frame is woken.
+   Arguments: link is the link to use,
+              isData is TRUE for the data queue, FALSE for responses,
+              frame is a pointer to the frame,
+              sizeFrame is the number of bytes in the frame.  */
+void queueFrame(LL_link *link, int isData, byte_t *frame, int sizeFrame)
+{
+    pthread_mutex_lock(&link->rxLock);
+    putFrame(link, isData ? &link->dataQ : &link->ackQ, frame, sizeFrame);
+    pthread_cond_broadcast(&link->rxArrived);
+    pthread_mutex_unlock(&link->rxLock);
+}  // end of queueFrame
+
+
+// ===========================================================================
+/* Function to copy a frame into a queue, with the lock held already.
+   If the queue is full, the oldest frame is dropped to make room.  A
+   frame too long for the buffers is cut short - it must be damaged, as
+   the buffers have room for the largest frame agreed, and its check will
+   fail.
+   Arguments: link is the link to use,
+              queue is the queue to put it in,
+              frame is a pointer to the frame,
+              sizeFrame is the number of bytes in the frame.  */
+static void putFrame(LL_link *link, frameQueue *queue, byte_t *frame,
+                     int sizeFrame)
+{
+    int slot;  // where the frame goes
+
+    if (queue->slots == 0) return;  // no queue - not connected
+    if (queue->count == queue->slots)  // full - drop the oldest
+    {
+        POOL_put(&queue->pool, queue->frames[queue->head]);
+        queue->head = (queue->head + 1) % queue->slots;
+        queue->count--;
+        link->rxDropped++;
+    }
+    slot = (queue->head + queue->count) % queue->slots;
+    if (sizeFrame > queue->pool.bufSize) sizeFrame = queue->pool.bufSize;
+    queue->frames[slot] = POOL_get(&queue->pool);
+    memcpy(queue->frames[slot], frame, sizeFrame);
+    queue->size[slot] = sizeFrame;
+    queue->count++;
+}  // end of putFrame
+
+
+// ===========================================================================
+/* Function to sort a received frame into the receive queues, by the type
+   in its header.  A data frame can carry an ACK in its header, which can
+   be trusted if the header check matches, even if the rest of the frame
+   is damaged.  The ACK is given to the sender as a response frame of its
+   own, just as if it had come on its own.  A frame with a damaged header
+   goes in the data queue, so LL_receive finds it is bad and counts it.
+   Setup frames go in the response queue while the settings are being
+   agreed.  One that comes later means the other end has not heard that
+   this end has finished, so whichever function is waiting for a frame
+   is asked to answer it.  A window probe is answered in the same way.
+   A frame of the kind the caller wants is not queued, but left where it
+   is for the caller, which has found the queue for it empty.
+   Arguments: link is the link to use,
+              frame is a pointer to the frame, after unstuffing,
+              sizeFrame is the number of bytes in the frame,
+              want is TRUE if the caller wants a data frame, FALSE for a
+              response, or -1 to queue every frame.
+   Returns TRUE if the frame was left for the caller, FALSE if not.  */
+int routeFrame(LL_link *link, byte_t *frame, int sizeFrame, int want)
+{
+    byte_t ackFrame[ACK_SIZE];  // response made from an ACK carried
+    int type = frameType(link, frame, sizeFrame);  // type of frame, or -1
+    int setupDone;              // TRUE once the settings have been agreed
+    int ack;                    // ACK carried by a data frame, or -1
+
+    if (type == SETUPFRAME)
+    {
+        pthread_mutex_lock(&link->rxLock);
+        setupDone = link->setupDone;
+        if (setupDone && (checkSetupFrame(frame, sizeFrame) == FRAMEGOOD)
+            && (frame[HEADERSIZE+SU_HEARD] != SETUP_DONE))
+        {
+            link->setupAgain = TRUE;
+            pthread_cond_broadcast(&link->rxArrived);  // wake whoever waits
+        }
+        pthread_mutex_unlock(&link->rxLock);
+        if (setupDone) return FALSE;  // answered, not kept
+        if (want == FALSE) return TRUE;
+        queueFrame(link, FALSE, frame, sizeFrame);
+        return FALSE;
+    }
+    if (type == PROBEFRAME)
+    {
+        pthread_mutex_lock(&link->rxLock);
+        link->probeAsked = TRUE;
+        pthread_cond_broadcast(&link->rxArrived);  // wake whoever waits
+        pthread_mutex_unlock(&link->rxLock);
+        return FALSE;
+    }
+    if ((type == POSACK) || (type == NEGACK) || (type == WINDOWFRAME))
+    {
+        if (want == FALSE) return TRUE;
+        queueFrame(link, FALSE, frame, sizeFrame);
+        return FALSE;
+    }
+    if ((type == DATAFRAME) && ((ack = ackField(link, frame)) >= 0))
+        queueFrame(link, FALSE, ackFrame,
+                   buildAckFrame(link, ackFrame, POSACK, ack, -1));
+    if (want == TRUE) return TRUE;
+    queueFrame(link, TRUE, frame, sizeFrame);
+    return FALSE;
+}  // end of routeFrame
+
+
+// ===========================================================================
+/* Function to find the type of a received frame from its header.
+   The header has its own check, so the type can be trusted if that
+   matches, even if the rest of the frame is damaged.
+   Arguments: link is the link to use,
+              frame is a pointer to the frame, after unstuffing,
+              sizeFrame is the number of bytes in the frame.
+   A setup frame always has the normal header, whatever the settings.
+   Returns DATAFRAME, POSACK, NEGACK, SETUPFRAME, PROBEFRAME or
+   WINDOWFRAME, or -1 if the header is damaged.  */
+int frameType(LL_link *link, byte_t *frame, int sizeFrame)
+{
+    int hdr = link->headerSize;  // number of bytes in the header
+
+    if ((sizeFrame >= HEADERSIZE) && (frame[TYPEPOS] == SETUPFRAME))
+        return (CRC_8(frame, HCSPOS) == frame[HCSPOS]) ? SETUPFRAME : -1;
+    if (sizeFrame < hdr) return -1;  // not even a header
+    if (CRC_8(frame, hdr-1) != frame[hdr-1]) return -1;
+    if ((frame[TYPEPOS] != DATAFRAME) && (frame[TYPEPOS] != POSACK)
+        && (frame[TYPEPOS] != NEGACK) && (frame[TYPEPOS] != PROBEFRAME)
+        && (frame[TYPEPOS] != WINDOWFRAME)) return -1;
+    return frame[TYPEPOS];
+}  // end of frameType
+
+
+// ===========================================================================
+/* Function to find and extract a frame from the received bytes.
+   Bytes are discarded up to a start marker, then taken up to the next
+   end marker.  Byte stuffing means the markers cannot appear inside a
+   frame, so the size byte is not needed to find the end, and a damaged
+   size byte cannot make the frame swallow the next one.  The stuffing
+   is then removed.  If another start marker turns up before the end
+   marker, the end of the first frame was damaged, so it is dropped and
+   the new one is kept, without waiting for a timeout.  Frames with
+   damaged stuffing are dropped, and the search goes on.
+   The header is checked as soon as it arrives.  If it is damaged, or
+   the frame runs on longer than its size byte allows, the frame is
+   dropped at once, and the bytes already received are searched for
+   the start of the next one.
+   Arguments: link is the link to use,
+              frameRx is a pointer to an array of bytes to hold the frame,
+              maxSize is the maximum number of bytes to receive,
+              timeLimit is the time limit for receiving a frame.
+   The return value is the number of bytes in the frame, after removing
+   the stuffing, zero if time limit was reached before frame received,
+   or a negative value if there was some other problem. */
+int getFrame(LL_link *link, byte_t *frameRx, int maxSize, float timeLimit)
+{
+    int nRx = 0;  // number of bytes received so far
+    int nSkipped = 0;  // number of bytes discarded before start marker
+    int retVal = 0;  // return value from other functions
+    int ended = FALSE;   // TRUE when the end marker has been received
+    int nRestarts = 0;   // number of damaged frames dropped
+    int nBody;       // number of bytes between the markers, after unstuffing
+    int headerGood = FALSE;  // TRUE when the header has been checked
+    int frameSize = 0;       // frame size, from the header
+
+    link->timerRx = timeSet(timeLimit);  // set time limit to wait for frame
+    PHY_setDeadline(link->port, link->timerRx);  // physical layer must not wait beyond it
+
+    // Always look once, so bytes already here are found even if the
+    // time limit is zero
+    do
+    {
+        // First search for the start of frame marker.  The physical layer
+        // searches all the bytes it has buffered, discarding any before it.
+        if (nRx == 0)
+        {
+            retVal = PHY_skipTo(link->port, STARTBYTE, &nSkipped);
+            // Return value is 1 if found, or negative for problem
+            if (retVal < 0) return retVal;  // check for problem and give up
+            pthread_mutex_lock(&link->rxLock);
+            link->lineBytesRx += nSkipped;  // noise counts as line bytes too
+            pthread_mutex_unlock(&link->rxLock);
+            if (retVal == 0) continue;      // not found yet
+        }
+
+        // Then get bytes up to the end marker, as many at a time as we
+        // can, but never more than the array can hold
+        if (!ended)
+        {
+            retVal = PHY_getTo(link->port, (frameRx + nRx), maxSize - nRx,
+                               ENDBYTE, &ended);
+            if (retVal < 0) return retVal;  // check for problem and give up
+            else nRx += retVal;  // otherwise update the bytes received count
+            pthread_mutex_lock(&link->rxLock);
+            link->lineBytesRx += retVal;
+            pthread_mutex_unlock(&link->rxLock);
+        }
+
+        // Check the header as soon as it is here, so a damaged frame
+        // can be dropped without waiting for the rest of it
+        if (!headerGood)
+        {
+            retVal = checkHeader(link, frameRx, nRx, maxSize, &frameSize);
+            if (retVal == FRAMEBAD)
+            {
+                LOG_WARN("LLGF: Frame bad - damaged header, %d bytes\n", nRx);
+                nRx = dropFrame(frameRx, nRx);  // keep any later frame
+                if (nRx == 0) ended = FALSE;
+                continue;
+            }
+            headerGood = (retVal == FRAMEGOOD);
+        }
+
+        if (!ended)
+        {
+            // Even if every byte were stuffed, the frame would have ended
+            // by now, so the end marker has been lost
+            if (headerGood && (nRx >= 2*frameSize - 2))
+            {
+                LOG_WARN("LLGF: Frame bad - longer than size %d\n", frameSize);
+                nRx = dropFrame(frameRx, nRx);  // keep any later frame
+                headerGood = FALSE;
+                continue;
+            }
+
+            if (nRx < maxSize) continue;  // wait for more bytes
+
+            // If we filled the frame array, without finding the end marker,
+            // this is a bad frame.  Keep any later frame that has started.
+            LOG_WARN("LLGF: Size limit seeking END, %d bytes received\n", nRx);
+            nRx = dropFrame(frameRx, nRx);
+            headerGood = FALSE;
+            continue;
+        }
+
+        // We found the end marker - remove the stuffing from the bytes
+        // between the markers, in place
+        nBody = STUFF_decode(frameRx + 1, nRx - 2, &nRestarts);
+        if (nBody >= 0)
+        {
+            if (nRestarts > 0)
+                LOG_WARN("LLGF: Dropped %d frames with no end marker\n", nRestarts);
+            frameRx[nBody + 1] = ENDBYTE;
+            return nBody + 2;  // return the number of bytes in the frame
+        }
+
+        LOG_WARN("LLGF: Frame bad - damaged byte stuffing, %d bytes\n", nRx);
+        nRx = 0;         // drop it and look for the next frame
+        ended = FALSE;
+        headerGood = FALSE;
+    }
+    while (!timeUp(link->timerRx));
+
+    // If we are out of time, report the facts, but return 0 -
+    // no frame received, but not a failure situation
+    if (nRx == 0)
+        LOG_DEBUG("LLGF: Timeout seeking START, %d bytes received\n", nSkipped);
+    else
+        LOG_DEBUG("LLGF: Timeout seeking END, %d bytes received\n", nRx);
+    return 0;
+}  // end of getFrame
+
+
+// ===========================================================================
+/* Function to check the header of a frame as it arrives, before the rest
+   of the frame, and before the stuffing is removed from it.
+   Arguments: link is the link to use,
+              frameRx is a pointer to the bytes received so far,
+              starting with the start marker,
+              nRx is the number of bytes received so far,
+              maxSize is the size of the array that will hold the frame,
+              frameSize is a pointer to the frame size from the header.
+   The header check must match, and the frame size must be possible.
+   Returns FRAMEGOOD or FRAMEBAD, or -1 if the header is not all here.  */
+int checkHeader(LL_link *link, byte_t *frameRx, int nRx, int maxSize,
+                int *frameSize)
+{
+    byte_t header[MAX_HEADER];  // header bytes, after removing stuffing
+    int hdr = link->headerSize;  // number of bytes in the header
+    int nHead = 1;  // number of header bytes so far
+    int i = 1;      // position in the bytes received
+
+    header[0] = frameRx[0];  // start marker is never stuffed
+    while ((nHead < hdr) && (i < nRx))
+    {
+        if ((frameRx[i] == STARTBYTE) || (frameRx[i] == ENDBYTE))
+            return FRAMEBAD;  // the frame ends before the header does
+        if (frameRx[i] == ESCBYTE)
+        {
+            if (i + 1 >= nRx) break;  // changed byte not here yet
+            header[nHead++] = (byte_t) (frameRx[i+1] ^ STUFF_XOR);
+            i += 2;
+        }
+        else header[nHead++] = frameRx[i++];
+    }
+    if (nHead < hdr) return -1;  // wait for more bytes
+
+    // A setup frame has the normal header, whatever the settings
+    if (header[TYPEPOS] == SETUPFRAME)
+    {
+        *frameSize = header[FRSPOS];
+        if ((CRC_8(header, HCSPOS) != header[HCSPOS])
+            || (*frameSize != SETUP_FRAMESIZE)) return FRAMEBAD;
+        return FRAMEGOOD;
+    }
+
+    *frameSize = sizeField(link, header);
+    if (CRC_8(header, hdr-1) != header[hdr-1]) return FRAMEBAD;
+    if ((*frameSize < hdr + link->trailerSize) || (*frameSize > maxSize))
+        return FRAMEBAD;  // not a possible size
+    return FRAMEGOOD;
+}  // end of checkHeader
+
+
+// ===========================================================================
+/* Function to drop a damaged frame from the start of the bytes received.
+   Byte stuffing means a start marker can only be the start of a frame,
+   so any later frame that has started is kept, moved to the start of
+   the array.  The rest of it will come from the physical layer.
+   Arguments: frameRx is a pointer to the bytes received so far,
+              nRx is the number of bytes received so far.
+   Returns the number of bytes kept.  */
+int dropFrame(byte_t *frameRx, int nRx)
+{
+    byte_t *next;  // pointer to the next start marker, if any
+
+    next = memchr(frameRx + 1, STARTBYTE, nRx - 1);
+    if (next == NULL) return 0;  // nothing worth keeping
+
+    nRx -= (int) (next - frameRx);
+    memmove(frameRx, next, nRx);
+    return nRx;
+}  // end of dropFrame
+
+
+// ===========================================================================
+/* Function to check a received frame for errors.
+   Arguments: link is the link to use,
+              frameRx is a pointer to an array of bytes holding a frame,
+              sizeFrame is the number of bytes in the frame.
+   It checks the error check bytes in the trailer, using the type of
+   check selected by LL_setCheck(), then the start and end markers.
+   If a data frame fails the check, and has FEC parity bytes, the errors
+   are corrected if there are few enough, and the check is done again.
+   The check then catches any block that was corrected wrongly.
+   The return value indicates if the frame is good or bad.  */
+int checkFrame(LL_link *link, byte_t *frameRx, int sizeFrame)
+{
+    unsigned long checkRx = 0;  // error check value received
+    unsigned long checkLcl;     // error check value calculated here
+    int hdr = link->headerSize; // number of bytes in the header
+    int nParity = 0;            // FEC parity bytes, in a data frame
+    int nCovered;               // number of bytes checked
+    int nFixed = 0;             // number of bytes corrected by FEC
+    int i;  // for use in loop
+
+    // The frame must be big enough to hold a header and trailer
+    if (sizeFrame < hdr + link->trailerSize)
+    {
+        LOG_WARN("LLCF: Frame bad - too short, %d bytes\n", sizeFrame);
+        return FRAMEBAD;
+    }
+
+    // The header has its own check, and the size byte must match the
+    // size found from the end marker
+    if (CRC_8(frameRx, hdr-1) != frameRx[hdr-1])
+    {
+        LOG_WARN("LLCF: Frame bad - header check mismatch\n");
+        return FRAMEBAD;
+    }
+    if (sizeField(link, frameRx) != sizeFrame)
+    {
+        LOG_WARN("LLCF: Frame bad - size byte %d, but %d bytes\n",
+                 sizeField(link, frameRx), sizeFrame);
+        return FRAMEBAD;
+    }
+    // Each piece covered by FEC is RS_MAX_BLOCK bytes with its parity,
+    // except perhaps the last, so the number of pieces follows from the size
+    if ((frameRx[TYPEPOS] == DATAFRAME) && (link->fecLen > 0))
+        nParity = link->fecLen
+                  * ((sizeFrame - 1 - hdr + RS_MAX_BLOCK - 1) / RS_MAX_BLOCK);
+    nCovered = sizeFrame - link->trailerSize - nParity - FRSPOS;
+    if (nCovered < hdr - FRSPOS)
+    {
+        LOG_WARN("LLCF: Frame bad - too short, %d bytes\n", sizeFrame);
+        return FRAMEBAD;
+    }
+
+    // Read the error check value from the trailer, and calculate
+    // a local value over the same bytes as the sender did
+    for (i = 0; i < link->checkLen; i++)
+    {
+        checkRx = (checkRx << 8) | frameRx[FRSPOS+nCovered+i];
+    }
+    checkLcl = checkValue(link, frameRx+FRSPOS, nCovered);
+
+    // If that failed, the parity covers the data and check bytes - try
+    // to correct them, then check again
+    if ((checkLcl != checkRx) && (nParity > 0))
+        nFixed = fecCorrect(link, frameRx+hdr,
+                            nCovered+FRSPOS-hdr+link->checkLen);
+    if (nFixed > 0)
+    {
+        checkRx = 0;
+        for (i = 0; i < link->checkLen; i++)
+        {
+            checkRx = (checkRx << 8) | frameRx[FRSPOS+nCovered+i];
+        }
+        checkLcl = checkValue(link, frameRx+FRSPOS, nCovered);
+        if (checkLcl == checkRx)
+        {
+            pthread_mutex_lock(&link->rxLock);
+            link->fecFixed++;  // for the report
+            pthread_mutex_unlock(&link->rxLock);
+        }
+    }
+
+    //if checks do not match, return error message && "FRAMEBAD"
+    if (checkLcl != checkRx) {
+
+        LOG_WARN("LLCF:  Frame bad - Check Mismatch\n");
+	return FRAMEBAD;
+    }
+
+    //If start marker not found on data, return message && "FRAMEBAD" 
+    if (frameRx[0] != STARTBYTE)
+    {
+        LOG_WARN("LLCF: Frame bad - no start marker\n");
+        return FRAMEBAD;
+    }
+
+    // Check the end-of-frame marker in the last byte
+    if (frameRx[sizeFrame-1] != ENDBYTE)
+    {
+        LOG_WARN("LLCF: Frame bad - no end marker\n");
+        return FRAMEBAD;
+    }
+
+    // If all tests are passed, indicate a good frame
+    return FRAMEGOOD;
+}  // end of checkFrame
+
+
+// ===========================================================================
+/* Function to process a received frame, to find the data & sequence number.
+   The frame has already been checked for errors, so this simple
+   implementation assumes everything is where is should be.
+   The data is left where it is, in the middle of the frame.
+   Arguments: link is the link to use,
+              frameRx is a pointer to the array holding the frame,
+              sizeFrame is the number of bytes in the frame,
+              dataRx is a pointer to where the address of the data goes,
+              seqNum is a pointer to the sequence number.
+   The return value is the number of data bytes in the frame. */
+int processFrame(LL_link *link, byte_t *frameRx, int sizeFrame,
+                 byte_t **dataRx, int *seqNum)
+{
+    int nRXdata;  // number of data bytes in the frame
+
+    // First get the sequence number from its place in the header
+    *seqNum = seqField(link, frameRx);
+
+    // Calculate the number of data bytes, based on the frame size
+    nRXdata = sizeFrame - link->headerSize - link->trailerSize;
+    if (frameRx[TYPEPOS] == DATAFRAME)  // less any FEC parity bytes
+        nRXdata -= link->fecLen * ((sizeFrame - 1 - link->headerSize
+                                    + RS_MAX_BLOCK - 1) / RS_MAX_BLOCK);
+
+    // The data bytes are in the middle of the frame
+    *dataRx = frameRx + link->headerSize;
+
+    return nRXdata;  // return the size of the data block
+}  // end of processFrame
+
+
+// ===========================================================================
+/* Function to build an acknowledgement frame - positive or negative.
+   Window probes and their answers are built the same way.  The room this
+   end has for data blocks goes in the data bytes, if given.
+   Arguments: link is the link to use,
+              ackFrame is a pointer to an array of ACK_SIZE bytes,
+              to hold the frame, before byte stuffing,
+              type is the type of acknowledgement,
+              seq is the sequence number that the ack should carry,
+              room is the number of data blocks there is room for,
+              or -1 for a frame without it.
+   The return value is the number of bytes in the frame.  */
+int buildAckFrame(LL_link *link, byte_t *ackFrame, int type, int seq,
+                  int room)
+{
+    int hdr = link->headerSize;  // number of bytes in the header
+    int nRoom = (room >= 0) ? ROOM_SIZE : 0;  // data bytes, for the room
+    int sizeAck = hdr+nRoom+link->trailerSize; // number of bytes in the ack frame
+    unsigned long check;  // error check value
+    int i;      // for use in loop
+
+    // First the header
+    ackFrame[0] = STARTBYTE;
+    ackFrame[FRSPOS] = sizeAck;
+    if (link->longFrames) ackFrame[LENHIPOS] = 0;  // an ACK is always short
+    ackFrame[TYPEPOS] = (byte_t) type;   // the type of response
+    putSeqFields(link, ackFrame, seq, -1);  // the type says what this is
+    ackFrame[hdr-1] = CRC_8(ackFrame, hdr-1);  // check on the header
+    if (nRoom > 0)
+    {
+        ackFrame[hdr] = (byte_t) (room >> 8);
+        ackFrame[hdr+1] = (byte_t) room;
+    }
+
+    // Then the trailer - error check over the header after the start
+    // marker, and the room
+    check = checkValue(link, ackFrame+FRSPOS, hdr+nRoom-FRSPOS);
+    for (i = 0; i < link->checkLen; i++)
+    {
+        ackFrame[hdr+nRoom+i] = (byte_t) (check >> (8*(link->checkLen-1-i)));
+    }
+
+    ackFrame[hdr+nRoom+link->checkLen] = ENDBYTE;
+    return sizeAck;
+}  // end of buildAckFrame
+
+
+// ===========================================================================
+/* Function to send an acknowledgement - positive or negative.
+   Arguments: link is the link to use,
+              type is the type of acknowledgement to send,
+              seq is the sequence number that the ack should carry,
+              debug controls printing of messages.
+   Return value indicates success or failure.
+   The type goes in the frame header, and is used to update statistics
+   for the report.  Window probes and their answers are sent this way
+   too.  Every type but a probe says how much room this end has. */
+int sendAck(LL_link *link, int type, int seq, int debug)
+{
+    byte_t ackFrame[ACK_SIZE];    // frame before stuffing
+    byte_t ackTx[2*ACK_SIZE];     // twice expected frame size, for byte stuff
+    int sizeAck;  // number of bytes in the ack frame
+    int retVal;   // return value from functions
+    int room = (type == PROBEFRAME) ? -1 : rxRoom(link);  // room to offer
+
+    // First build the frame, then add byte stuffing
+    sizeAck = buildAckFrame(link, ackFrame, type, seq, room);
+    sizeAck = stuffFrame(ackTx, ackFrame, sizeAck);
+
+    // Then send the frame and check for problems
+    retVal = portSend(link, ackTx, sizeAck);  // send the frame
+    if (retVal != sizeAck)  // problem!
+    {
+        LOG_ERROR("LLSA: Failed to send response, seq. %d\n", seq);
+        return FAILURE;  // problem code
+    }
+    else  // success - update the counters for the report
+    {
+        pthread_mutex_lock(&link->rxLock);
+        if (type == POSACK)  link->acksSent++;
+        else if (type == NEGACK) link->naksSent++;
+        else if (type == PROBEFRAME) link->probesSent++;
+        pthread_mutex_unlock(&link->rxLock);
+        if (debug)
+            printf("LLSA: Sent response of %d bytes, type %d, seq %d, room %d\n",
+                        sizeAck, type, seq, room);
+        return SUCCESS;
+    }
+}
+
+
+// ===========================================================================
+/* Function to work out how many more data blocks this end has room for.
+   The receive buffer holds the blocks received but not yet taken by the
+   program: the data frames waiting in the queue, and in selective repeat
+   the blocks kept in the window until the ones before them arrive.
+   Argument: link is the link to use.
+   Returns the room, in data blocks - 0 if the buffer is full.  */
+int rxRoom(LL_link *link)
+{
+    int room;  // room left in the buffer
+
+    pthread_mutex_lock(&link->rxLock);
+    room = link->rxBuffer - link->dataQ.count - link->rxKept;
+    pthread_mutex_unlock(&link->rxLock);
+    return (room > 0) ? room : 0;
+}
+
+
+// ===========================================================================
+/* Function to acknowledge a good data frame, from LL_receive.
+   If this end has no data to send, the ACK is sent at once.  So it is in
+   stop-and-wait, where neither end can send its next frame until it has
+   an ACK, so ACKs that waited for data frames would hold up both ends.
+   Otherwise it waits to go in the next data frame sent - for twice the
+   usual time between data frames, but no more than the ACK delay.
+   Only one ACK can wait.  If there is one already, in Go-Back-N the new
+   ACK covers both, so it is sent at once - so every second frame is ACKed
+   without waiting.  In the other modes each frame needs its own ACK, so
+   the one that was waiting is sent, and the new one waits instead.
+   Arguments: link is the link to use,
+              seq is the sequence number of the frame to acknowledge,
+              debug controls printing of messages.
+   Return value indicates success or failure.  */
+int ackLater(LL_link *link, int seq, int debug)
+{
+    int sendSeq = -1;  // sequence number to ACK now, if any
+    double wait;       // how long the ACK can wait
+
+    pthread_mutex_lock(&link->rxLock);
+    wait = 2.0 * link->txGap;
+    if (wait > link->ackDelay) wait = link->ackDelay;
+    if (!link->txActive || (link->arqMode == ARQ_STOPWAIT)
+        || (wait < 0.001))  // less than the clock can time
+        sendSeq = seq;  // no data frame to carry it
+    else if (link->ackPending && (link->arqMode == ARQ_GOBACKN))
+    {
+        sendSeq = seq;  // the new ACK covers the one waiting
+        link->ackPending = FALSE;
+    }
+    else
+    {
+        if (link->ackPending) sendSeq = link->ackSeq;  // old one goes now
+        else link->ackDue = timeSet((float) wait);
+        link->ackPending = TRUE;
+        link->ackSeq = seq;
+    }
+    pthread_mutex_unlock(&link->rxLock);
+
+    if (debug && (sendSeq != seq))
+        printf("LLR: ACK for block %d waiting to go in a data frame\n", seq);
+    if (sendSeq < 0) return SUCCESS;
+    return sendAck(link, POSACK, sendSeq, debug);
+}  // end of ackLater
+
+
+// ===========================================================================
+/* Function to send the ACK that is waiting to go in a data frame, if its
+   time is up, or if told to send it anyway.
+   Arguments: link is the link to use,
+              force is TRUE to send it even if its time is not up,
+              debug controls printing of messages.
+   Return value indicates success or failure.  */
+int sendDelayedAck(LL_link *link, int force, int debug)
+{
+    int seq = -1;  // sequence number to ACK, if any
+
+    pthread_mutex_lock(&link->rxLock);
+    if (link->ackPending && (force || timeUp(link->ackDue)))
+    {
+        seq = link->ackSeq;
+        link->ackPending = FALSE;
+    }
+    pthread_mutex_unlock(&link->rxLock);
+
+    if (seq < 0) return SUCCESS;  // nothing to send
+    if (debug) printf("LLSA: No data frame for ACK %d, sending it alone\n", seq);
+    return sendAck(link, POSACK, seq, debug);
+}  // end of sendDelayedAck
+
+
+// ===========================================================================
+/* Function to ask for a block again, with a NAK, as it is missing.
+   A gap in the sequence numbers shows a block is missing every time a
+   later frame arrives, so the block is only asked for once, unless told
+   to ask again - the timeout deals with a NAK that is lost.  The block
+   can be asked for again once it has arrived.
+   Arguments: link is the link to use,
+              seq is the sequence number of the block needed,
+              again is TRUE to send the NAK even if one was sent already,
+              debug controls printing of messages.
+   Return value indicates success or failure.  */
+int sendNak(LL_link *link, int seq, int again, int debug)
+{
+    if (link->rxNaked[SLOT(seq)] && !again) return SUCCESS;  // asked already
+    link->rxNaked[SLOT(seq)] = TRUE;
+    if (debug) printf("LLR: Asking for block %d again\n", seq);
+    return sendAck(link, NEGACK, seq, debug);
+}  // end of sendNak
+
+
+// ===========================================================================
+/* Function to ask for a damaged data frame again, with a NAK.
+   The header has its own check, so if that is good, the sequence number
+   of the damaged frame is known.  If it is the block needed, it is asked
+   for again, even if a NAK was sent for it already, as this must be the
+   frame re-sent after that NAK.  In selective repeat, any block in the
+   window can be asked for like this.  If the header is damaged, the
+   frame could be anything - but a frame longer than the longest ACK was
+   a data frame, so the expected block is asked for, once.
+   Arguments: link is the link to use,
+              frameRx is a pointer to the damaged frame,
+              sizeFrame is the number of bytes in the frame,
+              expected is the sequence number of the next block to return,
+              debug controls printing of messages.
+   Return value indicates success or failure.  */
+int nakBadFrame(LL_link *link, byte_t *frameRx, int sizeFrame, int expected,
+                int debug)
+{
+    int seq;     // sequence number of the damaged frame
+    int offset;  // position of the frame in the receive window
+
+    if (frameType(link, frameRx, sizeFrame) == DATAFRAME)  // header is good
+    {
+        seq = seqField(link, frameRx);
+        if (seq == expected) return sendNak(link, seq, TRUE, debug);
+        offset = (seq - expected + link->modSeq) % link->modSeq;
+        if ((link->arqMode == ARQ_SELREPEAT) && (seq < link->modSeq)
+            && (offset < link->txWindow) && !link->rxBuffered[SLOT(seq)])
+            return sendNak(link, seq, TRUE, debug);
+        return SUCCESS;  // not needed, or a Go-Back-N sender re-sends it
+    }
+    if (sizeFrame > link->headerSize + ROOM_SIZE + link->trailerSize)
+                               // damaged header, but too long for an ACK
+        return sendNak(link, expected, FALSE, debug);
+    return SUCCESS;
+}  // end of nakBadFrame
+
+
+// ===========================================================================
+/* Function to select the error check used in the frame trailer.
+   Arguments: link is the link to use,
+              type is CHECK_SUM, CHECK_CRC16 or CHECK_CRC32C,
+              debug controls printing.
+   The check covers every byte from the frame size to the last data byte.
+   The CRCs detect all burst errors up to 16 or 32 bits long, and
+   swapped bytes, which the simple checksum does not.
+   Both ends must use the same check.  Cannot be changed while frames are
+   waiting to be acknowledged, as they were built with the old check.
+   Returns SUCCESS, or BADUSE.  */
+int LL_linkSetCheck(LL_link *link, int type, int debug)
+{
+    int nBytes;  // number of check bytes for this type
+
+    switch (type)
+    {
+    case CHECK_SUM:
+        nBytes = 1;
+        break;
+    case CHECK_CRC16:
+        nBytes = 2;
+        break;
+    case CHECK_CRC32C:
+        nBytes = 4;
+        break;
+    default:
+        printf("LLCHK: Unknown error check type %d\n", type);
+        return BADUSE;
+    }
+    if (link->connected && (link->nOutstanding > 0))
+    {
+        printf("LLCHK: Cannot change error check with %d frames in flight\n",
+               link->nOutstanding);
+        return BADUSE;
+    }
+
+    link->checkType = type;
+    link->checkLen = nBytes;
+    link->trailerSize = nBytes + 1;  // check bytes and end marker
+    if (debug) printf("LLCHK: Using %d-byte error check, type %d\n",
+                      link->checkLen, link->checkType);
+    return SUCCESS;
+}
+
+
+// ===========================================================================
+/* Function to select forward error correction (FEC) for data frames.
+   Each data frame gets Reed-Solomon parity bytes, after the error check,
+   covering the data and check bytes.  The receiver can then correct up
+   to half that number of damaged bytes in a frame, without asking for it
+   again.  The parity bytes are sent in every data frame, so this is worth
+   it on a noisy line, where a lot of frames would have to be re-sent.
+   ACKs are short, so they have no parity.  Nor does the header, which
+   has its own check - a frame with a damaged header is dropped as soon
+   as it arrives.
+   Both ends must use the same setting.  Cannot be changed while frames
+   are waiting to be acknowledged, as they were built with the old one.
+   Arguments: link is the link to use,
+              nParity is the number of parity bytes: 0 for none, or an
+              even number up to MAX_FEC,
+              debug controls printing.
+   Returns SUCCESS, or BADUSE.  */
+int LL_linkSetFEC(LL_link *link, int nParity, int debug)
+{
+    if ((nParity < 0) || (nParity > MAX_FEC) || (nParity % 2 != 0))
+    {
+        printf("LLFEC: %d parity bytes not allowed, must be 0, or even "
+               "up to %d\n", nParity, MAX_FEC);
+        return BADUSE;
+    }
+    if (link->connected && (link->nOutstanding > 0))
+    {
+        printf("LLFEC: Cannot change FEC with %d frames in flight\n",
+               link->nOutstanding);
+        return BADUSE;
+    }
+
+    RS_init();  // build the tables now, not while a frame is waiting
+    link->fecLen = nParity;
+    if (debug)
+    {
+        if (nParity == 0) printf("LLFEC: No forward error correction\n");
+        else printf("LLFEC: %d parity bytes, correcting up to %d bytes "
+                    "in a frame\n", nParity, nParity / 2);
+    }
+    return SUCCESS;
+}
+
+
+// ===========================================================================
+/* Function to select long frames.  A long frame has one more byte in its
+   header, so the frame size can have 16 bits, and a frame can carry up to
+   MAX_JUMBO data bytes, rather than MAX_BLK.  At high bit rates, the time
+   taken to send the header and trailer, and to wait for the ACK, can be
+   more than the time taken to send a short block, so long blocks give a
+   much higher data rate - if the line has few enough errors.
+   The extra byte goes just before the header check, so the other fields
+   stay where they are:
+       normal header   START size type seq ack HCS
+       long header     START size-low type seq ack size-high HCS
+   ACKs and NAKs have the long header too, so every frame on the link is
+   the same shape.  Both ends must use the same setting, and it cannot be
+   changed while connected.
+   Arguments: link is the link to use,
+              on is TRUE for long frames, FALSE for normal ones,
+              debug controls printing.
+   Returns SUCCESS, or BADUSE.  */
+int LL_linkSetLongFrames(LL_link *link, int on, int debug)
+{
+    if (link->connected)
+    {
+        printf("LLLF: Cannot change the frame format while connected\n");
+        return BADUSE;
+    }
+
+    setFormat(link, on, link->seqBits);
+    if (debug) printf("LLLF: %s frames, up to %d data bytes\n",
+                      on ? "Long" : "Normal", link->maxBlock);
+    return SUCCESS;
+}
+
+
+// ===========================================================================
+/* Function to select the number of bits in sequence numbers.  With 4 bits,
+   the window can be at most 15 frames, or 8 in selective repeat, which
+   cannot keep a fast link with a long delay busy: the sender stops, with
+   the window full, long before the first ACK comes back.  The window should
+   hold as many bytes as the line carries in a round trip.
+   With 8 bits, the sequence number and the ACK carried fill their bytes.
+   With 16 bits, the header has a second byte for each, just before the
+   header check, so the other fields stay where they are:
+       wide header     START size type seq ack seq-high ack-high HCS
+       wide long       START size-low type seq ack size-high seq-high
+                       ack-high HCS
+   The top bit is not used for numbers, so an ACK field with every bit set
+   still means NOACK.  The window can then be up to MAX_WINDOW frames.
+   A window set for wider numbers is made smaller, to fit narrower ones.
+   Both ends must use the same setting, and it cannot be changed while
+   connected.
+   Arguments: link is the link to use,
+              bits is 4, 8 or 16,
+              debug controls printing.
+   Returns SUCCESS, or BADUSE.  */
+int LL_linkSetSeqBits(LL_link *link, int bits, int debug)
+{
+    int maxWindow;  // largest window allowed with these numbers
+
+    if ((bits != 4) && (bits != 8) && (bits != 16))
+    {
+        printf("LLSEQ: Sequence numbers of %d bits not allowed, "
+               "must be 4, 8 or 16\n", bits);
+        return BADUSE;
+    }
+    if (link->connected)
+    {
+        printf("LLSEQ: Cannot change the sequence numbers while connected\n");
+        return BADUSE;
+    }
+
+    setFormat(link, link->longFrames, bits);
+    maxWindow = windowLimit(link->arqMode, link->modSeq);
+    if (link->txWindow > maxWindow)
+    {
+        printf("LLSEQ: Window cut from %d to %d frames, to fit the "
+               "sequence numbers\n", link->txWindow, maxWindow);
+        link->txWindow = maxWindow;
+    }
+    if (debug) printf("LLSEQ: %d-bit sequence numbers, 0 to %d\n",
+                      bits, link->modSeq - 1);
+    return SUCCESS;
+}
+
+// Function to set the frame format: long or normal frames, and the size
+// of the sequence numbers
+static void setFormat(LL_link *link, int longFrames, int seqBits)
+{
+    link->longFrames = longFrames ? TRUE : FALSE;
+    link->seqBits = seqBits;
+    link->modSeq = (seqBits < 8) ? (1 << seqBits) : (1 << (seqBits - 1));
+    link->headerSize = (longFrames ? LONG_HEADERSIZE : HEADERSIZE)
+                       + ((seqBits > 8) ? SEQHI_SIZE : 0);
+    link->maxBlock = longFrames ? MAX_JUMBO : MAX_BLK;
+}
+
+// Function to find the largest window allowed in an ARQ mode.  Selective
+// repeat uses the same window size at the receiver, so the two windows
+// together must fit in the sequence numbers.
+static int windowLimit(int mode, int modSeq)
+{
+    int limit = (mode == ARQ_SELREPEAT) ? modSeq/2 : modSeq-1;
+    return (limit > MAX_WINDOW) ? MAX_WINDOW : limit;
+}
+
+
+// ===========================================================================
+/* Function to agree the settings with the other end, at connect.
+   Both ends do the same thing - there is no client or server.  Each sends
+   a setup frame every SETUP_WAIT seconds, offering the settings it was
+   given, and saying whether it has heard the other end yet.  As soon as
+   it has the other end's offer, it works out the settings to use, which
+   come out the same at both ends, and switches to them.  It is finished
+   when the other end says it has heard this end too, or when a data frame
+   arrives, as the other end only sends data when it has finished.
+   The last setup frame may be lost, so a setup frame that comes later is
+   answered by nextFrame.
+   Arguments: link is the link to use,
+              debug controls printing.
+   Returns SUCCESS, GIVEUP if there was no answer within CONNECT_WAIT
+   seconds, or FAILURE if the port failed.  */
+int setupLink(LL_link *link, int debug)
+{
+    byte_t *frame = link->frameAck;  // array to hold the frame received
+    int sizeFrame;        // number of bytes in the frame
+    int heard = FALSE;    // TRUE once the other end's offer has arrived
+    int dataWaiting;      // TRUE if a data frame has arrived
+    long giveUp = timeSet(CONNECT_WAIT);  // time to stop trying
+
+    if (debug) printf("LL: Agreeing settings with the other end\n");
+    while (!timeUp(giveUp))
+    {
+        if (sendSetup(link, heard ? SETUP_HEARD : SETUP_NEW, debug) != SUCCESS)
+            return FAILURE;
+        sizeFrame = nextFrame(link, FALSE, frame, MAX_FRAME, SETUP_WAIT);
+        if (sizeFrame < 0) return FAILURE;  // problem with the port
+
+        pthread_mutex_lock(&link->rxLock);
+        dataWaiting = (link->dataQ.count > 0);
+        pthread_mutex_unlock(&link->rxLock);
+        if (heard && dataWaiting) return SUCCESS;  // the other end is done
+
+        if ((sizeFrame == 0) || (frameType(link, frame, sizeFrame) != SETUPFRAME)
+            || (checkSetupFrame(frame, sizeFrame) != FRAMEGOOD))
+            continue;  // nothing useful - send again, and wait again
+
+        agreeSettings(link, frame + HEADERSIZE, debug && !heard);
+        heard = TRUE;
+        if (frame[HEADERSIZE+SU_HEARD] == SETUP_DONE) return SUCCESS;
+        if (frame[HEADERSIZE+SU_HEARD] == SETUP_HEARD)
+            return sendSetup(link, SETUP_DONE, debug);  // tell it we are done
+    }
+
+    LOG_ERROR("LL: No answer from the other end in %.0f s\n", CONNECT_WAIT);
+    return GIVEUP;
+}  // end of setupLink
+
+
+// ===========================================================================
+/* Function to send a setup frame, with the settings this end was given.
+   It has the normal header and a CRC-16, whatever the settings, so the
+   other end can always read it.
+   Arguments: link is the link to use,
+              heard is SETUP_NEW, SETUP_HEARD or SETUP_DONE, for what this
+              end has heard from the other end,
+              debug controls printing.
+   Returns SUCCESS, or FAILURE if it could not be sent.  */
+int sendSetup(LL_link *link, int heard, int debug)
+{
+    byte_t frame[SETUP_FRAMESIZE];      // frame before stuffing
+    byte_t frameTx[2*SETUP_FRAMESIZE];  // frame after stuffing
+    byte_t *offer = frame + HEADERSIZE; // the settings offered
+    int maxBlk = link->wantLong ? MAX_JUMBO : MAX_BLK;  // largest block
+    uint16_t check;      // CRC-16 value
+    int sizeTx;          // number of bytes to send
+
+    frame[0] = STARTBYTE;
+    frame[FRSPOS] = SETUP_FRAMESIZE;
+    frame[TYPEPOS] = SETUPFRAME;
+    frame[SEQNUMPOS] = 0;       // not used
+    frame[ACKPOS] = NOACK;
+    frame[HCSPOS] = CRC_8(frame, HCSPOS);
+
+    offer[SU_VERSION] = SETUP_VERSION;
+    offer[SU_HEARD] = (byte_t) heard;
+    offer[SU_ARQ] = (byte_t) link->wantArq;
+    offer[SU_WINDOW] = (byte_t) (link->wantWindow >> 8);
+    offer[SU_WINDOW+1] = (byte_t) link->wantWindow;
+    offer[SU_MAXBLK] = (byte_t) (maxBlk >> 8);
+    offer[SU_MAXBLK+1] = (byte_t) maxBlk;
+    offer[SU_CHECK] = (byte_t) link->wantCheck;
+    offer[SU_SEQBITS] = (byte_t) link->wantSeqBits;
+    offer[SU_FEC] = (byte_t) link->wantFec;
+
+    check = CRC_16(frame+FRSPOS, HEADERSIZE-FRSPOS+SETUP_SIZE);
+    frame[HEADERSIZE+SETUP_SIZE] = (byte_t) (check >> 8);
+    frame[HEADERSIZE+SETUP_SIZE+1] = (byte_t) check;
+    frame[HEADERSIZE+SETUP_SIZE+2] = ENDBYTE;
+
+    sizeTx = stuffFrame(frameTx, frame, SETUP_FRAMESIZE);
+    if (portSend(link, frameTx, sizeTx) != sizeTx)
+    {
+        LOG_ERROR("LL: Failed to send setup frame\n");
+        return FAILURE;
+    }
+    if (debug) printf("LL: Sent setup frame, heard %d\n", heard);
+    return SUCCESS;
+}  // end of sendSetup
+
+
+// ===========================================================================
+/* Function to check a setup frame for errors: the header check, the size,
+   the CRC-16 and the end marker.  It does not depend on the settings.
+   Arguments: frame is a pointer to the frame, after unstuffing,
+              sizeFrame is the number of bytes in the frame.
+   Returns FRAMEGOOD or FRAMEBAD.  */
+int checkSetupFrame(byte_t *frame, int sizeFrame)
+{
+    uint16_t check;  // CRC-16 value received
+
+    if ((sizeFrame != SETUP_FRAMESIZE) || (frame[FRSPOS] != SETUP_FRAMESIZE)
+        || (frame[TYPEPOS] != SETUPFRAME)
+        || (CRC_8(frame, HCSPOS) != frame[HCSPOS])
+        || (frame[sizeFrame-1] != ENDBYTE)) return FRAMEBAD;
+    check = (uint16_t) ((frame[HEADERSIZE+SETUP_SIZE] << 8)
+                        | frame[HEADERSIZE+SETUP_SIZE+1]);
+    if (CRC_16(frame+FRSPOS, HEADERSIZE-FRSPOS+SETUP_SIZE) != check)
+        return FRAMEBAD;
+    return FRAMEGOOD;
+}  // end of checkSetupFrame
+
+
+// ===========================================================================
+/* Function to work out the settings to use, from what the other end
+   offered and what this end was given, and to switch to them.  Both ends
+   work them out the same way, so they get the same answer:
+       ARQ mode      the simpler of the two: stop-and-wait, then Go-Back-N,
+                     then selective repeat
+       window        the smaller, as each end keeps that many frames
+       frame size    long frames only if both ends can take them
+       error check   the stronger, as one end has asked for it
+       FEC           the larger number of parity bytes, as one end has
+                     found the line noisy enough to need them
+       sequence      the narrower, as both ends must be able to use them,
+       numbers       and the window is cut to fit them
+   Arguments: link is the link to use,
+              offer is a pointer to the data of the setup frame received,
+              debug controls printing.  */
+void agreeSettings(LL_link *link, byte_t *offer, int debug)
+{
+    int arq = link->wantArq;        // ARQ mode to use
+    int window = link->wantWindow;  // window to use
+    int check = link->wantCheck;    // error check to use
+    int fec = link->wantFec;        // parity bytes to use
+    int seqBits = link->wantSeqBits;  // bits in sequence numbers to use
+    int maxBlk = link->wantLong ? MAX_JUMBO : MAX_BLK;  // largest block
+    int peerBlk = (offer[SU_MAXBLK] << 8) | offer[SU_MAXBLK+1];
+    int peerWindow = (offer[SU_WINDOW] << 8) | offer[SU_WINDOW+1];
+
+    if (offer[SU_VERSION] != SETUP_VERSION)
+        printf("LL: Other end has setup version %d, not %d\n",
+               offer[SU_VERSION], SETUP_VERSION);
+    if (offer[SU_ARQ] < arq) arq = offer[SU_ARQ];
+    if (peerWindow < window) window = peerWindow;
+    if ((offer[SU_CHECK] > check) && (offer[SU_CHECK] <= CHECK_CRC32C))
+        check = offer[SU_CHECK];
+    if ((offer[SU_FEC] > fec) && (offer[SU_FEC] <= MAX_FEC)) fec = offer[SU_FEC];
+    if (peerBlk < maxBlk) maxBlk = peerBlk;
+    if ((offer[SU_SEQBITS] < seqBits)
+        && ((offer[SU_SEQBITS] == 4) || (offer[SU_SEQBITS] == 8)))
+        seqBits = offer[SU_SEQBITS];
+    setFormat(link, maxBlk > MAX_BLK, seqBits);
+
+    // The window must fit in the sequence numbers agreed, and a selective
+    // repeat window in half of them, if it came from an end that wanted
+    // Go-Back-N
+    if (window > windowLimit(arq, link->modSeq))
+        window = windowLimit(arq, link->modSeq);
+    if (window < 1) window = 1;
+
+    link->arqMode = arq;
+    link->txWindow = window;
+    LL_linkSetCheck(link, check, FALSE);
+    link->fecLen = fec & ~1;  // must be even
+    if (debug)
+        printf("LL: Agreed %s, window %d, %s frames, %d-bit sequence numbers, "
+               "check type %d, %d FEC parity bytes\n",
+               (arq == ARQ_SELREPEAT) ? "selective repeat" :
+               (arq == ARQ_GOBACKN) ? "Go-Back-N" : "stop-and-wait",
+               window, link->longFrames ? "long" : "normal", seqBits, check,
+               link->fecLen);
+}  // end of agreeSettings
+
+
+// ===========================================================================
+/* Function to put back the settings this end was given, at disconnect,
+   in place of those agreed with the other end.  */
+static void restoreSettings(LL_link *link)
+{
+    link->arqMode = link->wantArq;
+    link->txWindow = link->wantWindow;
+    LL_linkSetCheck(link, link->wantCheck, FALSE);
+    link->fecLen = link->wantFec;
+    setFormat(link, link->wantLong, link->wantSeqBits);
+}  // end of restoreSettings
+
+
+// ===========================================================================
+/* Function to make the frame buffer pools for a connection, sized for the
+   window and frame format agreed.  The send pool has a buffer for each
+   frame the window can hold.  The receive pool has one for each frame
+   the receive window can keep, and one for the frame arriving.  The
+   receive queues, made small at connect, are made the size needed too.
+   Returns SUCCESS, or FAILURE if there is no memory for them.  */
+static int makePools(LL_link *link)
+{
+    int frameBytes = FRAME_BYTES(link->maxBlock);  // most bytes in a frame
+
+    POOL_free(&link->txPool);
+    POOL_free(&link->rxPool);
+    link->txPlainSize = (TX_HEADROOM + link->maxBlock + TX_TAILROOM
+                         + POOL_ALIGN - 1) / POOL_ALIGN * POOL_ALIGN;
+    link->rxFrameBytes = frameBytes;
+    if ((POOL_init(&link->txPool, link->txWindow,
+                   link->txPlainSize + frameBytes) != 0)
+        || (POOL_init(&link->rxPool, link->txWindow + 1, frameBytes) != 0)
+        || (makeQueues(link, link->txWindow + RX_QUEUE_EXTRA) != SUCCESS))
+    {
+        printf("LL: No memory for frame buffers, window %d\n", link->txWindow);
+        freePools(link);
+        return FAILURE;
+    }
+    link->frameRx = POOL_get(&link->rxPool);
+    return SUCCESS;
+}  // end of makePools
+
+
+// Function to free the frame buffer pools and the receive queues, and
+// forget the frames in them.
+static void freePools(LL_link *link)
+{
+    int i;  // for use in loop
+
+    for (i = 0; i < MAX_WINDOW; i++)
+    {
+        link->txPlain[i] = NULL;
+        link->txFrames[i] = NULL;
+        link->rxFrames[i] = NULL;
+    }
+    link->frameRx = NULL;
+    POOL_free(&link->txPool);
+    POOL_free(&link->rxPool);
+    pthread_mutex_lock(&link->rxLock);
+    freeQueue(&link->dataQ);
+    freeQueue(&link->ackQ);
+    pthread_mutex_unlock(&link->rxLock);
+}  // end of freePools
+
+
+// ===========================================================================
+/* Function to make an empty receive queue, with its buffers.
+   Arguments: queue is the queue to make,
+              slots is the most frames it can hold,
+              frameBytes is the most bytes in a frame.
+   Returns SUCCESS, or FAILURE if there is no memory for it.  */
+static int makeQueue(frameQueue *queue, int slots, int frameBytes)
+{
+    queue->frames = malloc(slots * sizeof(byte_t *));
+    queue->size = malloc(slots * sizeof(int));
+    queue->slots = slots;
+    queue->head = 0;
+    queue->count = 0;
+    if ((queue->frames == NULL) || (queue->size == NULL)
+        || (POOL_init(&queue->pool, slots, frameBytes) != 0))
+    {
+        freeQueue(queue);
+        return FAILURE;
+    }
+    return SUCCESS;
+}  // end of makeQueue
+
+
+// Function to free a receive queue, and forget the frames in it.
+static void freeQueue(frameQueue *queue)
+{
+    POOL_free(&queue->pool);
+    free(queue->frames);
+    free(queue->size);
+    queue->frames = NULL;
+    queue->size = NULL;
+    queue->slots = 0;
+    queue->head = 0;
+    queue->count = 0;
+}  // end of freeQueue
+
+
+// ===========================================================================
+/* Function to make the receive queues, or make them a new size, for the
+   frame format in use.  The data queue has room for frames of the largest
+   block, and the response queue for ACKs and setup frames.  Frames that
+   are waiting already move to the new queues, while the lock is held, as
+   the receive thread may be queueing more.
+   Arguments: link is the link to use,
+              slots is the most frames each queue can hold.
+   Returns SUCCESS, or FAILURE if there is no memory for them.  */
+static int makeQueues(LL_link *link, int slots)
+{
+    frameQueue newQ[2];   // the new data and response queues
+    frameQueue *oldQ[2];  // the queues they replace
+    frameQueue swap;      // for swapping them
+    int slot;             // slot holding a frame that is waiting
+    int i, j;             // for use in loops
+
+    oldQ[0] = &link->dataQ;
+    oldQ[1] = &link->ackQ;
+    if (makeQueue(&newQ[0], slots, FRAME_BYTES(link->maxBlock)) != SUCCESS)
+        return FAILURE;
+    if (makeQueue(&newQ[1], slots, RESPONSE_BYTES) != SUCCESS)
+    {
+        freeQueue(&newQ[0]);
+        return FAILURE;
+    }
+
+    pthread_mutex_lock(&link->rxLock);
+    for (i = 0; i < 2; i++)
+    {
+        for (j = 0; j < oldQ[i]->count; j++)  // oldest first
+        {
+            slot = (oldQ[i]->head + j) % oldQ[i]->slots;
+            putFrame(link, &newQ[i], oldQ[i]->frames[slot],
+                     oldQ[i]->size[slot]);
+        }
+        swap = *oldQ[i];
+        *oldQ[i] = newQ[i];
+        newQ[i] = swap;
+    }
+    pthread_mutex_unlock(&link->rxLock);
+
+    freeQueue(&newQ[0]);  // now the old queues
+    freeQueue(&newQ[1]);
+    return SUCCESS;
+}  // end of makeQueues
+
+
+// ===========================================================================
+/* Function to correct errors in the bytes covered by FEC, and their parity.
+   The bytes are taken a piece at a time, as they were by buildDataFrame,
+   and each piece is copied next to its parity bytes for the decoder.
+   Arguments: link is the link to use,
+              covered is a pointer to the bytes covered, which are
+              corrected in place, followed by all the parity bytes,
+              nCovered is the number of bytes covered.
+   Returns the number of bytes corrected, 0 if none,
+   or -1 if any piece had too many errors to correct.  */
+static int fecCorrect(LL_link *link, byte_t *covered, int nCovered)
+{
+    byte_t block[RS_MAX_BLOCK];  // one piece and its parity
+    byte_t *parity = covered + nCovered;  // parity for the piece
+    int nPiece;     // bytes in the piece
+    int nFixed = 0; // bytes corrected so far
+    int retVal;     // return value from decoder
+    int i;          // position of the piece
+
+    for (i = 0; i < nCovered; i += nPiece)
+    {
+        nPiece = RS_MAX_BLOCK - link->fecLen;
+        if (nPiece > nCovered - i) nPiece = nCovered - i;
+        memcpy(block, covered + i, nPiece);
+        memcpy(block + nPiece, parity, link->fecLen);
+        retVal = RS_decode(block, nPiece + link->fecLen, link->fecLen);
+        if (retVal < 0) return -1;  // too many errors in this piece
+        if (retVal > 0) memcpy(covered + i, block, nPiece);
+        nFixed += retVal;
+        parity += link->fecLen;
+    }
+    return nFixed;
+}  // end of fecCorrect
+
+
+// ===========================================================================
+/* Function to send a block of data using the sliding window.
+   If the window is full, it first waits for ACKs to make room.  Then it
+   builds the frame in the window slot for its sequence number, sends it,
+   and returns without waiting for the ACK.  The frame stays in the window
+   until it is acknowledged, and is re-sent if the window times out.
+   The data is in the slot already, from LL_getTxBuffer().
+   Arguments and return value as for LL_sendBuffer.  */
+int sendPipelined(LL_link *link, int nTXdata, int debug)
+{
+    int slot;    // window slot for this frame, from its sequence number
+    int retVal;  // return value from other functions
+
+    // Wait until there is room in the window, and at the other end
+    while (link->nOutstanding >= link->txWindow)
+    {
+        retVal = waitWindowAck(link, debug);
+        if (retVal < 0) return retVal;  // link failed or gave up
+    }
+    retVal = waitForRoom(link, debug);
+    if (retVal < 0) return retVal;  // link failed or gave up
+
+    // Build the frame around the data in its slot, so it can be re-sent
+    // later if needed.  The data stays there, so the frame can be rebuilt
+    // when it is re-sent.
+    slot = SLOT(link->seqNumTx);
+    if (link->txPlain[slot] == NULL)
+    {
+        printf("LLS: No block to send - use LL_getTxBuffer first\n");
+        return BADUSE;  // problem code
+    }
+    link->txDataSize[slot] = nTXdata;
+    link->txFrameSize[slot] = buildDataFrame(link, link->txFrames[slot],
+                                             link->txPlain[slot] + TX_HEADROOM,
+                                             nTXdata, link->seqNumTx);
+    link->txAcked[slot] = FALSE;
+    link->txResent[slot] = FALSE;
+    link->txSentTime[slot] = timeNow();  // start timing round trip
+
+    retVal = portSend(link, link->txFrames[slot],
+                      link->txFrameSize[slot]);  // send frame bytes
+    if (retVal != link->txFrameSize[slot])  // problem!
+    {
+        LOG_ERROR("LLS: Block %d, failed to send frame\n", link->seqNumTx);
+        return FAILURE;  // problem code
+    }
+
+    pthread_mutex_lock(&link->rxLock);  // LL_linkGetStats reads them
+    link->framesSent++;  // increment frame counter (for report)
+    link->blocksSent++;  // and the counts of new blocks and their data
+    link->dataBytesTx += nTXdata;
+    pthread_mutex_unlock(&link->rxLock);
+    link->nOutstanding++;
+    link->sentSinceRoom++;  // uses some of the room at the other end
+    if (debug) printf("LLS: Sent frame of %d bytes, block %d, %d in flight\n",
+                      link->txFrameSize[slot], link->seqNumTx, link->nOutstanding);
+    link->seqNumTx = next(link, link->seqNumTx);  // next block gets the next sequence number
+
+    return SUCCESS;
+}  // end of sendPipelined
+
+
+// ===========================================================================
+/* Function to wait for one response to the frames in the window.
+   In Go-Back-N, a good ACK for any frame in the window acknowledges that
+   frame and all the frames before it, so the window slides past it.
+   In selective repeat, an ACK only covers the frame it names, and the
+   window slides past the oldest frames once they have all been ACKed.
+   Each frame has its own timer, set to the retransmission timeout (rto)
+   when it is sent.  It waits until the first of these timers runs out.
+   Then in Go-Back-N every frame in the window is re-sent, oldest first,
+   and in selective repeat only the frames whose timers have run out.
+   After MAX_TRIES timeouts in a row without any progress, it gives up.
+   If the other end said it had no room, the frames are most likely
+   waiting there for its program, so a window probe is sent instead of
+   the frames, and the timers start again.  So they do when the answer
+   comes, as it shows the other end is there, and the frames are only
+   sent again if they time out once more after that.  Only one probe is
+   sent until the window moves: in selective repeat, the room can be
+   taken by frames kept after a lost one, which must then be sent again.
+   Arguments: link is the link to use,
+              debug controls printing.
+   Returns SUCCESS if a response was handled or the window was re-sent,
+   GIVEUP or FAILURE if the link has failed.  */
+int waitWindowAck(LL_link *link, int debug)
+{
+    byte_t *frameAck = link->frameAck; // array to hold the response
+    int sizeAck;      // size of ACK frame received
+    int seqAck;       // sequence number in response received
+    int nAcked;       // number of frames covered by the ACK
+    int seq;          // sequence number of frame being re-sent
+    int i;            // for use in loop
+    int retVal;       // return value from other functions
+    double now;       // time now
+    double firstDue;  // time the first frame timer runs out
+    float waitTime;   // time to wait for a response
+
+    // Find the first frame timer to run out - frames that have been
+    // ACKed (in selective repeat) no longer have timers
+    firstDue = link->txSentTime[SLOT(link->baseTx)] + link->rto;
+    seq = link->baseTx;
+    for (i = 0; i < link->nOutstanding; i++)
+    {
+        if (!link->txAcked[SLOT(seq)] && (link->txSentTime[SLOT(seq)] + link->rto < firstDue))
+            firstDue = link->txSentTime[SLOT(seq)] + link->rto;
+        seq = next(link, seq);
+    }
+    now = timeNow();
+    waitTime = (firstDue > now) ? (float) (firstDue - now) : 0.0f;
+
+    sizeAck = nextFrame(link, FALSE, frameAck, MAX_FRAME, waitTime);
+    if (sizeAck < 0)  // some problem receiving
+    {
+        return FAILURE;  // quit if failed
+    }
+
+    if (sizeAck == 0)  // timeout - go back and re-send
+    {
+        pthread_mutex_lock(&link->rxLock);
+        link->timeouts++;     // increment counter for report
+        pthread_mutex_unlock(&link->rxLock);
+        link->windowTries++;
+        if (link->windowTries >= MAX_TRIES)
+        {
+            LOG_ERROR("LLS: Block %d, tried %d times, failed\n",
+                      link->baseTx, link->windowTries);
+            return GIVEUP;  // tried enough times, giving up
+        }
+        if ((link->peerRoom == 0) && !link->probed)  // held up at the
+        {                                            // other end, not lost
+            link->probed = TRUE;
+            if (debug) printf("LLS: Timeout, but no room at the other end, "
+                              "sending window probe\n");
+            backoffRTO(link);
+            restartTimers(link);
+            return sendAck(link, PROBEFRAME, 0, debug);
+        }
+        // The oldest frame, or its ACK, was lost - the frames after it
+        // are re-sent too in Go-Back-N, but may well have arrived
+        noteFrameResult(link, link->txFrameSize[SLOT(link->baseTx)], FALSE);
+        if (debug) printf("LLS: Timeout, re-sending from block %d, %d in flight\n",
+                          link->baseTx, link->nOutstanding);
+        // The time limit is in whole ms, so the wait can end a little
+        // before the first timer runs out - that one is due all the same
+        now = timeNow();
+        if (now < firstDue) now = firstDue;
+        seq = link->baseTx;
+        for (i = 0; i < link->nOutstanding; i++)
+        {
+            // Skip frames that have been ACKed (selective repeat), and in
+            // selective repeat, frames whose timers are still running
+            if (!link->txAcked[SLOT(seq)] && ((link->arqMode != ARQ_SELREPEAT)
+                                 || (link->txSentTime[SLOT(seq)] + link->rto <= now)))
+            {
+                retVal = resendFrame(link, seq, now);
+                if (retVal != SUCCESS) return retVal;
+            }
+            seq = next(link, seq);
+        }
+        backoffRTO(link);  // the estimate was too short - wait longer next time
+        return SUCCESS;
+    }
+
+    if (checkFrame(link, frameAck, sizeAck) == FRAMEBAD)  // errors found
+    {
+        noteFrameRx(link, sizeAck, FALSE);  // counts it for report
+        if (debug) printf("LLS: Bad frame received\n");
+        return SUCCESS;  // nothing to learn from it - keep waiting
+    }
+
+    noteFrameRx(link, sizeAck, TRUE);  // counts it for report
+    noteRoom(link, frameAck, sizeAck);
+    if (frameAck[TYPEPOS] == WINDOWFRAME)  // answer to a window probe
+    {
+        if (debug) printf("LLS: Other end has room for %d blocks\n",
+                          link->peerRoom);
+        restartTimers(link);
+        link->windowTries = 0;  // the other end is there
+        return SUCCESS;
+    }
+    seqAck = seqField(link, frameAck);  // extract the sequence number
+    if (frameAck[TYPEPOS] != POSACK)  // a NAK - re-send without waiting
+    {
+        if (debug) printf("LLS: NAK received, seq %d\n", seqAck);
+        return handleNak(link, seqAck, debug);
+    }
+
+    // Position of the ACKed frame in the window, counting from the oldest
+    nAcked = ((seqAck - link->baseTx + link->modSeq) % link->modSeq) + 1;
+    if ((seqAck < link->modSeq) && (nAcked <= link->nOutstanding)
+        && (link->arqMode == ARQ_SELREPEAT))
+    {
+        if (debug) printf("LLS: ACK received, seq %d\n", seqAck);
+        pthread_mutex_lock(&link->rxLock);
+        link->acksRx++;               // increment counter for report
+        pthread_mutex_unlock(&link->rxLock);
+        if (!link->txAcked[SLOT(seqAck)] && !link->txResent[SLOT(seqAck)])  // measure round trip
+            updateRTT(link, timeNow() - link->txSentTime[SLOT(seqAck)]);
+        else resetRTO(link);        // progress, so undo any backoff
+        if (!link->txAcked[SLOT(seqAck)])   // this frame got there
+            noteFrameResult(link, link->txFrameSize[SLOT(seqAck)], TRUE);
+        link->txAcked[SLOT(seqAck)] = TRUE;
+        link->windowTries = 0;        // progress, so reset the timeout count
+        link->probed = FALSE;
+        // Slide the window past the oldest frames, if they are all ACKed
+        while ((link->nOutstanding > 0) && link->txAcked[SLOT(link->baseTx)])
+            slideWindow(link, 1);
+    }
+    else if ((seqAck < link->modSeq) && (nAcked <= link->nOutstanding))
+    {
+        if (debug) printf("LLS: ACK received, seq %d, %d frames acknowledged\n",
+                          seqAck, nAcked);
+        pthread_mutex_lock(&link->rxLock);
+        link->acksRx++;             // increment counter for report
+        pthread_mutex_unlock(&link->rxLock);
+        if (!link->txResent[SLOT(seqAck)])  // measure round trip, Karn's rule permitting
+            updateRTT(link, timeNow() - link->txSentTime[SLOT(seqAck)]);
+        else resetRTO(link);      // progress, so undo any backoff
+        seq = link->baseTx;         // all the frames covered got there
+        for (i = 0; i < nAcked; i++)
+        {
+            noteFrameResult(link, link->txFrameSize[SLOT(seq)], TRUE);
+            seq = next(link, seq);
+        }
+        slideWindow(link, nAcked);  // slide the window past the ACKed frame
+        link->windowTries = 0;      // progress, so reset the timeout count
+        link->probed = FALSE;
+    }
+    else  // ACK for a frame before the window - a duplicate
+    {
+        if (debug) printf("LLS: Duplicate ACK, seq %d, window starts at %d\n",
+                          seqAck, link->baseTx);
+        // The receiver is missing a frame, but the timeout will deal with it
+    }
+    return SUCCESS;
+}  // end of waitWindowAck
+
+
+// ===========================================================================
+/* Function to slide the send window past its oldest frames, which have
+   got there, giving their buffers back to the pool.
+   Arguments: link is the link to use,
+              nFrames is the number of frames to slide past.  */
+static void slideWindow(LL_link *link, int nFrames)
+{
+    int slot;  // window slot of the oldest frame
+
+    for ( ; (nFrames > 0) && (link->nOutstanding > 0); nFrames--)
+    {
+        slot = SLOT(link->baseTx);
+        POOL_put(&link->txPool, link->txPlain[slot]);
+        link->txPlain[slot] = NULL;
+        link->txFrames[slot] = NULL;
+        link->txAcked[slot] = FALSE;
+        link->baseTx = next(link, link->baseTx);
+        link->nOutstanding--;
+    }
+}  // end of slideWindow
+
+
+// ===========================================================================
+/* Function to wait until the other end has room for another data block.
+   Each response says how many data blocks the other end has room for,
+   and no more new blocks than that are sent until the next response.
+   While frames are in flight, their responses will come, so this just
+   waits for them.  With none in flight, nothing will come unless asked,
+   so a window probe is sent, and sent again each time the wait runs out,
+   with the wait doubled each time, up to TX_WAIT.  The other end answers
+   with its room.  An answer that there is still no room does not count
+   as a try, as the other end is there, just busy, so this waits for as
+   long as it takes.  After MAX_TRIES probes in a row without an answer,
+   it gives up.
+   Arguments: link is the link to use,
+              debug controls printing.
+   Returns SUCCESS once there is room, GIVEUP or FAILURE if the link has
+   failed.  */
+int waitForRoom(LL_link *link, int debug)
+{
+    byte_t *frameAck = link->frameAck; // array to hold the response
+    int sizeAck;            // size of response received
+    int tries = 0;          // probes in a row without an answer
+    int retVal;             // return value from other functions
+    double wait = link->rto;  // time to wait for an answer to a probe
+    double probeDue = 0.0;  // time the next probe is due - at once
+    double now;             // time now
+
+    while (link->sentSinceRoom >= link->peerRoom)
+    {
+        if (link->nOutstanding > 0)  // their responses will say
+        {
+            retVal = waitWindowAck(link, debug);
+            if (retVal < 0) return retVal;  // link failed or gave up
+            continue;
+        }
+
+        now = timeNow();
+        if (now >= probeDue)  // time to ask
+        {
+            if (tries >= MAX_TRIES)
+            {
+                LOG_ERROR("LLS: No answer to %d window probes, failed\n",
+                          tries);
+                return GIVEUP;  // tried enough times, giving up
+            }
+            if (debug) printf("LLS: No room at the other end, "
+                              "sending window probe\n");
+            if (sendAck(link, PROBEFRAME, 0, debug) != SUCCESS) return FAILURE;
+            tries++;
+            probeDue = now + wait;
+            wait = (2.0 * wait < TX_WAIT) ? 2.0 * wait : TX_WAIT;
+        }
+
+        sizeAck = nextFrame(link, FALSE, frameAck, MAX_FRAME,
+                            (float) (probeDue - now));
+        if (sizeAck < 0) return FAILURE;  // some problem receiving
+        if (sizeAck == 0) continue;       // time for another probe
+        if (checkFrame(link, frameAck, sizeAck) == FRAMEBAD)
+        {
+            noteFrameRx(link, sizeAck, FALSE);  // counts it for report
+            continue;
+        }
+        noteFrameRx(link, sizeAck, TRUE);  // counts it for report
+        if (noteRoom(link, frameAck, sizeAck)) tries = 0;  // it is there
+        if (debug) printf("LLS: Other end has room for %d blocks\n",
+                          link->peerRoom);
+    }
+    return SUCCESS;
+}  // end of waitForRoom
+
+
+// ===========================================================================
+/* Function to start the timers of the frames in the window again, while
+   they are held up at the other end.  They are marked as re-sent, so by
+   Karn's rule their ACKs are not used to time the round trip.
+   Argument: link is the link to use.  */
+static void restartTimers(LL_link *link)
+{
+    double now = timeNow();   // time the timers start from
+    int seq = link->baseTx;   // sequence number of frame
+    int i;                    // for use in loop
+
+    for (i = 0; i < link->nOutstanding; i++)
+    {
+        link->txSentTime[SLOT(seq)] = now;
+        link->txResent[SLOT(seq)] = TRUE;
+        seq = next(link, seq);
+    }
+}  // end of restartTimers
+
+
+// ===========================================================================
+/* Function to note the room the other end has for data blocks, from a
+   response that says.  An ACK that came in the header of a data frame
+   does not, so the room from the last response that did still stands.
+   Arguments: link is the link to use,
+              frame is a pointer to the response, which has been checked,
+              sizeFrame is the number of bytes in it.
+   Returns TRUE if the response gave the room, FALSE if not.  */
+int noteRoom(LL_link *link, byte_t *frame, int sizeFrame)
+{
+    int hdr = link->headerSize;  // number of bytes in the header
+
+    if (((frame[TYPEPOS] != POSACK) && (frame[TYPEPOS] != NEGACK)
+         && (frame[TYPEPOS] != WINDOWFRAME))
+        || (sizeFrame != hdr + ROOM_SIZE + link->trailerSize)) return FALSE;
+    link->peerRoom = (frame[hdr] << 8) | frame[hdr+1];
+    link->sentSinceRoom = 0;  // the room counts from now
+    return TRUE;
+}  // end of noteRoom
+
+
+// ===========================================================================
+/* Function to deal with a NAK received in a pipelined mode.  The frame it
+   names was damaged or lost, so it is re-sent at once, without waiting
+   for its timer to run out.  In Go-Back-N, the NAK also shows that every
+   frame before it has arrived, so the window slides up to it, and then
+   every frame left in the window is re-sent.  In selective repeat, only
+   the frame named is re-sent.  A NAK for a frame that is not waiting for
+   an ACK is out of date, and is ignored.  A NAK for the oldest frame
+   counts as a try, like a timeout, so a link that damages every frame
+   still gives up in the end.
+   Arguments: link is the link to use,
+              seq is the sequence number in the NAK,
+              debug controls printing.
+   Returns SUCCESS, or GIVEUP or FAILURE if the link has failed.  */
+int handleNak(LL_link *link, int seq, int debug)
+{
+    int offset;  // position of the frame in the window, from the oldest
+    int nResend; // number of frames to re-send
+    int i;       // for use in loop
+    int retVal;  // return value from other functions
+    double now = timeNow();  // time the frames are re-sent
+
+    pthread_mutex_lock(&link->rxLock);
+    link->naksRx++;   // increment counter for report
+    pthread_mutex_unlock(&link->rxLock);
+    offset = (seq - link->baseTx + link->modSeq) % link->modSeq;
+    if ((seq >= link->modSeq) || (offset > link->nOutstanding)
+        || ((link->arqMode == ARQ_SELREPEAT)
+            && ((offset == link->nOutstanding) || link->txAcked[SLOT(seq)])))
+    {
+        if (debug) printf("LLS: NAK for block %d, which is not waiting\n", seq);
+        return SUCCESS;
+    }
+
+    if (offset < link->nOutstanding)  // it was damaged
+        noteFrameResult(link, link->txFrameSize[SLOT(seq)], FALSE);
+    if (link->arqMode == ARQ_SELREPEAT) nResend = 1;
+    else
+    {
+        if (offset > 0)  // the frames before it have arrived
+        {
+            for (i = 0; i < offset; i++)
+                noteFrameResult(link, link->txFrameSize[SLOT((link->baseTx + i)
+                                                    % link->modSeq)], TRUE);
+            slideWindow(link, offset);  // up to the block asked for
+            link->windowTries = 0;  // progress, so reset the count
+            link->probed = FALSE;
+        }
+        nResend = link->nOutstanding;
+    }
+    if (nResend == 0) return SUCCESS;  // nothing left to re-send
+
+    if (seq == link->baseTx)  // the oldest frame - count the try
+    {
+        link->windowTries++;
+        if (link->windowTries >= MAX_TRIES)
+        {
+            LOG_ERROR("LLS: Block %d, tried %d times, failed\n",
+                      seq, link->windowTries);
+            return GIVEUP;  // tried enough times, giving up
+        }
+    }
+    if (debug) printf("LLS: Re-sending %d frames from block %d after NAK\n",
+                      nResend, seq);
+    for (i = 0; i < nResend; i++)
+    {
+        retVal = resendFrame(link, seq, now);
+        if (retVal != SUCCESS) return retVal;
+        seq = next(link, seq);
+    }
+    return SUCCESS;
+}  // end of handleNak
+
+
+// ===========================================================================
+/* Function to re-send a frame from the window.  The frame is rebuilt, as
+   the ACK it carried is out of date - the other end could take an old
+   ACK for a newer frame.  Its timer is restarted, and it is marked as
+   re-sent, so by Karn's rule its ACK is not used to time the round trip.
+   Arguments: link is the link to use,
+              seq is the sequence number of the frame,
+              now is the time it is sent.
+   Returns SUCCESS, or FAILURE if it could not be sent.  */
+int resendFrame(LL_link *link, int seq, double now)
+{
+    int slot = SLOT(seq);  // window slot for the frame
+    int retVal;  // return value from other functions
+
+    link->txResent[slot] = TRUE;     // Karn's rule - do not time this one
+    link->txSentTime[slot] = now;    // restart its timer
+    link->txFrameSize[slot] = buildDataFrame(link, link->txFrames[slot],
+                                            link->txPlain[slot] + TX_HEADROOM,
+                                            link->txDataSize[slot], seq);
+    retVal = portSend(link, link->txFrames[slot], link->txFrameSize[slot]);
+    if (retVal != link->txFrameSize[slot])  // problem!
+    {
+        LOG_ERROR("LLS: Block %d, failed to re-send frame\n", seq);
+        return FAILURE;  // problem code
+    }
+    pthread_mutex_lock(&link->rxLock);
+    link->framesSent++;  // increment frame counter (for report)
+    pthread_mutex_unlock(&link->rxLock);
+    return SUCCESS;
+}  // end of resendFrame
+
+
+// ===========================================================================
+/* Function to deal with a good frame received in selective repeat mode.
+   Every frame inside the receive window is ACKed on its own.  The expected
+   frame is left for the caller to return.  A frame further on in the window
+   is kept in its slot until the frames before it have been returned.
+   Blocks missing before it are asked for with NAKs.
+   A frame from just before the window was returned already, but its ACK
+   must have been lost, so it is ACKed again.  Anything else is ignored.
+   Arguments: link is the link to use,
+              frameRx is a pointer to the link's buffer holding the frame,
+              which is moved into the window if the frame is kept,
+              sizeFrame is the number of bytes in the frame,
+              expected is the sequence number of the next block to return,
+              debug controls printing.
+   Returns TRUE if this is the expected frame, FALSE otherwise.  */
+int receiveSelRepeat(LL_link *link, byte_t *frameRx, int sizeFrame,
+                     int expected, int debug)
+{
+    int seq = seqField(link, frameRx);  // sequence number of this frame
+    int slot = SLOT(seq);  // window slot for the frame
+    int offset;   // position of the frame in the receive window
+    byte_t *spare;  // buffer for the next frame, if this one is kept
+    int i;        // for use in loop
+
+    if (seq >= link->modSeq)  // cannot be one of ours
+    {
+        if (debug) printf("LLR: Impossible sequence number %d\n", seq);
+        return FALSE;
+    }
+
+    offset = (seq - expected + link->modSeq) % link->modSeq;
+    if (offset == 0)  // the one we are waiting for
+    {
+        link->rxNaked[slot] = FALSE;
+        ackLater(link, seq, debug);
+        return TRUE;
+    }
+
+    if (offset < link->txWindow)  // early, but inside the window - keep it
+    {
+        if (link->rxBuffered[slot] == FALSE)
+        {
+            // The frame stays in its buffer, which goes in the window,
+            // and the next frame arrives in a new one
+            spare = POOL_get(&link->rxPool);
+            if (spare == NULL)  // cannot happen, but it will come again
+            {
+                if (debug) printf("LLR: No frame buffer free for block %d\n",
+                                  seq);
+                return FALSE;
+            }
+            link->rxFrames[slot] = frameRx;
+            link->frameRx = spare;
+            link->rxFrameSize[slot] = sizeFrame;
+            link->rxBuffered[slot] = TRUE;
+            link->rxNaked[slot] = FALSE;
+            pthread_mutex_lock(&link->rxLock);
+            link->rxKept++;   // takes up room in the receive buffer
+            pthread_mutex_unlock(&link->rxLock);
+            if (debug) printf("LLR: Keeping block %d, waiting for %d\n",
+                              seq, expected);
+        }
+        ackLater(link, seq, debug);
+        // The blocks before it that have not arrived are missing - ask
+        // for each of them, once
+        for (i = expected; i != seq; i = next(link, i))
+        {
+            if (!link->rxBuffered[SLOT(i)] && !link->rxNaked[SLOT(i)])
+                sendNak(link, i, FALSE, debug);
+        }
+    }
+    else if (offset >= link->modSeq - link->txWindow)  // returned already
+    {
+        if (debug) printf("LLR: Duplicate rx seq. %d, expected %d\n",
+                          seq, expected);
+        sendAck(link, POSACK, seq, debug);  // in case previous ACK was not received
+    }
+    else if (debug) printf("LLR: Block %d is outside the window, expected %d\n",
+                           seq, expected);
+
+    return FALSE;
+}  // end of receiveSelRepeat
+
+
+// ===========================================================================
+// Function to advance the sequence number, wrapping around at maximum value.
+int next(LL_link *link, int seq)
+{
+    return ((seq + 1) % link->modSeq);
+}
+
+
+// ===========================================================================
+/* Function to calculate the error check value over a block of bytes,
+   using the type of check selected by LL_setCheck().
+   Arguments: link is the link to use,
+              bytes is a pointer to the bytes to check,
+              nBytes is the number of bytes.
+   Returns the check value - only the low checkLen bytes are used.  */
+unsigned long checkValue(LL_link *link, byte_t *bytes, int nBytes)
+{
+    unsigned long sum = 0;  // for the simple checksum
+    int i;                  // for use in loop
+
+    switch (link->checkType)
+    {
+    case CHECK_CRC16:
+        return CRC_16(bytes, nBytes);
+    case CHECK_CRC32C:
+        return CRC_32C(bytes, nBytes);
+    default:  // simple checksum, modulo MODULO from linklayer.h
+        for (i = 0; i < nBytes; i++) sum += bytes[i];
+        return sum % MODULO;
+    }
+}
+
+
+// ===========================================================================
+// Function to send bytes on the link's port, counting them for the
+// statistics.  The sender and the receiver (with its ACKs) can be in
+// different threads, so they take turns, and the line time charged for
+// pacing adds up.  Returns the number of bytes sent, as PHY_send does.
+static int portSend(LL_link *link, byte_t *bytes, int nBytes)
+{
+    int retVal;  // return value from PHY_send
+
+    pthread_mutex_lock(&link->txLock);
+    retVal = PHY_send(link->port, bytes, nBytes);  // send the bytes
+    pthread_mutex_unlock(&link->txLock);
+
+    if (retVal > 0)
+    {
+        pthread_mutex_lock(&link->rxLock);
+        link->lineBytesTx += retVal;
+        pthread_mutex_unlock(&link->rxLock);
+    }
+    return retVal;
+}
+
+
+// ===========================================================================
+/* Function to read a clock that counts seconds, for measuring intervals.
+   Uses the monotonic clock, which is not affected by changes to the time
+   of day, and has much better resolution than time().
+   Returns the time in seconds from some fixed point in the past.  */
+double timeNow(void)
+{
+    struct timespec now;  // seconds and nanoseconds
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) now.tv_sec + 1.0E-9 * (double) now.tv_nsec;
+}  // end of timeNow
+
+
+// ===========================================================================
+/* Function to update the round trip time estimates with a new sample,
+   and work out a new retransmission timeout from them.
+   The smoothed round trip time moves 1/8 of the way to each sample, and
+   the mean deviation 1/4 of the way.  The timeout is the smoothed time
+   plus four times the deviation, kept between RTO_MIN and TX_WAIT.
+   The estimates are changed under the lock, as LL_linkGetStats reads them.
+   Argument: sample is a measured round trip time in seconds.  */
+void updateRTT(LL_link *link, double sample)
+{
+    double error;  // difference between sample and estimate
+
+    pthread_mutex_lock(&link->rxLock);
+    if (link->rttValid == FALSE)  // first measurement
+    {
+        link->srtt = sample;
+        link->rttvar = sample / 2.0;
+        link->rttValid = TRUE;
+    }
+    else
+    {
+        error = sample - link->srtt;
+        if (error < 0.0) error = -error;
+        link->rttvar = 0.75 * link->rttvar + 0.25 * error;
+        link->srtt = 0.875 * link->srtt + 0.125 * sample;
+    }
+    pthread_mutex_unlock(&link->rxLock);
+
+    resetRTO(link);
+}  // end of updateRTT
+
+
+// ===========================================================================
+/* Function to set the retransmission timeout from the round trip time
+   estimates, undoing any backoff.  Used after each measurement, and
+   when an ACK shows progress but cannot be measured (Karn's rule) -
+   otherwise, with frequent errors, the backoff could last a long time.
+   If there is no estimate yet, the timeout is not changed.  */
+void resetRTO(LL_link *link)
+{
+    if (link->rttValid == FALSE) return;  // nothing to go on yet
+
+    pthread_mutex_lock(&link->rxLock);
+    link->rto = link->srtt + 4.0 * link->rttvar;
+    if (link->rto < RTO_MIN) link->rto = RTO_MIN;
+    if (link->rto > TX_WAIT) link->rto = TX_WAIT;
+    pthread_mutex_unlock(&link->rxLock);
+}  // end of resetRTO
+
+
+// ===========================================================================
+/* Function to return the size of a frame, from the size field in its
+   header: one byte, or two in a long header.
+   Arguments: link is the link to use,
+              header is a pointer to the header, after unstuffing.  */
+int sizeField(LL_link *link, byte_t *header)
+{
+    if (link->longFrames)
+        return header[FRSPOS] | (header[LENHIPOS] << 8);
+    return header[FRSPOS];
+}  // end of sizeField
+
+
+// ===========================================================================
+/* Functions to get and put the sequence number and the ACK carried, in a
+   frame header: one byte each, and a high byte each, just before the
+   header check, with 16-bit sequence numbers.  An ACK field with every
+   bit set means the frame carries no ACK.
+   Arguments: link is the link to use,
+              header is a pointer to the header, after unstuffing,
+              seq and ack are the values to put, ack -1 for no ACK.  */
+int seqField(LL_link *link, byte_t *header)
+{
+    int hdr = link->headerSize;  // number of bytes in the header
+
+    if (link->seqBits > 8)
+        return header[SEQNUMPOS] | (header[hdr-3] << 8);
+    return header[SEQNUMPOS];
+}  // end of seqField
+
+int ackField(LL_link *link, byte_t *header)
+{
+    int hdr = link->headerSize;  // number of bytes in the header
+
+    if (link->seqBits > 8)
+    {
+        if ((header[ACKPOS] == NOACK) && (header[hdr-2] == NOACK)) return -1;
+        return header[ACKPOS] | (header[hdr-2] << 8);
+    }
+    return (header[ACKPOS] == NOACK) ? -1 : header[ACKPOS];
+}  // end of ackField
+
+void putSeqFields(LL_link *link, byte_t *header, int seq, int ack)
+{
+    int hdr = link->headerSize;  // number of bytes in the header
+
+    if (ack < 0) ack = 0xFFFF;   // every bit set, in either size
+    header[SEQNUMPOS] = (byte_t) seq;
+    header[ACKPOS] = (byte_t) ack;
+    if (link->seqBits > 8)
+    {
+        header[hdr-3] = (byte_t) (seq >> 8);
+        header[hdr-2] = (byte_t) (ack >> 8);
+    }
+}  // end of putSeqFields
+
+
+// ===========================================================================
+/* Function to return the number of FEC parity bytes in a data frame.
+   Each piece of up to RS_MAX_BLOCK bytes, less its parity, has fecLen
+   parity bytes.  A normal frame is always one piece.
+   Arguments: link is the link to use,
+              nCovered is the number of data and check bytes.  */
+int fecParity(LL_link *link, int nCovered)
+{
+    int nPiece = RS_MAX_BLOCK - link->fecLen;  // most bytes in a piece
+
+    if (link->fecLen == 0) return 0;
+    return link->fecLen * ((nCovered + nPiece - 1) / nPiece);
+}  // end of fecParity
+
+
+// ===========================================================================
+/* Function to update the error rate estimate, used to choose the block
+   size, with one frame sent or received.  The counts so far are weighted
+   by ERR_MEMORY first, so the estimate follows the last hundred or so
+   frames.  The sender and the receiver both add to it, so it is changed
+   under the lock.
+   Arguments: link is the link to use,
+              nBytes is the number of bytes in the frame,
+              good is TRUE if it got through intact, FALSE if not.  */
+void noteFrameResult(LL_link *link, int nBytes, int good)
+{
+    pthread_mutex_lock(&link->rxLock);
+    link->errFrames = ERR_MEMORY * link->errFrames + 1.0;
+    link->errBad = ERR_MEMORY * link->errBad + (good ? 0.0 : 1.0);
+    link->errBytes = ERR_MEMORY * link->errBytes + nBytes;
+    pthread_mutex_unlock(&link->rxLock);
+}  // end of noteFrameResult
+
+
+// ===========================================================================
+/* Function to count a frame received, good or bad, for the report, and
+   add it to the error rate estimate.  Frames are received by the sender
+   (its responses) as well as by LL_receive, so the count is under the
+   lock.  Arguments as for noteFrameResult.  */
+void noteFrameRx(LL_link *link, int nBytes, int good)
+{
+    pthread_mutex_lock(&link->rxLock);
+    if (good) link->goodFrames++;
+    else link->badFrames++;
+    pthread_mutex_unlock(&link->rxLock);
+    noteFrameResult(link, nBytes, good);
+}  // end of noteFrameRx
+
+
+// ===========================================================================
+/* Function to double the retransmission timeout, after a timeout.
+   The next ACK that shows progress will bring it back to the estimate.  */
+void backoffRTO(LL_link *link)
+{
+    pthread_mutex_lock(&link->rxLock);
+    link->rto = 2.0 * link->rto;
+    if (link->rto > TX_WAIT) link->rto = TX_WAIT;
+    pthread_mutex_unlock(&link->rxLock);
+}  // end of backoffRTO
+
 
 // ===========================================================================
 /* Function to set a time limit at a point in the future.
-   limit   is the time limit in seconds (from now)  */
+   limit   is the time limit in seconds (from now)
+   Uses the monotonic clock of the physical layer, in ms, so the
+   result can also be given to PHY_setDeadline.
+   returns the time limit, in ms.  */
 long timeSet(float limit)
 {
-    long timeLimit = clock() + (long)(limit * CLOCKS_PER_SEC);
+    long timeLimit = PHY_timeMs() + (long)(limit * 1000.0f + 0.5f);
     return timeLimit;
 }  // end of timeSet
 
@@ -681,7 +3976,7 @@ long timeSet(float limit)
            FALSE if time has not yet reached the limit.   */
 int timeUp(long timeLimit)
 {
-    if (clock() < timeLimit) return FALSE;  // still within limit
+    if (PHY_timeMs() < timeLimit) return FALSE;  // still within limit
     else return TRUE;  // time limit has been reached or exceeded
 }  // end of timeUP
 
@@ -689,10 +3984,12 @@ int timeUp(long timeLimit)
 /* Function to check if a byte is one of the protocol bytes.
    argument b is a byte value to check
    returns TRUE if b is a protocol byte,
-           FALSE if b is not a protocol byte.*/
+           FALSE if b is not a protocol byte.
+   The bytes are the ones byte stuffing escapes, so it asks the stuffing
+   functions.  */
 int special(byte_t b)
 {
-    return FALSE;   // no checking in this version
+    return STUFF_special(b);
 }
 
 // ===========================================================================
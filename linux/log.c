@@ -0,0 +1,105 @@
+/*  Logging functions, for messages from the link and physical layers.
+       LOG_write    logs a message, used by the LOG_... macros
+       LOG_setEcho  sets the lowest level that is printed as well
+       LOG_dump     prints the messages held, to see what led to a problem
+    The ring is an array of LOG_RING entries, and a count of messages
+    logged.  A message takes its place by adding one to the count, with
+    an atomic step, so two threads never get the same place.  Each entry
+    has a stamp: LOG_BUSY while it is being written, then the message
+    number plus one.  A message that finds its entry busy, as the ring
+    has gone all the way round while another is still being written, is
+    dropped.  LOG_dump reads the stamp before and after copying the
+    message, and leaves it out if they differ, as the entry was written
+    again while it was being copied.  */
+
+#include <stdio.h>      // for vsnprintf, fputs, fprintf
+#include <stdarg.h>     // for the variable argument list
+#include <stdatomic.h>  // for the count and the stamps
+#include "log.h"        // header file for functions in this file
+
+#define LOG_BUSY (~0UL)  // stamp on an entry while it is being written
+
+// One message in the ring
+typedef struct
+{
+    atomic_ulong stamp;     // message number plus one, or LOG_BUSY
+    int level;              // level it was logged at
+    char text[LOG_LINE];    // the message
+} logEntry;
+
+static logEntry logRing[LOG_RING];   // the last LOG_RING messages
+static atomic_ulong logCount;        // number of messages logged
+static atomic_int echoLevel = LOG_LVL_WARN;  // lowest level printed
+
+//===================================================================
+/* Function to log a message at the given level, like printf.
+   Long messages are cut short, to fit in LOG_LINE characters.  */
+void LOG_write(int level, const char *format, ...)
+{
+    va_list args;     // the arguments after the format
+    unsigned long n;  // number of this message
+    unsigned long old;  // stamp on its entry, from an older message
+    logEntry *entry;  // its place in the ring
+
+    n = atomic_fetch_add(&logCount, 1);
+    entry = &logRing[n % LOG_RING];
+
+    // Mark the entry busy, unless another message is being written there
+    old = atomic_load_explicit(&entry->stamp, memory_order_relaxed);
+    if ((old == LOG_BUSY) || !atomic_compare_exchange_strong_explicit(
+            &entry->stamp, &old, LOG_BUSY,
+            memory_order_acquire, memory_order_relaxed))
+        return;  // drop this message
+    atomic_thread_fence(memory_order_release);  // stamp changes first
+
+    va_start(args, format);
+    vsnprintf(entry->text, LOG_LINE, format, args);
+    va_end(args);
+    entry->level = level;
+    if (level >= atomic_load(&echoLevel)) fputs(entry->text, stdout);
+
+    atomic_store_explicit(&entry->stamp, n + 1, memory_order_release);
+}
+
+
+//===================================================================
+/* Function to set the lowest level of message that is printed.
+   Returns the level it was before.  */
+int LOG_setEcho(int level)
+{
+    return atomic_exchange(&echoLevel, level);
+}
+
+
+//===================================================================
+/* Function to print all the messages in the ring, oldest first, after
+   a line saying how many there are.  Prints nothing if there are none.
+   Returns the number of messages printed.  */
+int LOG_dump(FILE *out)
+{
+    char text[LOG_LINE];   // copy of a message
+    unsigned long count = atomic_load(&logCount);  // messages logged
+    unsigned long n;       // number of message to print
+    unsigned long stamp;   // stamp on its entry
+    logEntry *entry;       // its place in the ring
+    int level;             // its level
+    int nPrinted = 0;      // messages printed
+
+    if (count > 0)
+        fprintf(out, "LOG: Last %lu messages, oldest first\n",
+                (count > LOG_RING) ? (unsigned long) LOG_RING : count);
+    for (n = (count > LOG_RING) ? count - LOG_RING : 0; n < count; n++)
+    {
+        entry = &logRing[n % LOG_RING];
+        stamp = atomic_load_explicit(&entry->stamp, memory_order_acquire);
+        if (stamp != n + 1) continue;  // being written, or written again
+        level = entry->level;
+        snprintf(text, LOG_LINE, "%s", entry->text);
+        atomic_thread_fence(memory_order_acquire);  // copy before re-read
+        if (atomic_load_explicit(&entry->stamp, memory_order_relaxed) != stamp)
+            continue;  // written again while it was copied
+        fprintf(out, "[%c] %s", "DIWE"[level & 3], text);
+        nPrinted++;
+    }
+    return nPrinted;
+}
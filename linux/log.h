@@ -0,0 +1,79 @@
+#ifndef LOG_H_INCLUDED
+#define LOG_H_INCLUDED
+
+#include <stdio.h>  // for FILE
+
+/*  Logging functions, for messages from the link and physical layers.
+       LOG_DEBUG, LOG_INFO, LOG_WARN and LOG_ERROR   log a message, like
+                    printf, at that level
+       LOG_setEcho  sets the lowest level that is printed as well
+       LOG_dump     prints the messages held, to see what led to a problem
+    Each message goes into a ring of the last LOG_RING messages, in
+    memory.  Messages at the echo level or above, warnings and errors at
+    first, are printed too.  The others cost only a copy into the ring,
+    so detailed messages can be kept on a busy port, and printed with
+    LOG_dump when something goes wrong.
+    Messages below LOG_MIN_LEVEL are removed when the program is
+    compiled, so they cost nothing at all - their arguments are not
+    even worked out.  The default leaves out the debug messages, which
+    come once or more for every frame.  To keep them, compile with
+    -DLOG_MIN_LEVEL=0.
+    Any thread can log at any time: the ring has no lock, as each
+    message takes the next place in it with one atomic step. */
+
+// Levels, lowest first
+#define LOG_LVL_DEBUG 0  // details of each frame, for finding problems
+#define LOG_LVL_INFO 1   // things worth knowing, once in a while
+#define LOG_LVL_WARN 2   // something went wrong, and was dealt with
+#define LOG_LVL_ERROR 3  // something went wrong, and could not be
+
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LVL_INFO  // lowest level compiled in
+#endif
+
+#define LOG_RING 256    // messages held in the ring - a power of 2
+#define LOG_LINE 160    // most characters in a message, with the end
+
+/* LOG_write function - logs a message at the given level, like printf.
+   Use the macros below instead, so messages below LOG_MIN_LEVEL are
+   removed when compiled. */
+void LOG_write(int level, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+#if LOG_MIN_LEVEL <= LOG_LVL_DEBUG
+#define LOG_DEBUG(...) LOG_write(LOG_LVL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) ((void) 0)
+#endif
+
+#if LOG_MIN_LEVEL <= LOG_LVL_INFO
+#define LOG_INFO(...) LOG_write(LOG_LVL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...) ((void) 0)
+#endif
+
+#if LOG_MIN_LEVEL <= LOG_LVL_WARN
+#define LOG_WARN(...) LOG_write(LOG_LVL_WARN, __VA_ARGS__)
+#else
+#define LOG_WARN(...) ((void) 0)
+#endif
+
+#if LOG_MIN_LEVEL <= LOG_LVL_ERROR
+#define LOG_ERROR(...) LOG_write(LOG_LVL_ERROR, __VA_ARGS__)
+#else
+#define LOG_ERROR(...) ((void) 0)
+#endif
+
+/* LOG_setEcho function - sets the lowest level of message that is
+   printed, as well as going into the ring.  The default is LOG_LVL_WARN.
+   Returns the level it was before. */
+int LOG_setEcho(int level);
+
+/* LOG_dump function - prints all the messages held in the ring, oldest
+   first, with their levels.  Those printed when they were logged are
+   printed again, so they are seen with the messages around them.
+   Argument: file to print them to, e.g. stdout.
+   Returns the number of messages printed. */
+int LOG_dump(FILE *out);
+
+#endif // LOG_H_INCLUDED
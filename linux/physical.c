@@ -3,6 +3,25 @@
        PHY_close   closes the port
        PHY_send    sends bytes
        PHY_get     gets received bytes
+       PHY_getTo   gets received bytes up to a marker byte
+       PHY_skipTo  discards received bytes up to a marker byte
+       PHY_setDeadline  sets a time limit for receiving
+    Received bytes are read from the port in large blocks into a ring
+    buffer, and PHY_get and PHY_skipTo take them from there.  When a
+    deadline is set, poll() is used to wait for bytes, so waiting stops
+    at the deadline rather than at the end of the port timeout.
+    The port name chooses one of several kinds of port (backends), each
+    with its own open, send, get and close functions:
+       "loop"          in memory: bytes sent come back to the same end
+       "mem0", "mem1"  the two ends of a socket pair, at memory speed
+       "pty0", "pty1"  the master and slave ends of a pseudo-terminal
+       anything else   a serial port, /dev/<name>, set up with termios
+    A ":rate" suffix, e.g. "mem0:9600", paces sending on the first three
+    to that bit rate, with 10 bits per byte.  Simulated errors are added
+    to received bytes in the same way for every kind of port.
+    PHY_open gives a handle for the port, which the other functions take,
+    and each port has its own settings and buffers, so a program can
+    have several ports open at once.
     All functions print explanatory messages if there is
     a problem, and return values to indicate failure.
     This version uses standard C functions and some functions specific
@@ -11,35 +30,171 @@
 #include <stdio.h>   // needed for printf
 //#include <windows.h>  // needed for port functions
 #include <string.h>
-#include <stdlib.h>  // for random number functions
-#include <time.h>    // for time function, used to seed rand
+#include <stdlib.h>  // for random number functions, calloc
+#include <stdint.h>  // for uintptr_t, used to seed them
+#include <time.h>    // for time function, used to seed them
+#include <math.h>    // for log function, used in error simulation
+#include <stdatomic.h>  // for the count of ports opened
+#include <pthread.h>    // for the lock on the port pairs
 #include "physical.h"  // header file for functions in this file
+#include "log.h"       // for messages, kept in a ring of the last few
 
 // Linux specific
 #include <fcntl.h> // Contains file controls like O_RDWR
 #include <errno.h> // Error integer and strerror() function
 #include <termios.h> // Contains POSIX terminal control definitions
 #include <unistd.h> // write(), read(), close()
+#include <poll.h>   // poll(), to wait for bytes with a time limit
+#include <sys/socket.h>  // socketpair(), for the mem ports
+#include <pty.h>    // openpty(), for the pty ports
 
-/* Creating a variable this way allows it to be shared
-   by the functions in this file only.  */
-// static HANDLE serial = INVALID_HANDLE_VALUE;  // handle for serial port
-static double rxProbErr = 0.0; // probability of error, used in PHY_get()
-
-static int serial_port = -1;
+/* Port backends.  Each kind of port has its own functions to open, send,
+   get bytes (waiting no later than the deadline), and close.  */
+typedef struct
+{
+    int (*open)(PHY_port *port, const char *portName, int bitRate,
+                int nDataBits, int parity, int rxTimeConst, int rxTimeIntv);
+    int (*send)(PHY_port *port, byte_t *dataTx, int nBytesToSend);
+    int (*get)(PHY_port *port, byte_t *dataRx, int nBytesToGet);
+    void (*close)(PHY_port *port);
+} phyBackend;
+
+/* Everything about one open port.  Each port has its own, so one
+   program can use several ports at once.  */
+struct PHY_port
+{
+    const phyBackend *backend;  // kind of port
+    int fd;               // file descriptor, -1 for the loop port
+    double rxProbErr;     // probability of error, used in PHY_get()
+    long bytesToError;    // bytes to receive before next simulated error
+    unsigned short errSeed[3];  // state of this port's random numbers
+    int portWaitMs;       // wait for bytes if no deadline, ms (-1 forever)
+    long paceRate;        // bit rate for paced sending, 0 for none
+    long lineFreeMs;      // time the paced line finishes sending
+
+    /* Receive ring buffer.  Bytes are read from the port in blocks as large
+       as the free space allows, so one read() usually brings in a whole frame
+       (or several), instead of one system call per byte.  */
+    byte_t rxRing[PHY_RXBUF];  // received bytes not yet taken
+    int rxHead;           // position of the oldest byte in the ring
+    int rxCount;          // number of bytes in the ring
+    long rxDeadline;      // ms time to stop waiting, 0 if none
+
+    // The loop port keeps bytes sent here, until they are got
+    byte_t loopBuf[PHY_RXBUF];  // bytes sent, not yet got
+    int loopCount;              // number of bytes in loopBuf
+};
+
+/* Pairs of connected ports, made by PHY_makePair.  A pair made before
+   fork() is shared, so a parent and child process can talk over it.
+   The ends not yet opened are shared by all the ports in this program,
+   so they are changed under the lock, as ports can open in any thread.  */
+static int pairFd[2][2] = {{-1, -1}, {-1, -1}};  // [mem or pty][end 0 or 1]
+static pthread_mutex_t pairLock = PTHREAD_MUTEX_INITIALIZER;  // for pairFd
+
+// Functions used only in this file
+static int fillRing(PHY_port *port);
+static long errorGap(PHY_port *port);
+static int serialOpen(PHY_port *port, const char *portName, int bitRate,
+                      int nDataBits, int parity, int rxTimeConst, int rxTimeIntv);
+static int pairOpen(PHY_port *port, const char *portName, int bitRate,
+                    int nDataBits, int parity, int rxTimeConst, int rxTimeIntv);
+static int loopOpen(PHY_port *port, const char *portName, int bitRate,
+                    int nDataBits, int parity, int rxTimeConst, int rxTimeIntv);
+static int fdSend(PHY_port *port, byte_t *dataTx, int nBytesToSend);
+static int fdGet(PHY_port *port, byte_t *dataRx, int nBytesToGet);
+static void fdClose(PHY_port *port);
+static int loopSend(PHY_port *port, byte_t *dataTx, int nBytesToSend);
+static int loopGet(PHY_port *port, byte_t *dataRx, int nBytesToGet);
+static void loopClose(PHY_port *port);
+static int pairKind(const char *portName);
+static int makePair(const char *portName);
+
+static const phyBackend serialBackend = {serialOpen, fdSend, fdGet, fdClose};
+static const phyBackend pairBackend = {pairOpen, fdSend, fdGet, fdClose};
+static const phyBackend loopBackend = {loopOpen, loopSend, loopGet, loopClose};
 
-/* PHY_open function - to open and configure the serial port.
-   Arguments are port number, bit rate, number of data bits, parity,
+//===================================================================
+/* PHY_open function - to open and configure the port.
+   Arguments are a pointer to the port handle, which is set if the port
+   opens, then port name, bit rate, number of data bits, parity,
    receive timeout constant, rx timeout interval, rx probability of error.
-   See comments below for more detail on timeouts.
+   The port name chooses the kind of port - see the top of this file.
    Returns zero if it succeeds - anything non-zero is a problem.*/
-int PHY_open(const char *portName,       // port name: e.g. "ttyS10"
+int PHY_open(PHY_port **portOpened,   // handle for the port, once open
+             const char *portName,       // port name: e.g. "ttyS10"
              int bitRate,       // bit rate: e.g. 1200, 4800, etc.
              int nDataBits,     // number of data bits: 7 or 8
              int parity,        // parity: 0 = none, 1 = odd, 2 = even
              int rxTimeConst,   // rx timeout constant in ms: 0 waits forever
              int rxTimeIntv,    // rx timeout interval in ms: 0 waits forever
              double probErr)    // rx probability of error: 0.0 for none
+{
+    PHY_port *port;    // the new port
+    const char *rate;  // pacing rate suffix in port name, if any
+    int retVal;        // return value from backend
+    static atomic_ulong nOpened = 0;  // ports opened by this program
+    unsigned long long seed;  // seed for this port's random numbers
+
+    *portOpened = NULL;
+    port = calloc(1, sizeof(PHY_port));  // everything starts at zero
+    if (port == NULL)
+    {
+        printf("PHY: No memory for port %s\n", portName);
+        return 7;
+    }
+    port->fd = -1;
+
+    // Choose the backend from the port name
+    if (strncmp(portName, "loop", 4) == 0) port->backend = &loopBackend;
+    else if (pairKind(portName) >= 0) port->backend = &pairBackend;
+    else port->backend = &serialBackend;
+
+    rate = strchr(portName, ':');
+    if ((rate != NULL) && (port->backend != &serialBackend))
+        port->paceRate = atol(rate + 1);
+    port->portWaitMs = (rxTimeConst > 0) ? rxTimeConst : -1;
+
+    retVal = port->backend->open(port, portName, bitRate, nDataBits, parity,
+                                 rxTimeConst, rxTimeIntv);
+    if (retVal != 0)
+    {
+        free(port);
+        return retVal;
+    }
+
+    /* Set up simulated errors on the receive path:
+       Seed this port's own random numbers, so opening another port does
+       not change its errors, and ports opened together get different ones.
+       Then check the probability of error value. */
+    seed = (unsigned long long) time(NULL)
+           ^ ((unsigned long long) getpid() << 24)
+           ^ ((atomic_fetch_add(&nOpened, 1) + 1) * 2654435761ULL)
+           ^ (uintptr_t) port;
+    port->errSeed[0] = (unsigned short) seed;
+    port->errSeed[1] = (unsigned short) (seed >> 16);
+    port->errSeed[2] = (unsigned short) (seed >> 32);
+    if ((probErr>=0.0) && (probErr<=1.0))  // check valid
+        port->rxProbErr = probErr; // keep value for this port
+    port->bytesToError = errorGap(port);  // position of the first simulated error,
+                                          // which can be the first byte
+
+    *portOpened = port;
+    return 0;
+}
+
+//===================================================================
+/* Function to open and configure a serial port, /dev/<portName>.
+   Arguments are as for PHY_open, without the probability of error.
+   See comments below for more detail on timeouts.
+   Returns zero if it succeeds - anything non-zero is a problem.*/
+static int serialOpen(PHY_port *port,  // port being opened
+             const char *portName,  // port name: e.g. "ttyS10"
+             int bitRate,       // bit rate: e.g. 1200, 4800, etc.
+             int nDataBits,     // number of data bits: 7 or 8
+             int parity,        // parity: 0 = none, 1 = odd, 2 = even
+             int rxTimeConst,   // rx timeout constant in ms: 0 waits forever
+             int rxTimeIntv)    // rx timeout interval in ms: 0 waits forever
 {
     // Define variables
     int bitRatio, bitRatioValid, i;  // for bit rate checking
@@ -113,13 +268,13 @@ int PHY_open(const char *portName,       // port name: e.g. "ttyS10"
     }
     */
 
-    serial_port = open(Full_portName, O_RDWR); 
+    port->fd = open(Full_portName, O_RDWR); 
 
-    if (serial_port < 0) {
+    if (port->fd < 0) {
       printf("Error number %i from open(): %s\n", errno, strerror(errno));
     }
     
-    if(tcgetattr(serial_port, &tty) != 0) {
+    if(tcgetattr(port->fd, &tty) != 0) {
       printf("Error %i from tcgetattr: %s\n", errno, strerror(errno));
     }
 
@@ -235,7 +390,7 @@ int PHY_open(const char *portName,       // port name: e.g. "ttyS10"
 
 
     // Save tty settings, also checking for error
-    if (tcsetattr(serial_port, TCSANOW, &tty) != 0) {   //this fuction sets and saves attributes described above
+    if (tcsetattr(port->fd, TCSANOW, &tty) != 0) {   //this fuction sets and saves attributes described above
       printf("Error %i from tcsetattr: %s\n", errno, strerror(errno));
       return 1;
     }
@@ -251,35 +406,190 @@ int PHY_open(const char *portName,       // port name: e.g. "ttyS10"
 
     
 
-    /* Set up simulated errors on the receive path:
-       Set the seed for the random number generator,
-       and check the probability of error value. */
-    srand(time(NULL));  // get time and use as seed
-    if ((probErr>=0.0) && (probErr<=1.0))  // check valid
-        rxProbErr = probErr; // pass value to shared variable
-
     // If we get this far, the port is open and configured
     sleep(2); //required to make flush work, for some reason
-    tcflush(serial_port, TCIOFLUSH);
+    tcflush(port->fd, TCIOFLUSH);
+
+    return 0;
+}
+
+//===================================================================
+/* PHY_makePair function, to make a pair of connected ports.
+   Argument: port name, "mem..." for a socket pair, "pty..." for a
+   pseudo-terminal (any end number or rate suffix is ignored).
+   A program that forks should make the pair first, so both processes
+   share it - PHY_open makes it otherwise.  If an end of the last pair
+   has been opened already, any other end left over is closed, and a
+   new pair is made, so a program can make one pair for each run.
+   Returns zero if it succeeds - anything non-zero is a problem.  */
+int PHY_makePair(const char *portName)
+{
+    int retVal;  // return value from makePair
 
+    pthread_mutex_lock(&pairLock);
+    retVal = makePair(portName);
+    pthread_mutex_unlock(&pairLock);
+    return retVal;
+}
+
+//===================================================================
+/* Function to make a pair of connected ports, for PHY_makePair and
+   pairOpen, which hold the lock on the pairs.
+   Returns zero if it succeeds - anything non-zero is a problem.  */
+static int makePair(const char *portName)
+{
+    int kind = pairKind(portName);  // 0 for mem, 1 for pty
+    int end;                        // for use in loop
+    struct termios tty;             // pty settings
+
+    if (kind < 0)
+    {
+        printf("PHY: %s is not a kind of port pair\n", portName);
+        return 3;
+    }
+    if ((pairFd[kind][0] >= 0) && (pairFd[kind][1] >= 0)) return 0;  // made already
+    for (end = 0; end < 2; end++)  // close what is left of the last pair
+    {
+        if (pairFd[kind][end] >= 0) close(pairFd[kind][end]);
+        pairFd[kind][end] = -1;
+    }
+
+    if (kind == 0)  // socket pair - a two-way connection in memory
+    {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pairFd[kind]) != 0)
+        {
+            printf("Error %i from socketpair: %s\n", errno, strerror(errno));
+            return 1;
+        }
+    }
+    else  // pseudo-terminal - the slave end acts like a serial port
+    {
+        if (openpty(&pairFd[kind][0], &pairFd[kind][1], NULL, NULL, NULL) != 0)
+        {
+            printf("Error %i from openpty: %s\n", errno, strerror(errno));
+            return 1;
+        }
+        tcgetattr(pairFd[kind][1], &tty);
+        cfmakeraw(&tty);  // no changes to any bytes, in either direction
+        tcsetattr(pairFd[kind][1], TCSANOW, &tty);
+    }
+    return 0;
+}
+
+//===================================================================
+/* Function to work out which kind of port pair a name refers to.
+   Returns 0 for mem, 1 for pty, or -1 if it is not a pair.  */
+static int pairKind(const char *portName)
+{
+    if (strncmp(portName, "mem", 3) == 0) return 0;
+    if (strncmp(portName, "pty", 3) == 0) return 1;
+    return -1;
+}
+
+//===================================================================
+/* Function to open one end of a port pair, making the pair if needed.
+   The end is given by the digit after "mem" or "pty": 0 or 1.
+   Returns zero if it succeeds - anything non-zero is a problem.*/
+static int pairOpen(PHY_port *port, const char *portName, int bitRate,
+                    int nDataBits, int parity, int rxTimeConst, int rxTimeIntv)
+{
+    int kind = pairKind(portName);             // 0 for mem, 1 for pty
+    int end = (portName[3] == '1') ? 1 : 0;    // which end of the pair
+    int retVal = 0;                            // return value
+
+    pthread_mutex_lock(&pairLock);
+    if (pairFd[kind][end] < 0)  // no pair, or this end has been used
+        retVal = makePair(portName);
+    port->fd = pairFd[kind][end];
+    pairFd[kind][end] = -1;  // this end is now in use - close will end it
+    pthread_mutex_unlock(&pairLock);
+    if (retVal != 0) return retVal;
+
+    if (port->fd < 0)
+    {
+        printf("PHY: Port %s is already in use\n", portName);
+        return 1;
+    }
+    printf("Port %s is end %d of a %s pair\n", portName, end,
+           kind ? "pseudo-terminal" : "socket");
+    return 0;
+}
+
+//===================================================================
+/* Function to open the loop port - bytes sent come back to this end.
+   Returns zero always.  */
+static int loopOpen(PHY_port *port, const char *portName, int bitRate,
+                    int nDataBits, int parity, int rxTimeConst, int rxTimeIntv)
+{
+    port->loopCount = 0;
+    printf("Port %s sends bytes back to itself\n", portName);
     return 0;
 }
 
 //===================================================================
-/* PHY_close function, to close the serial port.
-   Takes no arguments, returns 0 always.  */
-int PHY_close()
+/* PHY_close function, to close the port.
+   Argument: port handle, from PHY_open.  The handle cannot be used
+   after this, and anything left in the ring is discarded.
+   Returns 0 always.  */
+int PHY_close(PHY_port *port)
 {
-    close(serial_port);
+    if (port == NULL) return 0;  // not open
+    port->backend->close(port);
+    free(port);
     return 0;
 }
 
+//===================================================================
+/* Function to close a port that has a file descriptor.  One closed
+   already, after a problem sending or receiving, is left alone, as its
+   number may have been given to another file since.  */
+static void fdClose(PHY_port *port)
+{
+    if (port->fd >= 0) close(port->fd);
+    port->fd = -1;
+}
+
+//===================================================================
+/* Function to close the loop port, discarding any bytes in it.  */
+static void loopClose(PHY_port *port)
+{
+    port->loopCount = 0;
+}
+
 //===================================================================
 /* PHY_send function, to send bytes.
-   Arguments: pointer to array holding bytes to be sent;
+   Arguments: port handle, from PHY_open;
+              pointer to array holding bytes to be sent;
               number of bytes to send.
+   If sending is paced, waits until the simulated line would have
+   finished sending these bytes, then hands them over all at once.
+   Calls for one port must not overlap, as the line time is not locked -
+   the link layer sends one frame at a time, from any thread.
    Returns number of bytesize sent, or negative value on failure.  */
-int PHY_send(byte_t *dataTx, int nBytesToSend)
+int PHY_send(PHY_port *port, byte_t *dataTx, int nBytesToSend)
+{
+    long nowMs;  // time now
+
+    if (port == NULL)
+    {
+        printf("PHY: Port not open\n");
+        return -9;  // negative return value indicates failure
+    }
+
+    if (port->paceRate > 0)  // 10 bits per byte, with start and stop bits
+    {
+        nowMs = PHY_timeMs();
+        if (port->lineFreeMs < nowMs) port->lineFreeMs = nowMs;  // line was idle
+        port->lineFreeMs += (10000L * nBytesToSend) / port->paceRate;
+        if (port->lineFreeMs > nowMs) usleep((useconds_t) (1000 * (port->lineFreeMs - nowMs)));
+    }
+    return port->backend->send(port, dataTx, nBytesToSend);
+}
+
+//===================================================================
+/* Function to send bytes to a port that has a file descriptor.
+   Returns number of bytes sent, or negative value on failure.  */
+static int fdSend(PHY_port *port, byte_t *dataTx, int nBytesToSend)
 {
   //DWORD nBytesTx;  // double-word - number of bytes actually sent
      int nBytesSent;    // integer version of the same
@@ -293,16 +603,22 @@ int PHY_send(byte_t *dataTx, int nBytesToSend)
      //   return -9;  // negative return value indicates failure
      //}
 
+     if (port->fd < 0)  // closed after an earlier problem
+     {
+         printf("PHY: Port closed after a problem\n");
+         return -5;
+     }
+
     // Try to send the bytes as requested
 
-     printf("sending size=%d\n", nBytesToSend);
-     nBytesSent = write(serial_port, dataTx, nBytesToSend);
-     printf("bytes sent=%d\n", nBytesSent);
+     nBytesSent = write(port->fd, dataTx, nBytesToSend);
+     LOG_DEBUG("PHY: Sent %d of %d bytes\n", nBytesSent, nBytesToSend);
      
      if(( nBytesSent ) == -1) {
        printf("PHY: Problem sending data\n");
        printf("Error %i from function: %s\n", errno, strerror(errno));
-       close(serial_port);
+       close(port->fd);
+       port->fd = -1;  // so it is not closed again
        return -5;
     }
        
@@ -324,60 +640,295 @@ int PHY_send(byte_t *dataTx, int nBytesToSend)
     // note that timeout is not regarded as a failure here
 }
 
+//===================================================================
+/* Function to send bytes to the loop port - they are kept to be got.
+   Returns number of bytes sent, fewer if there is no room.  */
+static int loopSend(PHY_port *port, byte_t *dataTx, int nBytesToSend)
+{
+    if (nBytesToSend > PHY_RXBUF - port->loopCount) nBytesToSend = PHY_RXBUF - port->loopCount;
+    memcpy(port->loopBuf + port->loopCount, dataTx, nBytesToSend);
+    port->loopCount += nBytesToSend;
+    return nBytesToSend;
+}
+
 //===================================================================
 /* PHY_get function, to get received bytes.
-   Arguments: pointer to array to hold received bytes;
+   Arguments: port handle, from PHY_open;
+              pointer to array to hold received bytes;
               maximum number of bytes to receive.
+   Bytes are taken from the ring buffer.  If the ring is empty, one read
+   is done to fill it, waiting until the deadline (or the port timeout,
+   if there is no deadline) for bytes to arrive.
    Returns number of bytes actually received, or negative value on failure.  */
-int PHY_get(byte_t *dataRx, int nBytesToGet)
+int PHY_get(PHY_port *port, byte_t *dataRx, int nBytesToGet)
+{
+     int nBytesGot = 0;  // number of bytes copied so far
+     int nChunk;         // bytes to copy before the ring wraps around
+     int retVal;         // return value from fillRing
+
+     if (port->rxCount == 0)  // nothing waiting - try to get some more
+     {
+         retVal = fillRing(port);
+         if (retVal <= 0) return retVal;  // timeout (0) or failure
+     }
+
+     if (nBytesToGet > port->rxCount) nBytesToGet = port->rxCount;  // take what we have
+
+     // Copy in up to two pieces, as the bytes may wrap around the ring
+     while (nBytesGot < nBytesToGet)
+     {
+         nChunk = PHY_RXBUF - port->rxHead;  // bytes before the end of the ring
+         if (nChunk > nBytesToGet - nBytesGot) nChunk = nBytesToGet - nBytesGot;
+         memcpy(dataRx + nBytesGot, port->rxRing + port->rxHead, nChunk);
+         nBytesGot += nChunk;
+         port->rxHead = (port->rxHead + nChunk) % PHY_RXBUF;
+         port->rxCount -= nChunk;
+     }
+
+    return nBytesGot; // if no problem, return the number of bytes received
+}
+
+//===================================================================
+/* PHY_getTo function, to get received bytes up to a marker byte.
+   Arguments: port is the port handle, from PHY_open;
+              dataRx is a pointer to array to hold received bytes;
+              nBytesToGet is the maximum number of bytes to get;
+              marker is the byte value to stop at;
+              found is a pointer to a flag, set to 1 if the marker was got.
+   Like PHY_get, but stops after the marker, leaving any later bytes in
+   the ring.  The marker is found with memchr, not byte by byte.
+   Returns number of bytes actually got, or negative value on failure.  */
+int PHY_getTo(PHY_port *port, byte_t *dataRx, int nBytesToGet,
+              byte_t marker, int *found)
+{
+     int nBytesGot = 0;  // number of bytes copied so far
+     int nChunk;         // bytes to copy before the ring wraps around
+     byte_t *end;        // pointer to marker byte, if found
+     int retVal;         // return value from fillRing
+
+     *found = 0;
+     if (port->rxCount == 0)  // nothing waiting - try to get some more
+     {
+         retVal = fillRing(port);
+         if (retVal <= 0) return retVal;  // timeout (0) or failure
+     }
+
+     if (nBytesToGet > port->rxCount) nBytesToGet = port->rxCount;  // take what we have
+
+     // Copy in up to two pieces, as the bytes may wrap around the ring
+     while ((nBytesGot < nBytesToGet) && !*found)
+     {
+         nChunk = PHY_RXBUF - port->rxHead;  // bytes before the end of the ring
+         if (nChunk > nBytesToGet - nBytesGot) nChunk = nBytesToGet - nBytesGot;
+         end = memchr(port->rxRing + port->rxHead, marker, nChunk);
+         if (end != NULL)  // stop after the marker
+         {
+             nChunk = (int)(end - (port->rxRing + port->rxHead)) + 1;
+             *found = 1;
+         }
+         memcpy(dataRx + nBytesGot, port->rxRing + port->rxHead, nChunk);
+         nBytesGot += nChunk;
+         port->rxHead = (port->rxHead + nChunk) % PHY_RXBUF;
+         port->rxCount -= nChunk;
+     }
+
+    return nBytesGot; // if no problem, return the number of bytes received
+}
+
+//===================================================================
+/* PHY_skipTo function, to discard received bytes up to a marker byte.
+   Arguments: port is the port handle, from PHY_open;
+              marker is the byte value to look for;
+              nSkipped is a pointer to a counter of bytes discarded.
+   Searches the ring buffer for the marker, filling it with one read if it
+   is empty.  Bytes before the marker are discarded, and added to the
+   counter.  The marker itself is left in place, to be taken by PHY_get.
+   Returns 1 if the marker is next in the ring, 0 if it was not found in
+   the bytes received so far, or negative value on failure.  */
+int PHY_skipTo(PHY_port *port, byte_t marker, int *nSkipped)
 {
-     int nBytesGot;      // integer version of above
-     int threshold = 0;  // threshold for error simulation
-     int i;             // for use in loop
+     int nChunk;     // bytes to search before the ring wraps around
+     byte_t *found;  // pointer to marker byte, if found
+     int retVal;     // return value from fillRing
+
+     if (port->rxCount == 0)  // nothing waiting - try to get some more
+     {
+         retVal = fillRing(port);
+         if (retVal <= 0) return retVal;  // timeout (0) or failure
+     }
+
+     while (port->rxCount > 0)  // search the ring, in up to two pieces
+     {
+         nChunk = PHY_RXBUF - port->rxHead;  // bytes before the end of the ring
+         if (nChunk > port->rxCount) nChunk = port->rxCount;
+         found = memchr(port->rxRing + port->rxHead, marker, nChunk);
+         if (found != NULL) nChunk = (int)(found - (port->rxRing + port->rxHead));
+         *nSkipped += nChunk;  // discard bytes before the marker
+         port->rxHead = (port->rxHead + nChunk) % PHY_RXBUF;
+         port->rxCount -= nChunk;
+         if (found != NULL) return 1;  // marker is now next in the ring
+     }
+     return 0;  // not found yet
+}
+
+//===================================================================
+/* PHY_setDeadline function, to set a time limit for receiving.
+   Arguments: port handle, from PHY_open; time in ms on the monotonic
+   clock, as given by PHY_timeMs, or 0 to wait for the port timeout instead.
+   The deadline applies to every later call of PHY_get and PHY_skipTo
+   on this port, until it is changed.  */
+void PHY_setDeadline(PHY_port *port, long deadlineMs)
+{
+    port->rxDeadline = deadlineMs;
+}
+
+//===================================================================
+/* PHY_timeMs function, to read the monotonic clock used for deadlines.
+   This clock is not affected by changes to the time of day.
+   Returns the time in ms from some fixed point in the past.  */
+long PHY_timeMs(void)
+{
+    struct timespec now;  // seconds and nanoseconds
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long) now.tv_sec * 1000L + (long) (now.tv_nsec / 1000000L);
+}
+
+//===================================================================
+/* Function to fill the ring buffer from the port, with one get.
+   Takes as many bytes as there is room for (up to the end of the ring,
+   if it wraps around), waiting no later than the deadline.
+   Simulated bit errors are added to the new bytes here.
+   Returns number of bytes added, 0 on timeout, or negative on failure.  */
+static int fillRing(PHY_port *port)
+{
+     int tail = (port->rxHead + port->rxCount) % PHY_RXBUF;  // where new bytes go
+     int nSpace;        // room in the ring, before it wraps around
+     int nBytesGot;     // number of bytes got
      int flip;          // bit to change in simulating error
      byte_t pattern;    // bit pattern to cause error
 
-     //NB: FIX CHECK
-
-     // First check if the port is open
-     /*    if (serial == INVALID_HANDLE_VALUE)
+     if (port == NULL)
+     {
+         printf("PHY: Port not open\n");
+         return -9;
+     }
+     if (port->rxCount == PHY_RXBUF) return 0;  // full - nothing can be added
+     nSpace = (tail >= port->rxHead) ? PHY_RXBUF - tail : port->rxHead - tail;
+
+     nBytesGot = port->backend->get(port, port->rxRing + tail, nSpace);
+     if (nBytesGot <= 0) return nBytesGot;  // timeout (0) or failure
+
+    // Add bit errors, with the probability specified.  Rather than calling
+    // erand48() for every byte, the gap to the next error is worked out in
+    // advance, so the cost is only paid when an error actually happens.
+    if (port->rxProbErr != 0.0)
     {
-        printf("PHY: Port not valid\n");
-        return -9;  // negative return value indicates failure
+        while (port->bytesToError < nBytesGot)
+        {
+            flip = (int) (8.0 * erand48(port->errSeed));  // 0 to 7
+            pattern = (byte_t) (1 << flip); // bit pattern: single 1 in random place
+            port->rxRing[tail + port->bytesToError] ^= pattern;  // invert one bit
+            LOG_DEBUG("PHY_get:  ####  Simulated bit error...  ####\n");
+            port->bytesToError += 1 + errorGap(port);  // skip ahead to the next error
+        }
+        port->bytesToError -= nBytesGot;  // count down over the bytes received
     }
 
-     */
+    port->rxCount += nBytesGot;
+    return nBytesGot; // if no problem, return the number of bytes received
+}
 
-     nBytesGot = read(serial_port, dataRx, nBytesToGet);
+//===================================================================
+/* Function to get bytes from a port that has a file descriptor.
+   Waits with poll() until bytes arrive or the deadline passes, so the
+   read never blocks.  With no deadline, waits up to the port timeout.
+   Returns number of bytes got, 0 on timeout, or negative on failure.  */
+static int fdGet(PHY_port *port, byte_t *dataRx, int nBytesToGet)
+{
+     int nBytesGot;     // number of bytes read
+     int retVal;        // return value from poll
+     struct pollfd pfd; // port to wait for, with poll()
+     long waitMs;       // time left before the deadline, in ms
+
+     if (port->fd < 0)  // closed after an earlier problem
+     {
+         printf("PHY: Port closed after a problem\n");
+         return -4;
+     }
+     pfd.fd = port->fd;
+     pfd.events = POLLIN;
+     do
+     {
+         waitMs = port->portWaitMs;
+         if (port->rxDeadline != 0)  // wait for bytes, but only until the deadline
+         {
+             waitMs = port->rxDeadline - PHY_timeMs();
+             if (waitMs < 0) waitMs = 0;
+         }
+         retVal = poll(&pfd, 1, (int) waitMs);
+     }
+     while ((retVal < 0) && (errno == EINTR));  // interrupted - try again
+     if (retVal < 0)
+     {
+         printf("PHY: Problem waiting for data\n");
+         printf("Error %i from function: %s\n", errno, strerror(errno));
+         return -4;
+     }
+     if (retVal == 0) return 0;  // time is up, nothing arrived
+
+     nBytesGot = read(port->fd, dataRx, nBytesToGet);
      //LEGACY: !ReadFile(serial, dataRx, nBytesToGet, &nBytesRx, NULL )
-     
+
     // Try to get bytes as requested
     if (nBytesGot == -1)
     {
         printf("PHY: Problem receiving data\n");
         printf("Error %i from function: %s\n", errno, strerror(errno));
-        close(serial_port);
+        close(port->fd);
+        port->fd = -1;  // so it is not closed again
         return -4;
     }
+    return nBytesGot;
+}
 
-    // Add a bit error, with the probability specified
-    if (rxProbErr != 0.0)
+//===================================================================
+/* Function to get bytes from the loop port - the bytes sent to it.
+   If there are none, nothing else can send any, so it just waits for
+   the deadline (if there is one) and returns.
+   Returns number of bytes got, 0 if there are none.  */
+static int loopGet(PHY_port *port, byte_t *dataRx, int nBytesToGet)
+{
+    long waitMs;  // time left before the deadline, in ms
+
+    if (port->loopCount == 0)
     {
-        // set threshold as fraction of max, scaling for 8 bit bytes
-        threshold = 1 + (int)(8.0 * (double)RAND_MAX * rxProbErr);
-        for (i = 0; i < nBytesGot; i++)
-        {
-            if (rand() < threshold)  // we want to cause an error
-            {
-                flip = rand() % 8;  // random integer 0 to 7
-                pattern = (byte_t) (1 << flip); // bit pattern: single 1 in random place
-                dataRx[i] ^= pattern;  // invert one bit
-                printf("PHY_get:  ####  Simulated bit error...  ####\n");
-            }
-        }
+        waitMs = (port->rxDeadline != 0) ? port->rxDeadline - PHY_timeMs() : 0;
+        if (waitMs > 0) usleep((useconds_t) (1000 * waitMs));
+        return 0;
     }
+    if (nBytesToGet > port->loopCount) nBytesToGet = port->loopCount;
+    memcpy(dataRx, port->loopBuf, nBytesToGet);
+    port->loopCount -= nBytesToGet;
+    memmove(port->loopBuf, port->loopBuf + nBytesToGet, port->loopCount);
+    return nBytesToGet;
+}
 
-    return nBytesGot; // if no problem, return the number of bytes received
+//===================================================================
+/* Function to choose the number of error-free bytes before the next
+   simulated error.  Each byte has probability 8*rxProbErr of an error
+   (as one bit is changed), so the gap has a geometric distribution,
+   starting from 0: the very next byte has the error.
+   Returns the gap, 0 or more bytes.  */
+static long errorGap(PHY_port *port)
+{
+    double probByte = 8.0 * port->rxProbErr;  // probability of error in a byte
+    double u;    // uniform random number, 0 < u < 1
+
+    if (probByte <= 0.0) return 0;      // no errors - not used
+    if (probByte >= 1.0) return 0;      // every byte has an error
+    u = 1.0 - erand48(port->errSeed);  // erand48 gives 0 <= x < 1
+    return (long) (log(u) / log(1.0 - probByte));  // rounded down
 }
 
 // Function to print informative messages when something goes wrong...
@@ -11,20 +11,40 @@ typedef unsigned char byte_t;  // define type "byte_t" for simplicity
 #ifndef PHYSICAL_H_INCLUDED
 #define PHYSICAL_H_INCLUDED
 
-/*  Physical Layer functions using serial port.
+#define PHY_RXBUF 16384  // size of receive ring buffer, in bytes - room
+                         // for the longest link layer frame, stuffed
+
+// Handle for an open port - what is in it is private to physical.c
+typedef struct PHY_port PHY_port;
+
+/*  Physical Layer functions using serial port, or a simulated one.
        PHY_open        opens and configures the port
+       PHY_makePair    makes a pair of connected ports, for testing
        PHY_close       closes the port
        PHY_send        sends bytes
        PHY_receive     gets received bytes
+       PHY_getTo       gets received bytes up to a marker
+       PHY_skipTo      discards received bytes up to a marker
+       PHY_setDeadline sets a time limit for receiving
+    PHY_open gives a handle for the port, which the other functions take,
+    so a program can have several ports open at once.
     All functions print explanatory messages if there is
     a problem, and return values to indicate failure. */
 
-/* PHY_open function - to open and configure the serial port.
-   Arguments are port number, bit rate, number of data bits, parity,
+/* PHY_open function - to open and configure the port.
+   Arguments are a pointer to the port handle, which is set if the port
+   opens, then port name, bit rate, number of data bits, parity,
    receive timeout constant, rx timeout interval, rx probability of error.
-   See comments in function for more details of timeouts.
+   The port name chooses the kind of port:
+       "loop"          in memory: bytes sent come back to the same end
+       "mem0", "mem1"  the two ends of a socket pair, at memory speed
+       "pty0", "pty1"  the master and slave ends of a pseudo-terminal
+       anything else   a serial port, /dev/<name>
+   A ":rate" suffix, e.g. "mem0:9600", paces sending on the simulated
+   ports to that bit rate.  See comments in function for more details.
    Returns zero if it succeeds - anything non-zero is a problem.*/
-int PHY_open(const char *portName,       // port number: e.g. 1 for COM1, 5 for COM5
+int PHY_open(PHY_port **port,   // handle for the port, once open
+             const char *portName,       // port number: e.g. 1 for COM1, 5 for COM5
              int bitRate,       // bit rate: e.g. 1200, 4800, etc.
              int nDataBits,     // number of data bits: 7 or 8
              int parity,        // parity: 0 = none, 1 = odd, 2 = even
@@ -32,21 +52,60 @@ int PHY_open(const char *portName,       // port number: e.g. 1 for COM1, 5 for
              int rxTimeIntv,    // rx timeout interval in ms: 0 waits forever
              double probErr);   // rx probability of error: 0.0 for none
 
-/* PHY_close function, to close the serial port.
-   Takes no arguments, returns 0 always.  */
-int PHY_close(void);
+/* PHY_makePair function - to make a pair of connected ports.
+   Argument is a port name starting "mem" or "pty".  A program that
+   forks, to run both ends of a link, must make the pair before fork(),
+   then open end 0 in one process and end 1 in the other.
+   Returns zero if it succeeds - anything non-zero is a problem.*/
+int PHY_makePair(const char *portName);
+
+/* PHY_close function, to close the port.
+   Argument: port handle, which cannot be used after this.
+   Returns 0 always.  */
+int PHY_close(PHY_port *port);
 
 /* PHY_send function, to send bytes.
-   Arguments: pointer to array holding bytes to be sent;
+   Arguments: port handle;
+              pointer to array holding bytes to be sent;
               number of bytes to send.
    Returns number of bytes sent, or negative value on failure.  */
-int PHY_send(byte_t *dataTx, int nBytesToSend);
+int PHY_send(PHY_port *port, byte_t *dataTx, int nBytesToSend);
 
 /* PHY_get function, to get received bytes.
-   Arguments: pointer to array to hold received bytes;
+   Arguments: port handle;
+              pointer to array to hold received bytes;
               maximum number of bytes to get.
    Returns number of bytes actually got, or negative value on failure. */
-int PHY_get(byte_t *dataRx, int nBytesToGet);
+int PHY_get(PHY_port *port, byte_t *dataRx, int nBytesToGet);
+
+/* PHY_getTo function, to get received bytes up to a marker byte.
+   Arguments: port handle;
+              pointer to array to hold received bytes;
+              maximum number of bytes to get;
+              byte value to stop at;
+              pointer to flag, set to 1 if the marker was got, else 0.
+   Returns number of bytes actually got, or negative value on failure. */
+int PHY_getTo(PHY_port *port, byte_t *dataRx, int nBytesToGet,
+              byte_t marker, int *found);
+
+/* PHY_setDeadline function, to set a time limit for receiving.
+   Arguments: port handle;
+              time in ms on the monotonic clock (see PHY_timeMs) after
+              which PHY_get and PHY_skipTo stop waiting for bytes,
+              or 0 to wait for the port timeout instead.  */
+void PHY_setDeadline(PHY_port *port, long deadlineMs);
+
+/* PHY_timeMs function, to read the monotonic clock used for deadlines.
+   Returns the time in ms from some fixed point in the past. */
+long PHY_timeMs(void);
+
+/* PHY_skipTo function, to discard received bytes up to a marker byte.
+   Arguments: port handle;
+              byte value to look for;
+              pointer to counter of bytes discarded.
+   Returns 1 if the marker is the next byte to get, 0 if not found yet,
+   or negative value on failure. */
+int PHY_skipTo(PHY_port *port, byte_t marker, int *nSkipped);
 
 /* Function to print informative messages
    when something goes wrong...  */
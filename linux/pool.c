@@ -0,0 +1,84 @@
+/*  Frame buffer pool functions, so a link can hold many frames at once.
+       POOL_init    makes a pool of buffers, all the same size
+       POOL_free    frees a pool, and all its buffers
+       POOL_get     takes a buffer from a pool
+       POOL_put     gives a buffer back to its pool
+    All the buffers are in one block of memory, aligned to a cache line.
+    The free list is a stack of pointers: POOL_get pops the top one and
+    POOL_put pushes it back, so the buffer used most recently is used
+    again first, while it is still in the cache.  */
+
+#include <stdlib.h>  // for posix_memalign, malloc, free
+#include "pool.h"    // header file for functions in this file
+
+//===================================================================
+/* Function to make a pool of buffers, all free.
+   Arguments: pool is a pointer to the pool,
+              nBufs is the number of buffers,
+              bufSize is the most bytes needed in each buffer.
+   Returns 0 for success, or -1 if there is no memory for it. */
+int POOL_init(framePool *pool, int nBufs, int bufSize)
+{
+    void *memory;  // the block of memory for the buffers
+    int i;         // for use in loop
+
+    pool->memory = NULL;
+    pool->freeList = NULL;
+    pool->nFree = 0;
+    pool->nBufs = 0;
+    if (nBufs < 1) nBufs = 1;
+
+    // Round the size up to a whole number of cache lines
+    pool->bufSize = (bufSize + POOL_ALIGN - 1) / POOL_ALIGN * POOL_ALIGN;
+
+    if (posix_memalign(&memory, POOL_ALIGN, (size_t) nBufs * pool->bufSize))
+        return -1;
+    pool->freeList = malloc(nBufs * sizeof(byte_t *));
+    if (pool->freeList == NULL)
+    {
+        free(memory);
+        return -1;
+    }
+    pool->memory = memory;
+    pool->nBufs = nBufs;
+
+    // All the buffers start on the stack, the first one on top
+    for (i = 0; i < nBufs; i++)
+        pool->freeList[i] = pool->memory + (size_t) (nBufs - 1 - i) * pool->bufSize;
+    pool->nFree = nBufs;
+    return 0;
+}
+
+
+//===================================================================
+/* Function to free a pool, and all its buffers.
+   Safe to call on a pool that is empty, or has been freed already. */
+void POOL_free(framePool *pool)
+{
+    free(pool->memory);
+    free(pool->freeList);
+    pool->memory = NULL;
+    pool->freeList = NULL;
+    pool->nFree = 0;
+    pool->nBufs = 0;
+}
+
+
+//===================================================================
+/* Function to take a free buffer from a pool.
+   Returns a pointer to the buffer, or NULL if none is free. */
+byte_t *POOL_get(framePool *pool)
+{
+    if (pool->nFree == 0) return NULL;
+    return pool->freeList[--pool->nFree];  // pop the top of the stack
+}
+
+
+//===================================================================
+/* Function to give a buffer back to the pool it came from.
+   A NULL pointer is ignored. */
+void POOL_put(framePool *pool, byte_t *buffer)
+{
+    if ((buffer == NULL) || (pool->nFree >= pool->nBufs)) return;
+    pool->freeList[pool->nFree++] = buffer;  // push it on the stack
+}
@@ -0,0 +1,56 @@
+/* Define a type called byte_t, if not already defined.
+   This is an 8-bit variable, able to hold integers from 0 to 255.
+   It could be named "byte", but this conflicts with a definition in
+   windows.h, which is needed for the real physical layer functions. */
+#ifndef BYTE_T_DEFINED
+#define BYTE_T_DEFINED
+typedef unsigned char byte_t;  // define type "byte_t" for simplicity
+#endif
+
+
+#ifndef POOL_H_INCLUDED
+#define POOL_H_INCLUDED
+
+/*  Frame buffer pool functions, so a link can hold many frames at once.
+       POOL_init    makes a pool of buffers, all the same size
+       POOL_free    frees a pool, and all its buffers
+       POOL_get     takes a buffer from a pool
+       POOL_put     gives a buffer back to its pool
+    The buffers are made in one block, when the link is connected, so no
+    memory is allocated while frames are being sent and received.  The
+    free buffers are kept on a stack, so taking one and giving it back
+    each take the same time, however many there are.  Each buffer starts
+    on a cache line, and is a whole number of cache lines long, so two
+    buffers never share a line. */
+
+#define POOL_ALIGN 64   // bytes in a cache line
+
+// A pool of buffers
+typedef struct
+{
+    byte_t *memory;     // all the buffers, one after another
+    byte_t **freeList;  // stack of free buffers
+    int nFree;          // number of buffers on the stack
+    int nBufs;          // number of buffers in the pool
+    int bufSize;        // bytes in each buffer
+} framePool;
+
+/* POOL_init function - makes a pool of buffers.
+   Arguments: pointer to the pool; number of buffers; most bytes needed in
+              each buffer, which is rounded up to a whole number of lines.
+   Returns 0 for success, or -1 if there is no memory for it. */
+int POOL_init(framePool *pool, int nBufs, int bufSize);
+
+/* POOL_free function - frees a pool, and all its buffers.
+   Safe to call on a pool that is empty, or has been freed already. */
+void POOL_free(framePool *pool);
+
+/* POOL_get function - takes a free buffer from a pool.
+   Returns a pointer to the buffer, or NULL if none is free. */
+byte_t *POOL_get(framePool *pool);
+
+/* POOL_put function - gives a buffer back to the pool it came from.
+   A NULL pointer is ignored. */
+void POOL_put(framePool *pool, byte_t *buffer);
+
+#endif // POOL_H_INCLUDED
@@ -0,0 +1,230 @@
+/*  Reed-Solomon code functions, used for forward error correction.
+       RS_init      builds the tables
+       RS_encode    works out the parity bytes for a block
+       RS_decode    finds and corrects errors in a block and its parity
+    Each byte is an element of the field GF(256), built from the
+    polynomial x^8 + x^4 + x^3 + x^2 + 1 (0x11D), with alpha = 2.
+    Multiplication uses tables of logs and powers of alpha.  A block of
+    bytes is treated as a polynomial, first byte highest power, and the
+    parity bytes are the remainder after dividing it by the generator
+    polynomial, which has roots alpha^0 to alpha^(n-1) for n parity bytes.
+    So a good block followed by its parity is zero at each of those roots.
+    The decoder works out the value at each root (the syndromes), finds
+    the error locator polynomial with the Berlekamp-Massey algorithm,
+    finds the damaged positions from its roots with a Chien search, and
+    works out the error values with the Forney algorithm.  */
+
+#include <string.h>   // for memset, memmove, memcpy
+#include <pthread.h>  // for pthread_once, so threads can share the tables
+#include "rs.h"       // header file for functions in this file
+
+#define RS_POLY 0x11D   // field polynomial, with the x^8 term
+
+/* Tables for arithmetic in GF(256).  rsExp is twice as long as needed,
+   so the sum of two logs can be looked up without taking it mod 255.  */
+static byte_t rsExp[512];    // alpha to the power i
+static int rsLog[256];       // log to base alpha - rsLog[0] is not used
+static byte_t rsGen[RS_MAX_PARITY+1][RS_MAX_PARITY+1];  // generator
+                             // polynomial for each number of parity bytes,
+                             // highest power first, so rsGen[n][0] is 1
+static pthread_once_t initOnce = PTHREAD_ONCE_INIT;  // tables are built once
+
+// Function to multiply two elements of the field
+static byte_t gfMul(byte_t a, byte_t b)
+{
+    if ((a == 0) || (b == 0)) return 0;
+    return rsExp[rsLog[a] + rsLog[b]];
+}
+
+// Function to divide one element of the field by another, not zero
+static byte_t gfDiv(byte_t a, byte_t b)
+{
+    if (a == 0) return 0;
+    return rsExp[rsLog[a] + 255 - rsLog[b]];
+}
+
+//===================================================================
+/* Function to build the tables, run only once, by RS_init.  */
+static void buildTables(void)
+{
+    int i, k;      // for use in loops
+    int x = 1;     // power of alpha being worked out
+
+    for (i = 0; i < 255; i++)
+    {
+        rsExp[i] = (byte_t) x;
+        rsExp[i + 255] = (byte_t) x;
+        rsLog[x] = i;
+        x <<= 1;                  // multiply by alpha
+        if (x & 0x100) x ^= RS_POLY;
+    }
+    rsExp[510] = rsExp[0];
+    rsExp[511] = rsExp[1];
+
+    // Each generator is the one before, times (x + alpha^i)
+    memset(rsGen, 0, sizeof(rsGen));
+    rsGen[0][0] = 1;
+    for (i = 0; i < RS_MAX_PARITY; i++)
+    {
+        rsGen[i+1][0] = 1;
+        for (k = 1; k <= i; k++)
+            rsGen[i+1][k] = rsGen[i][k] ^ gfMul(rsGen[i][k-1], rsExp[i]);
+        rsGen[i+1][i+1] = gfMul(rsGen[i][i], rsExp[i]);
+    }
+}
+
+//===================================================================
+/* RS_init function - builds the tables.
+   Safe to call more than once, and from several threads at once: the
+   first call does the work, and any others wait until it is done.  */
+void RS_init(void)
+{
+    pthread_once(&initOnce, buildTables);
+}
+
+//===================================================================
+/* RS_encode function - works out the parity bytes for a block.
+   This is long division by the generator, a byte at a time: the parity
+   array holds the remainder so far, highest power first.  */
+void RS_encode(const byte_t *data, int nData, byte_t *parity, int nParity)
+{
+    const byte_t *gen;   // generator polynomial for this many parity bytes
+    byte_t feedback;     // next byte of the quotient
+    int logFb;           // log of that byte
+    int i, j;            // for use in loops
+
+    RS_init();
+    if ((nParity <= 0) || (nParity > RS_MAX_PARITY)) return;
+    gen = rsGen[nParity];
+    memset(parity, 0, nParity);
+
+    for (i = 0; i < nData; i++)
+    {
+        feedback = data[i] ^ parity[0];
+        memmove(parity, parity + 1, nParity - 1);
+        parity[nParity-1] = 0;
+        if (feedback == 0) continue;  // nothing to subtract
+        logFb = rsLog[feedback];
+        for (j = 0; j < nParity; j++)
+        {
+            if (gen[j+1] != 0) parity[j] ^= rsExp[logFb + rsLog[gen[j+1]]];
+        }
+    }
+}
+
+//===================================================================
+/* RS_decode function - corrects errors in a block and its parity.
+   Returns the number of bytes corrected, 0 if there were no errors,
+   or -1 if there were too many errors to correct.  */
+int RS_decode(byte_t *block, int nBytes, int nParity)
+{
+    byte_t synd[RS_MAX_PARITY];        // syndromes: block value at each root
+    byte_t lambda[RS_MAX_PARITY+1];    // error locator, lowest power first
+    byte_t prev[RS_MAX_PARITY+1];      // locator before the last change
+    byte_t temp[RS_MAX_PARITY+1];      // copy of locator while it changes
+    byte_t omega[RS_MAX_PARITY];       // error evaluator, lowest power first
+    int errPos[RS_MAX_PARITY/2];       // power of x at each damaged byte
+    int nErr = 0;        // number of damaged bytes found
+    int nLoc = 0;        // degree of the error locator
+    int shift = 1;       // steps since the locator was last lengthened
+    byte_t lastDisc = 1; // discrepancy when it was last lengthened
+    byte_t disc;         // discrepancy: how far the locator is out
+    byte_t s, num, den;  // values being worked out
+    int anyError = 0;    // TRUE if any syndrome is not zero
+    int i, j, k;         // for use in loops
+
+    RS_init();
+    if ((nParity <= 0) || (nParity > RS_MAX_PARITY) || (nBytes > RS_MAX_BLOCK)
+        || (nBytes <= nParity)) return -1;
+
+    // Syndromes - the block is a polynomial, first byte highest power,
+    // so Horner's rule works through it in order
+    for (i = 0; i < nParity; i++)
+    {
+        s = 0;
+        for (j = 0; j < nBytes; j++)
+        {
+            s = (s == 0) ? block[j] : rsExp[rsLog[s] + i] ^ block[j];
+        }
+        synd[i] = s;
+        if (s != 0) anyError = 1;
+    }
+    if (!anyError) return 0;  // nothing to correct
+
+    // Berlekamp-Massey: find the shortest locator that gives the syndromes
+    memset(lambda, 0, sizeof(lambda));
+    memset(prev, 0, sizeof(prev));
+    lambda[0] = 1;
+    prev[0] = 1;
+    for (i = 0; i < nParity; i++)
+    {
+        disc = synd[i];
+        for (j = 1; j <= nLoc; j++) disc ^= gfMul(lambda[j], synd[i-j]);
+        if (disc == 0)
+        {
+            shift++;
+            continue;
+        }
+        memcpy(temp, lambda, sizeof(lambda));
+        for (j = 0; j + shift <= nParity; j++)
+            lambda[j+shift] ^= gfMul(gfDiv(disc, lastDisc), prev[j]);
+        if (2 * nLoc <= i)  // the locator must get longer
+        {
+            nLoc = i + 1 - nLoc;
+            memcpy(prev, temp, sizeof(prev));
+            lastDisc = disc;
+            shift = 1;
+        }
+        else shift++;
+    }
+    if (nLoc > nParity / 2) return -1;  // too many errors
+
+    // Chien search: byte j of the block is the power k = nBytes-1-j of x,
+    // and is damaged if the locator is zero at alpha^(-k)
+    for (j = 0; j < nBytes; j++)
+    {
+        k = nBytes - 1 - j;
+        s = lambda[0];
+        for (i = 1; i <= nLoc; i++)
+        {
+            if (lambda[i] != 0)
+                s ^= rsExp[(rsLog[lambda[i]] + (255 - k) * i) % 255];
+        }
+        if (s == 0)
+        {
+            if (nErr == nLoc) return -1;  // more roots than the degree
+            errPos[nErr++] = k;
+        }
+    }
+    if (nErr != nLoc) return -1;  // some errors are outside the block
+
+    // Error evaluator: syndromes times locator, up to the power nParity-1
+    for (i = 0; i < nParity; i++)
+    {
+        omega[i] = 0;
+        for (j = 0; (j <= i) && (j <= nLoc); j++)
+            omega[i] ^= gfMul(lambda[j], synd[i-j]);
+    }
+
+    // Forney: the error at x^k is alpha^k * omega(X) / lambda'(X),
+    // with X = alpha^(-k).  The derivative only has the odd powers.
+    for (i = 0; i < nErr; i++)
+    {
+        k = errPos[i];
+        num = 0;
+        for (j = 0; j < nParity; j++)
+        {
+            if (omega[j] != 0)
+                num ^= rsExp[(rsLog[omega[j]] + (255 - k) * j) % 255];
+        }
+        den = 0;
+        for (j = 1; j <= nLoc; j += 2)
+        {
+            if (lambda[j] != 0)
+                den ^= rsExp[(rsLog[lambda[j]] + (255 - k) * (j - 1)) % 255];
+        }
+        if (den == 0) return -1;  // cannot happen for a real error
+        block[nBytes-1-k] ^= gfMul(rsExp[k], gfDiv(num, den));
+    }
+    return nErr;
+}
@@ -0,0 +1,47 @@
+/* Define a type called byte_t, if not already defined.
+   This is an 8-bit variable, able to hold integers from 0 to 255.
+   It could be named "byte", but this conflicts with a definition in
+   windows.h, which is needed for the real physical layer functions. */
+#ifndef BYTE_T_DEFINED
+#define BYTE_T_DEFINED
+typedef unsigned char byte_t;  // define type "byte_t" for simplicity
+#endif
+
+
+#ifndef RS_H_INCLUDED
+#define RS_H_INCLUDED
+
+/*  Reed-Solomon code functions, used for forward error correction.
+       RS_init      builds the tables
+       RS_encode    works out the parity bytes for a block of bytes
+       RS_decode    finds and corrects errors in a block and its parity
+    The code works on bytes, in the field GF(256) with polynomial 0x11D.
+    With n parity bytes, up to n/2 damaged bytes can be corrected,
+    wherever they are in the block.  The block and its parity together
+    can be up to RS_MAX_BLOCK bytes long.  */
+
+#define RS_MAX_PARITY 32   // most parity bytes allowed
+#define RS_MAX_BLOCK 255   // most bytes in a block, including parity
+
+/* RS_init function - builds the tables.
+   Safe to call more than once, from any thread.  The other functions
+   call it if needed. */
+void RS_init(void);
+
+/* RS_encode function - works out the parity bytes for a block.
+   Arguments: pointer to the bytes; number of bytes;
+              pointer to an array to hold the parity bytes;
+              number of parity bytes, an even number up to RS_MAX_PARITY.
+   The parity goes after the block, so the block must be no longer than
+   RS_MAX_BLOCK less the number of parity bytes. */
+void RS_encode(const byte_t *data, int nData, byte_t *parity, int nParity);
+
+/* RS_decode function - corrects errors in a block and its parity.
+   Arguments: pointer to the block, followed by its parity bytes, which
+              is corrected in place; total number of bytes, including
+              the parity; number of parity bytes.
+   Returns the number of bytes corrected, 0 if there were no errors,
+   or -1 if there were too many errors to correct. */
+int RS_decode(byte_t *block, int nBytes, int nParity);
+
+#endif // RS_H_INCLUDED
@@ -0,0 +1,231 @@
+/*  Byte stuffing functions, so the frame markers never appear inside a frame.
+       STUFF_setKernel  selects a kernel, for testing
+       STUFF_special    checks if a byte is a special byte
+       STUFF_find       finds the first special byte in a block
+       STUFF_encode     adds stuffing to a block of bytes
+       STUFF_decode     removes stuffing from a block of bytes
+    Special bytes are rare in most data, so the work is mainly finding
+    them.  The SSE2 and AVX2 kernels compare 16 or 32 bytes at a time with
+    each of the three special values, and the bytes in between are copied
+    with memcpy or memmove.  The scalar kernel checks one byte at a time,
+    in the same way as STUFF_special.  All kernels give the same results.
+    Only the marker byte values are taken from the link layer, so this
+    file can be linked, and tested, on its own.  */
+
+#include <string.h>     // for memcpy, memmove
+#include <pthread.h>    // for pthread_once, to choose the kernel once
+#include "linklayer.h"  // for the marker byte values
+#include "stuffing.h"   // header file for functions in this file
+
+// The vector kernels need x86 and a compiler that can target them
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define STUFF_HAVE_X86 1
+#include <immintrin.h>   // SSE2 and AVX2 intrinsics
+#else
+#define STUFF_HAVE_X86 0
+#endif
+
+static pthread_once_t initOnce = PTHREAD_ONCE_INIT;  // kernel is chosen once
+static int bestKernel = STUFF_SCALAR;  // fastest kernel on this processor
+static int kernel = STUFF_SCALAR;      // kernel in use
+
+//===================================================================
+/* Function to choose the fastest kernel this processor can use, run
+   only once, by stuffInit.  */
+static void chooseKernel(void)
+{
+#if STUFF_HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) bestKernel = STUFF_AVX2;
+    else if (__builtin_cpu_supports("sse2")) bestKernel = STUFF_SSE2;
+#endif
+    kernel = bestKernel;
+}
+
+//===================================================================
+/* Function to choose the kernel, if it has not been chosen yet.
+   Safe to call more than once, and from several threads at once.  */
+static void stuffInit(void)
+{
+    pthread_once(&initOnce, chooseKernel);
+}
+
+//===================================================================
+/* Function to check if a byte is one of the three special bytes.
+   Returns TRUE if it is, FALSE if not.  */
+static inline int isSpecial(byte_t b)
+{
+    return (b == STARTBYTE) || (b == ENDBYTE) || (b == ESCBYTE);
+}
+
+//===================================================================
+/* STUFF_special function - checks if a byte is a special byte, one
+   that must be escaped inside a frame.
+   Returns TRUE if it is, FALSE if not.  */
+int STUFF_special(byte_t b)
+{
+    return isSpecial(b);
+}
+
+//===================================================================
+/* STUFF_setKernel function - selects the kernel to use, for testing.
+   If the kernel asked for is not available, the best one that is
+   available is used instead.
+   Returns the kernel that will be used.  */
+int STUFF_setKernel(int newKernel)
+{
+    stuffInit();
+    if ((newKernel < STUFF_SCALAR) || (newKernel > bestKernel))
+        newKernel = bestKernel;
+    kernel = newKernel;
+    return kernel;
+}
+
+//===================================================================
+/* Scalar kernel - checks one byte at a time.
+   Returns the position of the first special byte, or nBytes.  */
+static int findScalar(const byte_t *data, int nBytes)
+{
+    int i;  // position in block
+
+    for (i = 0; i < nBytes; i++)
+    {
+        if (isSpecial(data[i])) break;
+    }
+    return i;
+}
+
+#if STUFF_HAVE_X86
+//===================================================================
+/* SSE2 kernel - compares 16 bytes at a time with each special value,
+   and turns the results into a bit mask, one bit per byte.
+   Compiled for SSE2 even if the rest of the program is not, and only
+   called if the processor supports it.  */
+__attribute__((target("sse2")))
+static int findSSE2(const byte_t *data, int nBytes)
+{
+    __m128i start = _mm_set1_epi8((char) STARTBYTE);
+    __m128i end = _mm_set1_epi8((char) ENDBYTE);
+    __m128i esc = _mm_set1_epi8((char) ESCBYTE);
+    __m128i block, hits;  // 16 bytes, and which of them are special
+    int mask;             // one bit for each special byte
+    int i = 0;            // position in block
+
+    while (i + 16 <= nBytes)
+    {
+        block = _mm_loadu_si128((const __m128i *) (data + i));
+        hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, start),
+                                         _mm_cmpeq_epi8(block, end)),
+                            _mm_cmpeq_epi8(block, esc));
+        mask = _mm_movemask_epi8(hits);
+        if (mask != 0) return i + __builtin_ctz(mask);
+        i += 16;
+    }
+    return i + findScalar(data + i, nBytes - i);  // last few bytes
+}
+
+//===================================================================
+/* AVX2 kernel - as the SSE2 kernel, but 32 bytes at a time.  */
+__attribute__((target("avx2")))
+static int findAVX2(const byte_t *data, int nBytes)
+{
+    __m256i start = _mm256_set1_epi8((char) STARTBYTE);
+    __m256i end = _mm256_set1_epi8((char) ENDBYTE);
+    __m256i esc = _mm256_set1_epi8((char) ESCBYTE);
+    __m256i block, hits;  // 32 bytes, and which of them are special
+    unsigned int mask;    // one bit for each special byte
+    int i = 0;            // position in block
+
+    while (i + 32 <= nBytes)
+    {
+        block = _mm256_loadu_si256((const __m256i *) (data + i));
+        hits = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(block, start),
+                                               _mm256_cmpeq_epi8(block, end)),
+                               _mm256_cmpeq_epi8(block, esc));
+        mask = (unsigned int) _mm256_movemask_epi8(hits);
+        if (mask != 0) return i + __builtin_ctz(mask);
+        i += 32;
+    }
+    return i + findSSE2(data + i, nBytes - i);  // last few bytes
+}
+#endif
+
+//===================================================================
+/* STUFF_find function - finds the first special byte in a block of bytes.
+   Returns the position of the first special byte,
+   or the number of bytes if there is none.  */
+int STUFF_find(const byte_t *data, int nBytes)
+{
+    stuffInit();
+#if STUFF_HAVE_X86
+    if (kernel == STUFF_AVX2) return findAVX2(data, nBytes);
+    if (kernel == STUFF_SSE2) return findSSE2(data, nBytes);
+#endif
+    return findScalar(data, nBytes);
+}
+
+//===================================================================
+/* STUFF_encode function - adds stuffing to a block of bytes.
+   Copies runs of ordinary bytes, and replaces each special byte with
+   the escape byte and the changed special byte.
+   Returns the number of bytes in the result.  */
+int STUFF_encode(const byte_t *dataIn, int nBytes, byte_t *dataOut)
+{
+    int nOut = 0;  // number of bytes in the result so far
+    int run;       // number of ordinary bytes before the next special one
+
+    while (nBytes > 0)
+    {
+        run = STUFF_find(dataIn, nBytes);
+        memcpy(dataOut + nOut, dataIn, run);
+        nOut += run;
+        dataIn += run;
+        nBytes -= run;
+        if (nBytes > 0)  // stopped at a special byte
+        {
+            dataOut[nOut++] = ESCBYTE;
+            dataOut[nOut++] = (byte_t) (*dataIn++ ^ STUFF_XOR);
+            nBytes--;
+        }
+    }
+    return nOut;
+}
+
+//===================================================================
+/* STUFF_decode function - removes stuffing from a block of bytes, in place.
+   The result is never longer than the input, so runs of ordinary bytes
+   can be moved down with memmove.  An unescaped start marker means the
+   frame before it was damaged, so decoding starts again after it.
+   Returns the number of bytes after decoding, or -1 if damaged.  */
+int STUFF_decode(byte_t *data, int nBytes, int *nRestarts)
+{
+    int nIn = 0;   // number of input bytes used so far
+    int nOut = 0;  // number of bytes in the result so far
+    int run;       // number of ordinary bytes before the next special one
+    byte_t b;      // byte after an escape
+
+    while (nIn < nBytes)
+    {
+        run = STUFF_find(data + nIn, nBytes - nIn);
+        memmove(data + nOut, data + nIn, run);
+        nOut += run;
+        nIn += run;
+        if (nIn == nBytes) break;  // no more special bytes
+
+        if (data[nIn] == STARTBYTE)  // a new frame starts here
+        {
+            (*nRestarts)++;
+            nOut = 0;  // drop everything before it
+            nIn++;
+        }
+        else if ((data[nIn] == ESCBYTE) && (nIn + 1 < nBytes))
+        {
+            b = (byte_t) (data[nIn+1] ^ STUFF_XOR);
+            if (!isSpecial(b)) return -1;  // not a byte that needs escaping
+            data[nOut++] = b;
+            nIn += 2;
+        }
+        else return -1;  // end marker, or escape with nothing after it
+    }
+    return nOut;
+}
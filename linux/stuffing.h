@@ -0,0 +1,67 @@
+/* Define a type called byte_t, if not already defined.
+   This is an 8-bit variable, able to hold integers from 0 to 255.
+   It could be named "byte", but this conflicts with a definition in
+   windows.h, which is needed for the real physical layer functions. */
+#ifndef BYTE_T_DEFINED
+#define BYTE_T_DEFINED
+typedef unsigned char byte_t;  // define type "byte_t" for simplicity
+#endif
+
+
+#ifndef STUFFING_H_INCLUDED
+#define STUFFING_H_INCLUDED
+
+/*  Byte stuffing functions, so the frame markers never appear inside a frame.
+       STUFF_special   checks if a byte is a special byte
+       STUFF_find      finds the first special byte in a block
+       STUFF_encode    adds stuffing to a block of bytes
+       STUFF_decode    removes stuffing from a block of bytes
+    The special bytes are the start and end markers and the escape byte
+    (STARTBYTE, ENDBYTE and ESCBYTE in linklayer.h).  Each special byte
+    in the block is sent as ESCBYTE followed by the byte XOR STUFF_XOR,
+    which is not special.  So stuffing at most doubles the size.
+    The search for special bytes uses SSE2 or AVX2 where the processor
+    has it, so most bytes are copied in runs rather than one at a time. */
+
+#define STUFF_XOR 0x20   // pattern to change an escaped byte
+
+// Kernels - ways of finding special bytes, slowest first
+#define STUFF_SCALAR 0   // one byte at a time
+#define STUFF_SSE2 1     // 16 bytes at a time
+#define STUFF_AVX2 2     // 32 bytes at a time
+
+/* STUFF_setKernel function - selects the kernel to use, for testing.
+   If the kernel asked for is not available, the best one that is
+   available is used instead.
+   Returns the kernel that will be used. */
+int STUFF_setKernel(int kernel);
+
+/* STUFF_special function - checks if a byte is a special byte, one that
+   must be escaped inside a frame.
+   Returns TRUE (1) if it is, FALSE (0) if not. */
+int STUFF_special(byte_t b);
+
+/* STUFF_find function - finds the first special byte in a block of bytes.
+   Arguments: pointer to the bytes; number of bytes.
+   Returns the position of the first special byte,
+   or the number of bytes if there is none. */
+int STUFF_find(const byte_t *data, int nBytes);
+
+/* STUFF_encode function - adds stuffing to a block of bytes.
+   Arguments: pointer to the bytes; number of bytes;
+              pointer to array to hold the result, which must have
+              room for twice the number of bytes.
+   Returns the number of bytes in the result. */
+int STUFF_encode(const byte_t *dataIn, int nBytes, byte_t *dataOut);
+
+/* STUFF_decode function - removes stuffing from a block of bytes, in place.
+   If an unescaped start marker is found, the bytes before it are from a
+   damaged frame, so they are dropped, and decoding starts again after it.
+   Arguments: pointer to the bytes; number of bytes;
+              pointer to a counter of the times this happened.
+   Returns the number of bytes after decoding, or -1 if the bytes are
+   damaged: an unescaped end marker, or an escape byte that is last or
+   not followed by a changed special byte. */
+int STUFF_decode(byte_t *data, int nBytes, int *nRestarts);
+
+#endif // STUFFING_H_INCLUDED